@@ -1,13 +1,18 @@
 #pragma once
 
-#include "apu.h"
+#include "def.h"
+#include "blip_buffer.h"
+#include <array>
 #include <cstdint>
-#include <functional>
 #include <memory>
+#include <vector>
 
 namespace nes
 {
     class VirtualDevice;
+    class Scheduler;
+    class CPU6502;
+    class NesEmulator;
 
     namespace apu_channel
     {
@@ -28,14 +33,18 @@ namespace nes
             void SetTimerHigh(std::uint8_t val);
 
             void Step();
+            // 一次走steps步，和调用steps次Step一样
+            void Advance(std::uint32_t steps);
             void StepEnvelope();
             void StepSweep();
             std::uint8_t Output();
+            // 不管计时器走到哪，Output都是0
+            bool IsSilent() const;
 
             void Sweep();
             
             std::uint8_t channel;
-            std::uint8_t duty;
+            std::uint8_t duty = 0;
             
             bool constant_volume = false;
             std::uint8_t volume = 0;
@@ -61,8 +70,10 @@ namespace nes
             void SetTimerHigh(std::uint8_t val);
 
             void Step();
+            void Advance(std::uint32_t steps);
             void StepCounter();
             std::uint8_t Output();
+            bool IsSilent() const;
 
             std::uint16_t timer = 0;
             std::uint16_t cur_time = 0;
@@ -79,8 +90,10 @@ namespace nes
             void SetLengthCounter(std::uint8_t val);
 
             void Step();
+            void Advance(std::uint32_t steps);
             void StepEnvelope();
             std::uint8_t Output();
+            bool IsSilent() const;
 
             bool constant_volume = false;
             std::uint8_t volume = 0;
@@ -117,31 +130,45 @@ namespace nes
         struct DMC
         {
             void Step();
+            void Advance(std::uint32_t steps);
+            // 读下一个采样字节
+            void Fetch();
+            inline bool NeedFetch() const { return data.enable && data.cur_length > 0 && data.shift_count == 0; }
             std::uint8_t Output();
 
             DMCData data;
 
-            std::function<std::uint8_t(std::uint16_t)> read_callback;
+            // 采样从主线上读
+            NesEmulator* bus = nullptr;
         };
     }
 
     class APU
     {
         public:
-            APU() = default;
+            APU();
             ~APU() = default;
 
+            // 采样率用device上设置的
             void Reset();
-            void Step();
+            // APU不是每个周期都跑，CPU读写APU寄存器或者到了登记的时间点，才追到timestamp
+            void Run(std::uint64_t timestamp);
+            // 到现在为止的输出一次合成采样交给device，一帧结束的时候调用
+            void EndAudioFrame();
+
+            // 下面两个由调度器在登记的时间点调用，调用之前要先Run到那个时间点
+            void StepFrameCounter();
+            void FetchDMC();
 
             void SetRegister(std::uint16_t addr, std::uint8_t val);
             inline void SetDevice(std::shared_ptr<VirtualDevice> device) { m_device = std::move(device); }
+            inline void SetScheduler(Scheduler* scheduler) { m_scheduler = scheduler; }
             // 就能读$4015这一个。。。
             std::uint8_t ReadStatus();
 
-            // 本来硬件上APU和CPU在一块的，但是写的时候分开了，所以中断只能回调了，无奈出此下策
-            inline void SetIRQCallback(std::function<void()>&& callback) { m_trigger_IRQ = std::move(callback); }
-            inline void SetDMCReadCallback(std::function<std::uint8_t(std::uint16_t)>&& callback) { m_DMC.read_callback = std::move(callback); }
+            // 本来硬件上APU和CPU在一块的，但是写的时候分开了，所以中断直接发给CPU
+            inline void SetCPU(CPU6502* CPU) { m_CPU = CPU; }
+            inline void SetBus(NesEmulator* bus) { m_DMC.bus = bus; }
 
             // 存档使用的函数
             std::vector<char> Save() const;
@@ -149,7 +176,22 @@ namespace nes
             void Load(const std::vector<char>& data, int version);
 
         private:
-            std::function<void()> m_trigger_IRQ;
+            // 一个CPU周期
+            void Step();
+            // 一次走cycles个CPU周期，中间输出不会变，最后一个周期的输出记下来
+            void Advance(std::uint64_t cycles);
+            // 从现在开始，第几个CPU周期走完以后输出可能会变，都不会变的话返回UINT64_MAX
+            std::uint64_t GetCyclesToOutputChange() const;
+            // 混音以后的输出变了的话记到m_blip里
+            void UpdateOutput();
+
+            // 按这一轮开始的时间点和走到第几步，登记下次帧计数器走的时间点
+            void ScheduleFrameCounter();
+            // 按DMC现在的状态算出移位寄存器什么时候空，登记下一次读数据的时间点
+            void ScheduleDMCFetch();
+
+        private:
+            CPU6502* m_CPU = nullptr;
 
             apu_channel::Pulse    m_pulse1 { .channel = 1 };
             apu_channel::Pulse    m_pulse2 { .channel = 2 };
@@ -158,6 +200,9 @@ namespace nes
             apu_channel::DMC      m_DMC;
 
             std::shared_ptr<VirtualDevice> m_device;
+            Scheduler* m_scheduler = nullptr;
+            // APU已经跑到的时间点
+            std::uint64_t m_timestamp = 0;
             unsigned int m_cycles = 0;
             unsigned int m_frame_cycles = 0;
 
@@ -165,7 +210,15 @@ namespace nes
             bool m_interrupt = false;
             bool m_frame_interrupt = false;
 
-            float m_output_record = 0.0f;
-            float m_frame_counter = 0.0f;
+            // 输出的变化量都记在这里，一帧合成一次采样
+            BlipBuffer m_blip;
+            // 上次记的混音输出，单位是1 / OUTPUT_LEVEL_UNIT
+            std::int32_t m_output_level = 0;
+            // 这一帧到现在的CPU周期数
+            std::uint32_t m_audio_frame_cycles = 0;
+            std::array<std::int32_t, AUDIO_BUFFER_SAMPLES> m_audio_samples{};
+            std::array<std::int16_t, AUDIO_BUFFER_SAMPLES> m_audio_output{};
+            // 帧计数器这一轮开始的时间点，每一步的时间点都按整数周期从这里算
+            std::uint64_t m_frame_sequence_timestamp = 0;
     };
 }
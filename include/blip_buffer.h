@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+// x86-64上用SSE4.1和AVX2叠加冲激，要运行的时候看CPU支不支持
+#if defined(__x86_64__) || defined(_M_X64)
+#define NES_BLIP_HAS_SIMD 1
+#else
+#define NES_BLIP_HAS_SIMD 0
+#endif
+
+namespace nes
+{
+    // 把一个变化量乘上冲激表叠加到差分缓冲里
+    // out : KERNEL_WIDTH个差分，kernel : 这个相位的冲激表
+    using BlipAddKernelFunc = void(*)(std::int64_t* out, const std::int32_t* kernel, std::int32_t delta);
+
+    enum class BlipKernel
+    {
+        Scalar,
+        SSE41,
+        AVX2,
+    };
+
+    // 带限的阶跃合成（blip buffer）
+    // 输出变了的时候按时钟周期记一个变化量，攒够一帧以后一次按带限的冲激表合成采样，不会有点采样的混叠
+    // 时钟周期换算到采样用的是整数的分数，不会有误差累积
+    // 冲激表是多相位的加窗sinc，本身就是从时钟频率到采样率的重采样，采样率随便设
+    class BlipBuffer
+    {
+    public:
+        // 每个采样之间分成多少个相位
+        static constexpr int PHASE_BITS = 5;
+        static constexpr int PHASE_COUNT = 1 << PHASE_BITS;
+        // 一个变化量影响前后各HALF_WIDTH个采样
+        static constexpr int HALF_WIDTH = 8;
+        static constexpr int KERNEL_WIDTH = HALF_WIDTH * 2;
+        // 冲激表的和是1 << KERNEL_UNIT_BITS
+        static constexpr int KERNEL_UNIT_BITS = 15;
+        // 读的时候顺便去掉直流，每个采样积分值衰减1 / (1 << BASS_SHIFT)，44.1kHz的时候截止频率大概14Hz
+        static constexpr int BASS_SHIFT = 9;
+
+        // 按CPU支持的指令集选最快的，一个变化量叠16个64位的数，AVX2比标量快七成左右，SSE4.1快五成左右
+        static BlipKernel GetBestKernel();
+        // 这个CPU（或者编译器）不支持的返回nullptr
+        static BlipAddKernelFunc GetAddKernel(BlipKernel kernel);
+
+        // capacity是一帧最多能攒多少个采样
+        BlipBuffer(std::uint32_t clock_rate, std::uint32_t sample_rate, std::size_t capacity);
+        ~BlipBuffer() = default;
+
+        // 改采样率的时候攒着的都扔掉
+        void SetRates(std::uint32_t clock_rate, std::uint32_t sample_rate);
+        void Clear();
+        // 换一种指令集叠加冲激，结果都一样，不支持的话返回false
+        bool SetKernel(BlipKernel kernel);
+
+        // 一帧最多能有多少个时钟周期，超过的话采样就放不下了
+        inline std::uint32_t GetMaxFrameClocks() const noexcept { return m_max_frame_clocks; }
+
+        // 在这一帧的第clock_time个时钟周期，输出变了delta
+        inline void AddDelta(std::uint32_t clock_time, std::int32_t delta)
+        {
+            std::uint64_t time = m_offset + static_cast<std::uint64_t>(clock_time) * m_sample_rate;
+            std::size_t index = static_cast<std::size_t>(time / m_clock_rate);
+            std::size_t phase = static_cast<std::size_t>((time % m_clock_rate) * PHASE_COUNT / m_clock_rate);
+            AddKernel(index, phase, delta);
+        }
+
+        // 一帧结束，这一帧有clock_duration个时钟周期，这之前的采样都可以读了
+        void EndFrame(std::uint32_t clock_duration);
+        inline std::size_t GetSamplesAvailable() const noexcept { return static_cast<std::size_t>(m_offset / m_clock_rate); }
+        // 最多读count个采样，返回读到的个数，值的单位和delta一样，已经去掉了直流
+        std::size_t ReadSamples(std::int32_t* out, std::size_t count);
+
+    private:
+        void AddKernel(std::size_t index, std::size_t phase, std::int32_t delta);
+
+    private:
+        std::uint32_t m_clock_rate = 0;
+        std::uint32_t m_sample_rate = 0;
+        std::uint32_t m_max_frame_clocks = 0;
+        std::size_t m_capacity = 0;
+        // 是nullptr的话用标量的
+        BlipAddKernelFunc m_add_kernel = nullptr;
+
+        // 这一帧开始的位置，单位是1 / m_clock_rate个采样
+        std::uint64_t m_offset = 0;
+        // 存的是输出的差分，读的时候再积分，后面多留KERNEL_WIDTH个给最后几个变化量
+        std::unique_ptr<std::int64_t[]> m_buffer;
+        std::int64_t m_integrator = 0;
+    };
+}
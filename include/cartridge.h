@@ -4,7 +4,7 @@
 #include <memory>
 #include <vector>
 #include <string_view>
-#include "mappers/mapper.h"
+#include "mappers/mapper_headers.h"
 
 namespace nes
 {
@@ -18,7 +18,10 @@ namespace nes
         
         inline const std::vector<std::uint8_t>& GetPRGRom() const { return m_PRG_Rom; }
         inline const std::vector<std::uint8_t>& GetCHRRom() const { return m_CHR_Rom; }
-        inline const std::unique_ptr<Mapper>& GetMapper() { return m_mapper; }
+        // 热路径用VisitMapper按具体类型调用，存档这种不在乎快慢的地方直接用基类指针
+        inline MapperVariant& GetMapper() noexcept { return m_mapper; }
+        inline Mapper* GetMapperInterface() { return VisitMapper(m_mapper, [](Mapper& mapper) -> Mapper* { return &mapper; }); }
+        inline std::uint8_t* GetPRGRam() { return m_PRG_Ram.get(); }
         inline std::uint8_t ReadPRGRam(std::uint16_t address)
         {
             if(m_PRG_Ram)  return m_PRG_Ram[address];
@@ -54,7 +57,7 @@ namespace nes
         unsigned int m_mapper_id = 0;
 
         std::unique_ptr<std::uint8_t[]> m_trainer = nullptr;
-        std::unique_ptr<Mapper> m_mapper = nullptr;
+        MapperVariant m_mapper;
         std::unique_ptr<std::uint8_t[]> m_PRG_Ram = nullptr;
         std::vector<std::uint8_t> m_PRG_Rom;
         std::vector<std::uint8_t> m_CHR_Rom;
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+namespace nes
+{
+    // 解码好的8x8 tile，每个像素是0到3的颜色，一行8个
+    struct DecodedTile
+    {
+        std::array<std::uint8_t, 64> pixels;
+        // 左右翻转的，给翻转的精灵用
+        std::array<std::uint8_t, 64> flipped;
+    };
+
+    // 图案表的tile用到的时候才解码，解码以后一直留着
+    // 下标按tile在CHR ROM（后面接着CHR RAM）里的位置算，换bank只是换了下标，不用重新解码
+    class CHRTileCache
+    {
+    public:
+        CHRTileCache() = default;
+        ~CHRTileCache() = default;
+
+        // 换卡带的时候按CHR ROM加CHR RAM的大小重新分配，全部作废
+        void Resize(std::size_t tile_count);
+        void Clear();
+        // 写了CHR RAM以后那个tile要重新解码
+        inline void Invalidate(std::size_t index) { if (index < m_tile_count) m_valid[index] = 0; }
+
+        // 下标为index的tile，data是它的16字节，还没解码的话现在解码
+        inline const DecodedTile& Get(std::size_t index, const std::uint8_t* data)
+        {
+            if (!m_valid[index])
+                Decode(index, data);
+            return m_tiles[index];
+        }
+
+    private:
+        void Decode(std::size_t index, const std::uint8_t* data);
+
+    private:
+        std::unique_ptr<DecodedTile[]> m_tiles;
+        std::unique_ptr<std::uint8_t[]> m_valid;
+        std::size_t m_tile_count = 0;
+    };
+}
@@ -1,11 +1,22 @@
 #pragma once
 
-#include <functional>
 #include <vector>
 #include <cstdint>
+#include "cpu_block_cache.h"
+#include "cpu_jit.h"
+
+// 线程化分派要用computed goto（标签的地址），GCC和Clang才有，其他编译器只能用switch
+#if defined(__GNUC__)
+#define NES_CPU_HAS_THREADED_DISPATCH 1
+#else
+#define NES_CPU_HAS_THREADED_DISPATCH 0
+#endif
 
 namespace nes
 {
+    class Scheduler;
+    class NesEmulator;
+
     enum class CPU6502InterruptType
     {
         IRQ,
@@ -25,32 +36,83 @@ namespace nes
 
         // 初始化
         void Reset();
-        // 单步执行
+        // 单步执行（一个周期）
         void Step();
+        // 按整条指令执行，直到主时钟到了deadline，或者调度器里有事件要在下一条指令之前处理
+        // 最后一条指令会执行完，所以主时钟可能会超过deadline几个周期
+        // 用哪种分派由编译选项NES_CPU_BLOCK_CACHE和NES_CPU_THREADED_DISPATCH决定
+        inline void RunUntil(std::uint64_t deadline)
+        {
+#if defined(NES_CPU_BLOCK_CACHE) || defined(NES_CPU_JIT)
+            RunUntilCached(deadline);
+#elif defined(NES_CPU_THREADED_DISPATCH)
+            RunUntilThreaded(deadline);
+#else
+            RunUntilSwitch(deadline);
+#endif
+        }
+        // 两种分派都编译进来，方便对比性能
+        // 每条指令都走ExecuteCode里的那一个switch
+        void RunUntilSwitch(std::uint64_t deadline);
+        // 每条指令执行完直接跳到下一条指令，编译器不支持的时候就是RunUntilSwitch
+        void RunUntilThreaded(std::uint64_t deadline);
+        // PRG ROM里的代码按块解码缓存起来，执行的时候不用再取指令和操作数
+        // 打开JIT的话，热的块再翻译成机器码执行
+        void RunUntilCached(std::uint64_t deadline);
+
+        // 运行的时候也可以关掉JIT，关掉以后RunUntilCached就只用解码缓存
+        // 平台不支持或者申请不到可执行内存的时候打开也没用
+        void SetJITEnabled(bool enabled);
+        inline bool IsJITEnabled() const noexcept { return m_JIT != nullptr && m_JIT->IsAvailable(); }
         // 设置中断
-        void Interrupt(CPU6502InterruptType type);
+        inline void Interrupt(CPU6502InterruptType type) { m_current_interrupt |= (1 << static_cast<int>(type)); }
         
-        inline void PushStack(std::uint8_t value) { m_main_bus_write(0x100 | m_SP--, value); }
-        inline std::uint8_t PullStack() { return m_main_bus_read(0x100 | ++m_SP); }
+        void PushStack(std::uint8_t value);
+        std::uint8_t PullStack();
 
-        // 设置从总线读写ram或者mapper的回调
-        inline void SetReadFunction(std::function<std::uint8_t(std::uint16_t)>&& callback) { m_main_bus_read = std::move(callback); }
-        inline void SetWriteFunction(std::function<void(std::uint16_t, std::uint8_t)>&& callback) { m_main_bus_write = std::move(callback); }
+        // 直接调用模拟器的MainBusRead/MainBusWrite读写主线，这两个函数写在emulator.h里，CPU这边能内联
+        void SetBus(NesEmulator* bus);
 
         void SkipOAMDMACycle();
+        // 总线访问了寄存器（可能登记了新的事件、来了中断或者开始了OAMDMA），RunUntilThreaded要在这条指令之后马上重新检查
+        inline void EndDispatchBatch() noexcept { m_batch_end = 0; }
+
+        // CPU执行的时候顺便推进主时钟
+        inline void SetScheduler(Scheduler* scheduler) { m_scheduler = scheduler; }
+
+        inline std::uint64_t GetCycles() const noexcept { return m_cycles; }
 
         // 获取状态寄存器
         inline bool GetC() const { return m_P & 0x01; }
-        inline bool GetZ() const { return m_P & 0x02; }
+        inline bool GetZ() const { return m_Z_value == 0; }
         inline bool GetI() const { return m_P & 0x04; }
         inline bool GetB() const { return m_P & 0x10; }
         inline bool GetV() const { return m_P & 0x40; }
-        inline bool GetN() const { return m_P & 0x80; }
+        inline bool GetN() const { return m_N_value & 0x80; }
+        // 完整的状态寄存器，N和Z要从最后的结果算出来
+        inline std::uint8_t GetP() const
+        {
+            return (m_P & 0x7d) | (m_N_value & 0x80) | (m_Z_value == 0 ? 0x02 : 0x00);
+        }
+        inline void SetP(std::uint8_t value)
+        {
+            m_P = value;
+            m_N_value = value;
+            m_Z_value = ~value & 0x02;
+        }
         inline void SetFlag(std::uint8_t value, bool set)
         {
+            // N和Z不在m_P里，只能整个算出来再写回去
+            if (value & 0x82)
+            {
+                SetP(set ? (GetP() | value) : (GetP() & ~value));
+                return;
+            }
             if (set) m_P |= value;
             else     m_P &= ~value;
         }
+        // 大部分指令只是按结果设置N和Z，先把结果记下来，用到的时候再算
+        inline void SetNZ(std::uint8_t result) { m_N_value = m_Z_value = result; }
 
         // 存档使用的函数
         std::vector<char> Save() const;
@@ -59,8 +121,18 @@ namespace nes
 
     private:
         std::uint16_t ReadAddress(std::uint16_t start_address);
+        // 指令边界上检查中断，然后进中断或者执行一条指令，所有读写都在这里做完
+        void ExecuteInstruction();
+        // 执行完一条指令（或者进中断）以后，把剩下的周期算上
+        void FinishInstruction();
+        // 下一条指令之前要不要进中断
+        bool HasPendingInterrupt() const;
         void InterruptExecute(CPU6502InterruptType type);
         void ExecuteCode(std::uint8_t op_code);
+        // 执行解码缓存里的一条指令，PC已经跳过这条指令了
+        template<std::uint8_t op_code>
+        void ExecuteDecoded(std::uint16_t operand);
+        static DecodedInstruction::Execute GetDecodedExecute(std::uint8_t op_code);
 
         template<typename Addr, typename R, typename... Args>
         void CombineAddressingAndInstruction(R(CPU6502::*)(Args...), Addr);
@@ -86,6 +158,21 @@ namespace nes
         std::uint16_t IndirectY();
         std::uint16_t Relative();
 
+        // 操作数已经读出来的时候用这些，只算地址
+        int           Implied(std::uint16_t operand);
+        std::uint8_t  Immediate(std::uint16_t operand);
+        std::uint16_t Absolute(std::uint16_t operand);
+        std::uint16_t ZeroPage(std::uint16_t operand);
+        std::uint8_t  Accumulator(std::uint16_t operand);
+        std::uint16_t AbsoluteX(std::uint16_t operand);
+        std::uint16_t AbsoluteY(std::uint16_t operand);
+        std::uint16_t ZeroPageX(std::uint16_t operand);
+        std::uint16_t ZeroPageY(std::uint16_t operand);
+        std::uint16_t Indirect(std::uint16_t operand);
+        std::uint16_t IndirectX(std::uint16_t operand);
+        std::uint16_t IndirectY(std::uint16_t operand);
+        std::uint16_t Relative(std::uint16_t operand);
+
         // 所有指令
         // 根据寻址模式通过编译期选择对应的函数，所以参数和返回值会有所不同
         void         ADC(std::uint8_t  src);
@@ -175,8 +262,12 @@ namespace nes
         std::uint16_t m_PC = 0;
         // 栈顶指针，地址为0x0100+S
         std::uint8_t m_SP = 0xfd;
-        // 处理器状态， N V 1 B D I Z C
+        // 处理器状态， N V 1 B D I Z C，其中N和Z不一定是最新的，要用GetP()
         std::uint8_t m_P = 0x24;
+        // 决定N的值，第7位就是N
+        std::uint8_t m_N_value = 0x00;
+        // 决定Z的值，为0的时候Z是1
+        std::uint8_t m_Z_value = 0x01;
         // 累加器
         std::uint8_t m_A = 0;
         // X变址寄存器
@@ -198,10 +289,18 @@ namespace nes
 
         // 总的周期数
         std::uint64_t m_cycles = 0;
+        // RunUntilThreaded这一批跑到主时钟的这个时间点为止
+        std::uint64_t m_batch_end = 0;
+
+        Scheduler* m_scheduler = nullptr;
+        NesEmulator* m_bus = nullptr;
 
-        std::function<std::uint8_t(std::uint16_t)> m_main_bus_read;
-        std::function<void(std::uint16_t, std::uint8_t)> m_main_bus_write;
+        CPU6502BlockCache m_block_cache;
+        // 没打开JIT的时候是空的
+        std::unique_ptr<CPU6502JIT> m_JIT = nullptr;
 
         friend class CPU6502Disassembly;
+        friend class CPU6502BlockCache;
+        friend class CPU6502JIT;
     };
 }
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+
+namespace nes
+{
+    class CPU6502;
+    struct MemoryMap;
+
+    // 解码好的一条指令，操作数已经从ROM里读出来了
+    struct DecodedInstruction
+    {
+        using Execute = void(*)(CPU6502&, std::uint16_t);
+
+        Execute execute = nullptr;
+        std::uint16_t operand = 0;
+        std::uint8_t length = 0;
+        std::uint8_t op_code = 0;
+    };
+
+    // 一段连续执行的指令，碰到会改PC的指令或者到了页的边界就结束
+    struct DecodedBlock
+    {
+        static constexpr std::size_t MAX_INSTRUCTIONS = 16;
+
+        // 第一条指令在ROM里的位置，同一个PC换了bank以后指向的ROM不一样，所以不用另外记bank
+        const std::uint8_t* code = nullptr;
+        std::uint8_t count = 0;
+        std::array<DecodedInstruction, MAX_INSTRUCTIONS> instructions;
+    };
+
+    // PRG ROM里的代码解码一次以后就存起来，热循环不用每次都重新取指令和操作数
+    // 只缓存只读的页（PRG ROM），内存和PRG RAM里的代码可能会被改，还是一条一条解释
+    class CPU6502BlockCache
+    {
+    public:
+        static constexpr std::size_t BLOCK_COUNT = 2048;
+
+        CPU6502BlockCache();
+        ~CPU6502BlockCache() = default;
+
+        inline void SetMemoryMap(const MemoryMap* memory_map) { m_memory_map = memory_map; }
+        // 换卡带以后ROM的地址可能会重复，所以要全部清掉
+        void Clear();
+
+        // 从PC开始的块，没有缓存就现在解码，PC不在ROM里返回nullptr
+        const DecodedBlock* GetBlock(std::uint16_t PC);
+
+    private:
+        const MemoryMap* m_memory_map = nullptr;
+        // 按PC的低位直接映射
+        std::unique_ptr<DecodedBlock[]> m_blocks;
+    };
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <array>
+#include <string_view>
+
 #ifdef _CPU6502_ALL_INSTRUCTIONS_
 #undef _CPU6502_ALL_INSTRUCTIONS_
 #endif
@@ -269,3 +272,55 @@ OPERATION(0xfe, INC, AbsoluteX,   7) \
 OPERATION(0xff, ISC, AbsoluteX,   7) \
 
 
+namespace nes
+{
+    // 各种寻址方式的指令长度（包括指令码）
+    constexpr int GetImmediateLength()   { return 2; }
+    constexpr int GetAbsoluteLength()    { return 3; }
+    constexpr int GetZeroPageLength()    { return 2; }
+    constexpr int GetImpliedLength()     { return 1; }
+    constexpr int GetAccumulatorLength() { return 1; }
+    constexpr int GetAbsoluteXLength()   { return 3; }
+    constexpr int GetAbsoluteYLength()   { return 3; }
+    constexpr int GetZeroPageXLength()   { return 2; }
+    constexpr int GetZeroPageYLength()   { return 2; }
+    constexpr int GetIndirectLength()    { return 3; }
+    constexpr int GetIndirectXLength()   { return 2; }
+    constexpr int GetIndirectYLength()   { return 2; }
+    constexpr int GetRelativeLength()    { return 2; }
+
+    constexpr auto GetAllInstructionLength()
+    {
+        std::array<int, 256> result{};
+
+        #define OPERATION(op_code_, instruction_, addressing_, ...) \
+            result[op_code_] = Get##addressing_##Length(); \
+
+        CPU6502_ALL_INSTRUCTIONS
+
+        #undef OPERATION
+
+        return result;
+    }
+
+    // 跳转、分支、中断返回之类会改PC的指令，还有没实现的XXX，执行完以后下一条不一定在后面
+    constexpr auto GetAllInstructionChangesPC()
+    {
+        std::array<bool, 256> result{};
+
+        #define OPERATION(op_code_, instruction_, addressing_, ...) \
+            result[op_code_] = std::string_view(#addressing_) == "Relative" || std::string_view(#instruction_) == "JMP" \
+                || std::string_view(#instruction_) == "JSR" || std::string_view(#instruction_) == "RTS" \
+                || std::string_view(#instruction_) == "RTI" || std::string_view(#instruction_) == "BRK" \
+                || std::string_view(#instruction_) == "XXX"; \
+
+        CPU6502_ALL_INSTRUCTIONS
+
+        #undef OPERATION
+
+        return result;
+    }
+
+    constexpr std::array<int, 256>  ALL_INSTRUCTION_LENGTH     = GetAllInstructionLength();
+    constexpr std::array<bool, 256> ALL_INSTRUCTION_CHANGES_PC = GetAllInstructionChangesPC();
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+// 只有x86-64并且不是Windows（调用约定不一样）的时候才能生成机器码，其他情况CPU6502JIT什么都不编译
+#if defined(__x86_64__) && !defined(_WIN32)
+#define NES_CPU_HAS_JIT 1
+#else
+#define NES_CPU_HAS_JIT 0
+#endif
+
+namespace nes
+{
+    class CPU6502;
+    struct DecodedBlock;
+    struct MemoryMap;
+
+    // 把解码缓存里执行次数多的块翻译成x86-64机器码
+    // 寄存器、标志位（N和Z也是懒算的）、内存和ROM的读写、跳页和分支的周期都直接生成机器码，中间不回到C++
+    // 访问寄存器的页（页表里指针是空的）、会改中断状态的指令（CLI、PLP、RTI、BRK）和非法指令不翻译，
+    // 走到这些地方就停下来，让解释器执行这一条
+    // 块的中间不检查时间和事件，所以只有最坏情况下整个块跑完也不会到deadline、也不会有事件的时候才能进来
+    class CPU6502JIT
+    {
+    public:
+        // 机器码的入口，从块的第一条指令开始执行，m_PC会设成停下来的位置
+        // 返回值低32位是执行了多少个周期（m_cycles和主时钟都还没加），第32位是1的话表示停在了一条要解释执行的指令上
+        using Entry = std::uint64_t(*)(CPU6502* CPU, const MemoryMap* memory_map);
+
+        static constexpr std::uint64_t INTERPRET_NEXT = 1ull << 32;
+        static constexpr std::size_t BLOCK_COUNT = 2048;
+        // 一个块执行这么多次以后才翻译
+        static constexpr std::uint32_t HOT_THRESHOLD = 16;
+        static constexpr std::size_t CODE_BUFFER_SIZE = 2 * 1024 * 1024;
+
+        struct CompiledBlock
+        {
+            // ROM的位置一样PC也可能不一样（NROM-128的$8000和$C000、MMC3换PRG模式），机器码里写死了PC，所以两个都要对上
+            const std::uint8_t* code = nullptr;
+            std::uint16_t PC = 0;
+            Entry entry = nullptr;
+            // 除了最后一条（或者第一条不翻译的）指令，前面的指令最坏情况下一共多少个周期
+            // 解释器在这些指令之后都会检查时间和事件，机器码不检查，所以进来之前要保证这段时间里不会停
+            std::uint32_t guard_cycles = 0;
+            std::uint32_t count = 0;
+        };
+
+        // CPU6502里各个寄存器相对于对象开头的偏移，生成的机器码按这个直接读写
+        struct Offsets
+        {
+            std::int32_t PC = 0;
+            std::int32_t SP = 0;
+            std::int32_t P = 0;
+            std::int32_t N_value = 0;
+            std::int32_t Z_value = 0;
+            std::int32_t A = 0;
+            std::int32_t X = 0;
+            std::int32_t Y = 0;
+            std::int32_t cross_page = 0;
+        };
+
+        explicit CPU6502JIT(const CPU6502& CPU);
+        ~CPU6502JIT();
+
+        // 申请可执行内存失败（或者不支持的平台）的话就不能用，CPU还是用解释器
+        inline bool IsAvailable() const noexcept { return m_code_buffer != nullptr; }
+        void Clear();
+
+        // 块的机器码，还不够热或者翻译失败的时候返回nullptr
+        const CompiledBlock* GetBlock(const DecodedBlock* block, std::uint16_t PC);
+
+    private:
+        bool Compile(const DecodedBlock* block, std::uint16_t PC, CompiledBlock& compiled);
+
+        Offsets m_offsets;
+        std::unique_ptr<CompiledBlock[]> m_blocks;
+        std::uint8_t* m_code_buffer = nullptr;
+        std::size_t m_code_size = 0;
+    };
+}
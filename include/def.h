@@ -36,14 +36,26 @@ namespace nes
         Player2,
     };
 
+    // 默认的采样率，实际用的是声卡给的
     constexpr int AUDIO_FREQ = 44100;
     constexpr int AUDIO_BUFFER_SAMPLES = 2048;
+    constexpr int AUDIO_MIN_FREQ = 8000;
+    constexpr int AUDIO_MAX_FREQ = 192000;
+
+    // 输出给声卡的样本格式，都是单声道
+    enum class AudioFormat
+    {
+        U8,
+        S16,
+        F32,
+    };
     constexpr int NTSC_CPU_FREQUENCY = 1789773;
-    constexpr int NTSC_FRAME_FREQUENCY = 240;
 
     // 存档文件用的魔法数 (其实这个数使用numpy随机生成的)
     constexpr int SAVE_MAGIC_NUMBER = 1098186332;
-    constexpr int SAVE_VERSION = 0;
+    // 1 : APU的帧计数器改成存这一轮开始以后的周期数
+    // 2 : APU的帧计数器改成存离下一步还有多少个周期（有符号），1的时候一轮刚走完存出来的数是绕回去的
+    constexpr int SAVE_VERSION = 2;
 
     enum class EmulatorOperation
     {
@@ -79,6 +91,11 @@ namespace nes
     {
         int Scale = 3;
         int JoystickDeadZone = 8000;
+        // 1的话PPU输出调色板索引，每帧显示之前再转成颜色（支持强调位）
+        int PaletteIndexFrame = 0;
+        // 想要的样本格式和采样率，声卡不支持这个采样率的话用声卡给的
+        AudioFormat AudioSampleFormat = AudioFormat::S16;
+        int AudioFrequency = 48000;
     };
 
     struct Config
@@ -3,6 +3,8 @@
 #include "cpu.h"
 #include "ppu.h"
 #include "apu.h"
+#include "scheduler.h"
+#include "memory_map.h"
 #include <memory>
 #include <atomic>
 #include <concepts>
@@ -23,6 +25,20 @@ namespace nes
         void PutInCartridge(std::unique_ptr<Cartridge> cartridge);
         void Run(const bool& running);
 
+        // 上电初始化，Run里面会自己调用
+        void Reset();
+        // 下面两个不看时间也不sleep，有多快跑多快，给批量运行、性能测试之类用的
+        // 一直跑到当前这一帧结束
+        void RunFrame();
+        // 跑cycles个CPU周期，中间完成了一帧就返回true
+        // CPU按整条指令跑，最后一条指令超出去的周期会在下次调用的时候扣掉
+        bool RunCycles(std::uint64_t cycles);
+
+        inline std::uint64_t GetFrame() const noexcept { return m_frame; }
+        inline std::uint64_t GetCycles() const noexcept { return m_CPU.GetCycles(); }
+        // 编译的时候打开了NES_CPU_JIT才会走JIT，运行的时候可以关掉换回解释器
+        inline void SetJITEnabled(bool enabled) { m_CPU.SetJITEnabled(enabled); }
+
         inline void SetVirtualDevice(std::shared_ptr<VirtualDevice> device)
         { 
             m_device = device;
@@ -37,9 +53,36 @@ namespace nes
         void SetOperation(EmulatorOperation operation);
         const std::string& GetCartridgeFilename() const noexcept { return m_cartridge->GetFileName(); }
 
-    private:
+        // CPU和DMC读写主线，CPU每条指令都要走好几次，所以写在头文件里让CPU那边能内联
+        // 内存和ROM直接查页表，页表里没有的（寄存器之类）才走MainBusReadSlow/MainBusWriteSlow
         std::uint8_t MainBusRead(std::uint16_t address);
         void MainBusWrite(std::uint16_t address, std::uint8_t value);
+        // CPU的解码缓存要直接看页表
+        inline const MemoryMap& GetMemoryMap() const noexcept { return m_memory_map; }
+
+    private:
+        // CPU按整条指令一直跑到主时钟到了timestamp，中间有事件到期就停下来处理，完成了一帧就返回true
+        // stop_at_frame_end的话一帧结束就马上返回
+        bool RunUntil(std::uint64_t timestamp, bool stop_at_frame_end);
+        // 和上面的RunCycles一样，stop_at_frame_end的话一帧结束就马上返回，剩下的周期下次调用的时候接着跑
+        bool RunCycles(std::uint64_t cycles, bool stop_at_frame_end);
+        // 处理快捷操作，只在一帧结束之后调用
+        void HandleOperation();
+
+        // 处理时间点在until之前的事件，一帧结束了就先停下来返回true，剩下的事件留到下次
+        bool RunEvents(std::uint64_t until);
+
+        // PPU不是每个周期都跑，CPU能看到PPU的时候（读写PPU寄存器、OAMDMA、换bank、NMI、IRQ、一帧结束）才追上来
+        // CPU周期内调用的时候要追到这个周期结束，因为原来是每个周期先跑PPU再跑CPU
+        void SyncPPU(std::uint64_t timestamp);
+        inline void SyncPPU() { SyncPPU(m_scheduler.GetTimestamp() + CPU_CLOCK_DIVIDER); }
+        // PPU状态或mapper状态变了之后，重新登记一下下次必须同步的时间点
+        void UpdatePPUSyncPoint();
+        // APU也一样，CPU读写APU寄存器或者APU自己登记的时间点到了才追上来
+        inline void SyncAPU(std::uint64_t timestamp) { m_APU.Run(timestamp); }
+
+        std::uint8_t MainBusReadSlow(std::uint16_t address);
+        void MainBusWriteSlow(std::uint16_t address, std::uint8_t value);
 
         std::string GetSavePath() const;
 
@@ -49,6 +92,7 @@ namespace nes
     private:
         std::unique_ptr<Cartridge> m_cartridge = nullptr;
         std::unique_ptr<std::uint8_t[]> m_RAM  = nullptr;
+        MemoryMap m_memory_map;
 
         std::shared_ptr<VirtualDevice> m_device = nullptr;
 
@@ -56,8 +100,31 @@ namespace nes
         std::uint64_t m_frame = 0;
         std::function<void(void)> m_screenshot_callback;
 
+        Scheduler m_scheduler;
+        // PPU已经跑到的时间点
+        std::uint64_t m_PPU_timestamp = 0;
+        // RunCycles要跑到的时间点，CPU多跑的周期下次从这里扣
+        std::uint64_t m_target_timestamp = 0;
+
         CPU6502 m_CPU;
         PPU     m_PPU;
         APU     m_APU;
     };
+
+    inline std::uint8_t NesEmulator::MainBusRead(std::uint16_t address)
+    {
+        auto page = m_memory_map.read[address >> MEMORY_PAGE_SHIFT];
+        if (page != nullptr) [[likely]]
+            return page[address & (MEMORY_PAGE_SIZE - 1)];
+        return MainBusReadSlow(address);
+    }
+
+    inline void NesEmulator::MainBusWrite(std::uint16_t address, std::uint8_t value)
+    {
+        auto page = m_memory_map.write[address >> MEMORY_PAGE_SHIFT];
+        if (page != nullptr) [[likely]]
+            page[address & (MEMORY_PAGE_SIZE - 1)] = value;
+        else
+            MainBusWriteSlow(address, value);
+    }
 }
@@ -7,6 +7,10 @@
 namespace nes
 {
     class Cartridge;
+    class Scheduler;
+    class CPU6502;
+    struct MemoryMap;
+    struct CHRMap;
 
     class Mapper
     {
@@ -14,24 +18,46 @@ namespace nes
         Mapper(Cartridge* cartridge) : m_cartridge(cartridge) {}
         virtual ~Mapper() = default;
 
-        virtual std::uint8_t ReadPRG(std::uint16_t address) = 0;
         virtual void WritePRG(std::uint16_t address, std::uint8_t value) = 0;
-        virtual std::uint8_t ReadCHR(std::uint16_t address) = 0;
-        virtual void WriteCHR(std::uint16_t address, std::uint8_t value) = 0;
 
         virtual bool HasExtendPRGRam() const { return false; }
         void OnMirroringChanged(std::function<void(MirroringType)>&& callback) { m_on_morroring_changed = std::move(callback); }
-        virtual void SetTriggerIRQCallback(std::function<void(void)>&& callback) {}
+        // 有IRQ的mapper直接发给CPU
+        void SetCPU(CPU6502* CPU) { m_CPU = CPU; }
         virtual void ReduceIRQCounter() {}
-        virtual void CPUCycleCounter() {}
+        // ReduceIRQCounter会不会触发IRQ，会的话PPU每条扫描线都要和CPU同步一下
+        virtual bool IsScanlineIRQEnabled() const { return false; }
+        // 按CPU周期数的IRQ不再每个周期去数，mapper把触发时间登记到调度器，到时间了调用OnScheduledIRQ
+        void SetScheduler(Scheduler* scheduler) { m_scheduler = scheduler; }
+        virtual void OnScheduledIRQ() {}
+        // CPU读PRG ROM直接走页表，mapper换bank的时候把PRG ROM重新映射上去
+        void SetMemoryMap(MemoryMap* memory_map);
+        // PPU读写图案表也直接按指针，mapper换CHR bank的时候重新映射
+        void SetCHRMap(CHRMap* CHR_map);
 
         // 存档使用的函数
         virtual std::vector<char> Save() const = 0;
         virtual std::size_t GetSaveFileSize(int version) const noexcept = 0;
         virtual void Load(const std::vector<char>& data, int version) = 0;
 
+    protected:
+        // 按现在的bank把PRG ROM映射到页表上
+        virtual void UpdatePRGMap() = 0;
+        // 把CPU地址[address, address + size)映射到PRG ROM的offset处
+        void MapPRG(std::uint16_t address, std::size_t size, std::size_t offset);
+        // 按现在的bank把CHR ROM（或者CHR RAM）映射到PPU的图案表上
+        virtual void UpdateCHRMap() = 0;
+        // 把PPU地址[address, address + size)映射到CHR ROM的offset处，只读
+        void MapCHR(std::uint16_t address, std::size_t size, std::size_t offset);
+        // 把PPU地址[address, address + size)映射到CHR RAM的offset处，可以写
+        void MapCHRRam(std::uint16_t address, std::size_t size, std::uint8_t* ram, std::size_t offset);
+
     protected:
         Cartridge* m_cartridge;
+        Scheduler* m_scheduler = nullptr;
+        CPU6502* m_CPU = nullptr;
+        MemoryMap* m_memory_map = nullptr;
+        CHRMap* m_CHR_map = nullptr;
         std::function<void(MirroringType)> m_on_morroring_changed;
     };
 }
@@ -5,16 +5,13 @@
 
 namespace nes
 {
-    class Mapper1 : public Mapper
+    class Mapper1 final : public Mapper
     {
     public:
         Mapper1(Cartridge* cartridge);
         ~Mapper1() = default;
 
-        std::uint8_t ReadPRG(std::uint16_t address) override;
         void WritePRG(std::uint16_t address, std::uint8_t value) override;
-        std::uint8_t ReadCHR(std::uint16_t address) override;
-        void WriteCHR(std::uint16_t address, std::uint8_t value) override;
 
         bool HasExtendPRGRam() const override { return true; }
 
@@ -29,6 +26,10 @@ namespace nes
         std::size_t GetSaveFileSize(int version) const noexcept override;
         void Load(const std::vector<char>& data, int version) override;
     
+    protected:
+        void UpdatePRGMap() override;
+        void UpdateCHRMap() override;
+
     private:
         std::uint8_t m_shift_register = 0x10;
         std::uint8_t m_control = 0x0c;
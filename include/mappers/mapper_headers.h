@@ -6,3 +6,26 @@
 #include "mappers/mapper3.h"
 #include "mappers/mapper4.h"
 #include "mappers/mapper65.h"
+#include <type_traits>
+#include <variant>
+
+namespace nes
+{
+    // 支持的mapper就这几个，放在variant里，调用的时候编译期就知道是哪个类，不用走虚函数
+    // monostate表示还没有创建mapper
+    using MapperVariant = std::variant<std::monostate, Mapper0, Mapper1, Mapper2, Mapper3, Mapper4, Mapper65>;
+
+    // 对具体的mapper调用func，没有mapper的时候返回默认值
+    template<typename Func>
+    inline decltype(auto) VisitMapper(MapperVariant& mapper, Func&& func)
+    {
+        using Result = std::invoke_result_t<Func, Mapper0&>;
+        return std::visit([&func](auto& m) -> Result
+        {
+            if constexpr (std::is_same_v<std::remove_cvref_t<decltype(m)>, std::monostate>)
+                return Result();
+            else
+                return func(m);
+        }, mapper);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace nes
+{
+    // CPU地址空间按1KB分页
+    constexpr std::uint16_t MEMORY_PAGE_SHIFT = 10;
+    constexpr std::uint16_t MEMORY_PAGE_SIZE = 1 << MEMORY_PAGE_SHIFT;
+    constexpr std::size_t MEMORY_PAGE_COUNT = 0x10000 >> MEMORY_PAGE_SHIFT;
+
+    // CPU的页表，每页记一个读指针和一个写指针
+    // 内存和ROM直接按指针读写，指针为空的页（PPU/APU寄存器、mapper寄存器、没有的内存）才走慢的那条路
+    struct MemoryMap
+    {
+        std::array<const std::uint8_t*, MEMORY_PAGE_COUNT> read{};
+        std::array<std::uint8_t*, MEMORY_PAGE_COUNT> write{};
+        // 读的映射每改一次就加一，CPU执行解码缓存里的代码的时候用它判断是不是换了bank
+        std::uint32_t generation = 0;
+
+        // 把[address, address + size)映射到data上，size是页大小的整数倍
+        inline void MapRead(std::uint16_t address, std::size_t size, const std::uint8_t* data)
+        {
+            ++generation;
+            for (std::size_t i = 0; i < size; i += MEMORY_PAGE_SIZE)
+                read[(address + i) >> MEMORY_PAGE_SHIFT] = data == nullptr ? nullptr : data + i;
+        }
+        inline void MapWrite(std::uint16_t address, std::size_t size, std::uint8_t* data)
+        {
+            for (std::size_t i = 0; i < size; i += MEMORY_PAGE_SIZE)
+                write[(address + i) >> MEMORY_PAGE_SHIFT] = data == nullptr ? nullptr : data + i;
+        }
+    };
+
+    // PPU的图案表[0, 0x2000)也按1KB分页，mapper换CHR bank的时候更新
+    constexpr std::size_t CHR_PAGE_COUNT = 0x2000 >> MEMORY_PAGE_SHIFT;
+    // 一个tile 16字节，一页64个
+    constexpr std::size_t CHR_TILE_SIZE = 16;
+    // 没有CHR ROM的卡带用的CHR RAM
+    constexpr std::size_t CHR_RAM_SIZE = 0x2000;
+
+    struct CHRMap
+    {
+        std::array<const std::uint8_t*, CHR_PAGE_COUNT> read{};
+        // CHR ROM的页是空的，写了也没用
+        std::array<std::uint8_t*, CHR_PAGE_COUNT> write{};
+        // 这一页第一个tile在CHRTileCache里的下标，CHR ROM的tile在前面，CHR RAM的接在后面
+        std::array<std::uint32_t, CHR_PAGE_COUNT> tile{};
+        // 映射每改一次就加一，PPU用它判断画好的精灵是不是换了bank
+        std::uint32_t generation = 0;
+    };
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 
 namespace nes
 {
@@ -34,4 +35,13 @@ namespace nes
         { 204, 210, 120, 255 }, { 180, 222, 120, 255 }, { 168, 226, 144, 255 }, { 152, 226, 180, 255 }, 
         { 160, 214, 228, 255 }, { 160, 162, 160, 255 }, { 0, 0, 0, 255 }, { 0, 0, 0, 255 }
     };
+
+    // 调色板颜色按屏幕缓冲的字节顺序（B G R A）拼成一个32位的数
+    inline std::uint32_t ToScreenColor(const PaletteColor& color)
+    {
+        const std::uint8_t bytes[4] = { color.b, color.g, color.r, color.a };
+        std::uint32_t res;
+        std::memcpy(&res, bytes, sizeof(res));
+        return res;
+    }
 }
@@ -1,39 +1,20 @@
 #pragma once
 
 #include <array>
-#include <functional>
 #include <memory>
 #include <vector>
-#include <coroutine>
 #include <cstdint>
 #include "def.h"
+#include "memory_map.h"
+#include "chr_tile_cache.h"
+#include "ppu_compose.h"
+#include "mappers/mapper_headers.h"
 
 namespace nes
 {
     class Cartridge;
     class VirtualDevice;
-
-    // PPU协程返回用
-    struct PPUCycleCoro
-    {
-        struct promise_type
-        {
-            auto get_return_object() { return std::coroutine_handle<promise_type>::from_promise(*this); }
-            auto initial_suspend() noexcept { return std::suspend_always{}; }
-            auto final_suspend() noexcept { return std::suspend_always{}; }
-            void return_void() { }
-            void unhandled_exception() {}
-        };
-
-        PPUCycleCoro(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
-        PPUCycleCoro(const PPUCycleCoro&) = delete;
-        PPUCycleCoro& operator= (const PPUCycleCoro&) = delete;
-        PPUCycleCoro(PPUCycleCoro&& other) : m_handle(other.m_handle) { other.m_handle = nullptr; }
-        PPUCycleCoro& operator= (PPUCycleCoro&& other) { m_handle = other.m_handle; other.m_handle = nullptr; return *this; }
-        ~PPUCycleCoro() { if (m_handle) m_handle.destroy(); }
-
-        std::coroutine_handle<promise_type> m_handle;
-    };
+    class CPU6502;
 
     enum class PPUScanlineType
     {
@@ -50,18 +31,26 @@ namespace nes
         ~PPU();
 
         void Reset();
-        void Step();
+        // 连续走dots个点
+        void Run(std::uint32_t dots);
+        // 从当前位置开始，至少还要走多少个点才会到下一个CPU能观察到的时间点（NMI、一帧结束、mapper的扫描线IRQ）
+        // 提前同步没有影响，所以算出来的值可以比实际的小，不能比实际的大
+        std::uint32_t GetDotsToNextEvent(bool scanline_IRQ) const;
 
         std::uint8_t GetRegister(std::uint16_t address);
         void SetRegister(std::uint16_t address, std::uint8_t value);
 
-        inline void SetReadMapperCHRCallback(std::function<std::uint8_t(std::uint16_t)>&& callback) { m_mapper_read_CHR = std::move(callback); }
-        inline void SetWriteMapperCHRCallback(std::function<void(std::uint16_t, std::uint8_t)>&& callback) { m_mapper_write_CHR = std::move(callback); }
-        inline void SetMapperReduceIRQCounterCallback(std::function<void(void)>&& callback) { m_mapper_reduce_IRQ_counter = std::move(callback); }
-        inline void SetNMICallback(std::function<void()>&& callback) { m_trigger_NMI = std::move(callback); }
+        // 扫描线计数直接找mapper，NMI直接发给CPU
+        inline void SetMapper(MapperVariant* mapper) { m_mapper = mapper; }
+        inline void SetCPU(CPU6502* CPU) { m_CPU = CPU; }
 
         inline void SetDevice(std::shared_ptr<VirtualDevice> device) { m_device = std::move(device); }
-        inline void SetMirrorType(MirroringType type) { m_mirror_type = type; }
+        void SetMirrorType(MirroringType type);
+        // mapper把CHR bank映射到这里，PPU直接按指针读图案表
+        inline CHRMap* GetCHRMap() noexcept { return &m_CHR_map; }
+        // 换卡带的时候按CHR ROM的大小重新分配tile缓存，读档的时候CHR RAM被整个改了，要清空
+        inline void ResizeTileCache(std::size_t CHR_ROM_size) { m_tile_cache.Resize((CHR_ROM_size + CHR_RAM_SIZE) / CHR_TILE_SIZE); }
+        inline void ClearTileCache() { m_tile_cache.Clear(); }
 
         void OAMDMA(std::uint8_t* data);
 
@@ -76,10 +65,41 @@ namespace nes
         std::uint8_t PPUBusRead(std::uint16_t address);
         void PPUBusWrite(std::uint16_t address, std::uint8_t value);
 
-        std::uint16_t GetVRAMAddress(std::uint16_t address);
-
-        PPUCycleCoro StepCoro();
-        void StepExecVisibleRendering(int scanline, int cycle);
+        // 取图案和名称表的时候直接按指针读，不用走PPUBusRead的分支
+        inline std::uint8_t ReadCHR(std::uint16_t address) const
+        {
+            auto page = m_CHR_map.read[address >> MEMORY_PAGE_SHIFT];
+            return page != nullptr ? page[address & (MEMORY_PAGE_SIZE - 1)] : 0;
+        }
+        // address所在的那一行tile解码好的8个像素，flip是左右翻转的，address必须在图案表里
+        inline const std::uint8_t* GetTileRow(std::uint16_t address, bool flip)
+        {
+            static constexpr std::array<std::uint8_t, 8> EMPTY_ROW{};
+            auto page = address >> MEMORY_PAGE_SHIFT;
+            auto data = m_CHR_map.read[page];
+            if (data == nullptr)
+                return EMPTY_ROW.data();
+            std::size_t tile = (address & (MEMORY_PAGE_SIZE - 1)) >> 4;
+            const auto& decoded = m_tile_cache.Get(m_CHR_map.tile[page] + tile, data + tile * CHR_TILE_SIZE);
+            return (flip ? decoded.flipped.data() : decoded.pixels.data()) + ((address & 0x07) << 3);
+        }
+        inline std::uint8_t& Nametable(std::uint16_t address) { return m_nametables[(address >> 10) & 0x03][address & 0x03ff]; }
+        // 按镜像类型算出四个名称表各自对应哪块显存
+        void UpdateNametableMap();
+
+        // 走到下一个点，行尾（奇数帧PreRender少一个点）换到下一行
+        void NextDot();
+        void NextScanline();
+        void SetScanline(int scanline);
+        // 执行一个点上按表登记的事
+        void ExecuteDot(std::uint32_t actions);
+        // 逐点画可见扫描线的第first到第last个点，按PPUMASK的显示和左边8像素裁剪编译出不同的版本
+        template <std::uint8_t MASK>
+        void RenderDots(int scanline, int first, int last);
+        using RenderDotsFunc = void (PPU::*)(int scanline, int first, int last);
+        static RenderDotsFunc SelectRenderDots(std::uint8_t mask);
+        // 一次画完一整条可见扫描线（第1到256个点），中间没有寄存器变化的时候用
+        void RenderScanline(int scanline);
 
         void IncHorizontal();
         void IncVertical();
@@ -91,6 +111,15 @@ namespace nes
         void FetchingData(int cycle);
 
         void SpriteEvaluation(int scanline);
+        // 把第二OAM里的精灵在这一行的像素一次画到m_sprite_line里
+        void DrawSpriteLine(int scanline);
+        // 这一行的精灵，中间改了寄存器、OAM或者CHR bank的话要重新画
+        inline const std::array<std::uint8_t, 256>& GetSpriteLine(int scanline)
+        {
+            if (!m_sprite_line_valid || m_sprite_line_CHR_generation != m_CHR_map.generation)
+                DrawSpriteLine(scanline);
+            return m_sprite_line;
+        }
 
         // PPUCTRL
         // TODO : Master/Slave Mode没写
@@ -109,6 +138,7 @@ namespace nes
         inline bool IsBothBgAndSpEnabled() const { return (m_PPUMASK & 0x18) == 0x18; }
         inline bool IsShowBackgroundLeftmost8() const { return (m_PPUMASK & 0x02); }
         inline bool IsShowSpriteLeftmost8() const { return (m_PPUMASK & 0x04); }
+        void SetPPUMASK(std::uint8_t value);
 
         // PPUSTATUS
         std::uint8_t GetPPUSTATUS();
@@ -137,6 +167,14 @@ namespace nes
 
     private:
         std::unique_ptr<std::uint8_t[]> m_VRAM = nullptr;
+        // 名称表0到3在显存里的位置
+        std::array<std::uint8_t*, 4> m_nametables{};
+        CHRMap m_CHR_map;
+        CHRTileCache m_tile_cache;
+        // 整行合成用的，按CPU支持的指令集选
+        ComposeScanlineFunc m_compose_scanline = nullptr;
+        // 逐点画的时候用的，写PPUMASK的时候重新选
+        RenderDotsFunc m_render_dots = nullptr;
 
         std::uint8_t m_open_bus = 0;
 
@@ -170,21 +208,27 @@ namespace nes
         bool m_has_trigger_NMI = false;
 
         int m_cycle = 0;
+        // 当前扫描线，261是PreRender
+        int m_scanline = 0;
 
         PPUScanlineType m_scanline_type = PPUScanlineType::PreRender;
         MirroringType m_mirror_type = MirroringType::Horizontal;
 
-        std::array<std::uint8_t, 64 * 4> m_primary_OAM;
+        std::array<std::uint8_t, 64 * 4> m_primary_OAM{};
         // 单纯存一下m_primary_OAM的坐标
         std::vector<int> m_secondary_OAM;
-
-        PPUCycleCoro m_step_coro;
+        // 当前扫描线上的精灵像素，第7位是有精灵，第6位是精灵0，第5位是在背景后面，低5位是颜色索引
+        std::array<std::uint8_t, 256> m_sprite_line{};
+        bool m_sprite_line_valid = false;
+        std::uint32_t m_sprite_line_CHR_generation = 0;
+
+        // 当前扫描线每个点要做的事，和最后一个有事做的点
+        const std::uint32_t* m_line_actions = nullptr;
+        int m_line_last_action = 0;
         std::uint64_t m_frame = 0;
 
-        std::function<std::uint8_t(std::uint16_t)> m_mapper_read_CHR;
-        std::function<void(std::uint16_t, std::uint8_t)> m_mapper_write_CHR;
-        std::function<void()> m_trigger_NMI;
-        std::function<void()> m_mapper_reduce_IRQ_counter;
+        MapperVariant* m_mapper = nullptr;
+        CPU6502* m_CPU = nullptr;
 
         std::shared_ptr<VirtualDevice> m_device;
     };
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+// x86-64一定有SSE2，AVX2要运行的时候看CPU支不支持
+#if defined(__x86_64__) || defined(_M_X64)
+#define NES_PPU_HAS_SSE2 1
+#else
+#define NES_PPU_HAS_SSE2 0
+#endif
+
+namespace nes
+{
+    // 把一整行的背景和精灵合成屏幕上的颜色
+    // background : 背景的调色板索引（0到15），0是透明（包括被裁掉的）
+    // sprite : 精灵行缓冲，第7位是有精灵，第6位是精灵0，第5位是在背景后面，低5位是调色板索引
+    // colors : 调色板32项的颜色，还没处理镜像，$10/$14/$18/$1C在这里处理
+    // out : 256个像素，字节顺序和屏幕缓冲一样
+    // 返回有没有精灵0压在不透明背景上的像素
+    using ComposeScanlineFunc = bool(*)(const std::uint8_t* background, const std::uint8_t* sprite, const std::uint32_t* colors, std::uint32_t* out);
+
+    enum class ComposeKernel
+    {
+        Scalar,
+        SSE2,
+        AVX2,
+    };
+
+    // 按CPU支持的指令集选最快的
+    ComposeKernel GetBestComposeKernel();
+    // 这个CPU（或者编译器）不支持的返回nullptr
+    ComposeScanlineFunc GetComposeScanline(ComposeKernel kernel);
+}
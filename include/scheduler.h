@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <vector>
+
+namespace nes
+{
+    // 时间戳都用主时钟(NTSC 21.477272MHz)计，CPU一个周期12个主时钟，PPU一个点4个主时钟
+    constexpr std::uint64_t CPU_CLOCK_DIVIDER = 12;
+    constexpr std::uint64_t PPU_CLOCK_DIVIDER = 4;
+
+    // 排序的时候时间戳一样就按这个顺序来
+    enum class SchedulerEvent
+    {
+        PPUSync,         // PPU需要追上CPU（NMI、一帧结束、mapper的扫描线IRQ）
+        APUFrameCounter, // APU帧计数器
+        DMCFetch,        // DMC读下一个采样字节
+        MapperIRQ,       // mapper自己按CPU周期数的IRQ
+        Count
+    };
+
+    // 各个部件把自己下次要做事的时间登记进来，主循环只在有事件到期的时候才去找它们
+    struct ScheduledEvent
+    {
+        std::uint64_t timestamp;
+        SchedulerEvent event;
+
+        bool operator> (const ScheduledEvent& other) const noexcept
+        {
+            if (timestamp != other.timestamp)
+                return timestamp > other.timestamp;
+            return event > other.event;
+        }
+    };
+
+    // 每种事件同时只有一个时间点，重新登记会覆盖之前的
+    class Scheduler
+    {
+    public:
+        static constexpr std::uint64_t NO_EVENT = std::numeric_limits<std::uint64_t>::max();
+
+        Scheduler();
+        ~Scheduler() = default;
+
+        void Reset();
+
+        inline std::uint64_t GetTimestamp() const noexcept { return m_timestamp; }
+        inline void Advance(std::uint64_t clocks) noexcept { m_timestamp += clocks; }
+
+        void Schedule(SchedulerEvent event, std::uint64_t timestamp);
+        void Cancel(SchedulerEvent event);
+        inline std::uint64_t GetDeadline(SchedulerEvent event) const noexcept { return m_deadline[static_cast<int>(event)]; }
+
+        // 队列里最早的时间点，可能是已经被覆盖掉的，所以只能用来判断要不要调用PopDueEvent
+        inline std::uint64_t GetNextTimestamp() const noexcept { return m_queue.empty() ? NO_EVENT : m_queue.top().timestamp; }
+        // 取出一个时间点在until之前的事件，没有就返回空
+        // CPU按整条指令跑，事件处理的时候主时钟可能已经过了它登记的时间点，需要的话用返回的时间点
+        std::optional<ScheduledEvent> PopDueEvent(std::uint64_t until);
+
+    private:
+        std::uint64_t m_timestamp = 0;
+        // 被覆盖或者取消的事件不从队列里删，取出来的时候和这里对不上就扔掉
+        std::array<std::uint64_t, static_cast<int>(SchedulerEvent::Count)> m_deadline;
+        std::priority_queue<ScheduledEvent, std::vector<ScheduledEvent>, std::greater<ScheduledEvent>> m_queue;
+    };
+}
@@ -7,6 +7,7 @@
 #include <unordered_map>
 #include "SDL_keycode.h"
 #include "SDL_joystick.h"
+#include "SDL_audio.h"
 
 struct SDL_Window;
 struct SDL_Renderer;
@@ -45,6 +46,7 @@ class SDLApplication
         SDL_Window* m_window;
         SDL_Renderer* m_renderer;
         SDL_Texture* m_texture;
+        SDL_AudioDeviceID m_audio_device = 0;
         // 现在就支持两个手柄就可以了
         struct Joystick
         {
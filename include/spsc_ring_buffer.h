@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <algorithm>
+
+namespace nes
+{
+    // 单生产者单消费者的环形缓冲，一个线程只Push，另一个线程只Pop，不加锁也不会等
+    // 读写位置各占一个cache line，两个线程不会互相把对方的cache line弄失效
+    template <typename T, std::size_t Capacity>
+    class SPSCRingBuffer
+    {
+        static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+    public:
+        static constexpr std::size_t CAPACITY = Capacity;
+
+        // 生产者线程用，满了的话放不下的就丢掉，返回放进去的个数
+        inline std::size_t Push(const T* data, std::size_t count) noexcept
+        {
+            std::size_t write = m_write.load(std::memory_order_relaxed);
+            if (Capacity - (write - m_cached_read) < count)
+            {
+                // 缓存的读位置过时了才去读消费者的
+                m_cached_read = m_read.load(std::memory_order_acquire);
+                count = std::min(count, Capacity - (write - m_cached_read));
+            }
+            // 可能绕回开头，分两段拷
+            std::size_t start = write & (Capacity - 1);
+            std::size_t first = std::min(count, Capacity - start);
+            std::copy_n(data, first, m_data.begin() + start);
+            std::copy_n(data + first, count - first, m_data.begin());
+            m_write.store(write + count, std::memory_order_release);
+            return count;
+        }
+
+        // 消费者线程用，正好取count个，不够的话什么都不取，返回false
+        inline bool PopExactly(T* data, std::size_t count) noexcept
+        {
+            std::size_t read = m_read.load(std::memory_order_relaxed);
+            if (m_cached_write - read < count)
+            {
+                m_cached_write = m_write.load(std::memory_order_acquire);
+                if (m_cached_write - read < count)
+                    return false;
+            }
+            // 可能绕回开头，分两段拷
+            std::size_t start = read & (Capacity - 1);
+            std::size_t first = std::min(count, Capacity - start);
+            std::copy_n(m_data.begin() + start, first, data);
+            std::copy_n(m_data.begin(), count - first, data + first);
+            m_read.store(read + count, std::memory_order_release);
+            return true;
+        }
+
+        // 两个线程都能调用，只是个大概的值
+        inline std::size_t GetSize() const noexcept
+        {
+            return m_write.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire);
+        }
+
+    private:
+        static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+        // 生产者写，顺便记一下上次看到的读位置
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> m_write = 0;
+        std::size_t m_cached_read = 0;
+
+        // 消费者写，顺便记一下上次看到的写位置
+        alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> m_read = 0;
+        std::size_t m_cached_write = 0;
+
+        alignas(CACHE_LINE_SIZE) std::array<T, Capacity> m_data{};
+    };
+}
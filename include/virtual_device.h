@@ -1,11 +1,11 @@
 #pragma once
 
 #include <atomic>
-#include <mutex>
+#include <chrono>
 #include <functional>
-#include <list>
 #include <array>
 #include "def.h"
+#include "spsc_ring_buffer.h"
 
 namespace nes
 {
@@ -24,6 +24,14 @@ namespace nes
             std::uint64_t GetTurboTimeIntervalMs() const noexcept { return m_turbo_time_interval_ms; }
 
             std::uint8_t* GetScreenPtr() noexcept { return m_screen.data(); }
+            // 调色板索引模式：PPU只写每个像素的调色板索引和每行的强调位（PPUMASK高3位），显示之前再一次转成颜色
+            // 要在开始运行之前设置
+            void SetPaletteIndexMode(bool enabled) noexcept { m_palette_index_mode = enabled; }
+            bool IsPaletteIndexMode() const noexcept { return m_palette_index_mode; }
+            const std::uint8_t* GetIndexScreenPtr() const noexcept { return m_index_screen.data(); }
+            const std::uint8_t* GetLineEmphasisPtr() const noexcept { return m_line_emphasis.data(); }
+            // 按强调位把调色板索引转成颜色写到屏幕缓冲里，ApplicationUpdate会调用
+            void ConvertIndexScreen();
             void SetApplicationUpdateCallback(std::function<void(const std::uint8_t*)>&& callback) { m_app_update_callback = std::move(callback); }
 
             void ApplicationUpdate();
@@ -34,8 +42,19 @@ namespace nes
             void StartPPURender();
             void EndPPURender();
 
+            // 声卡用的样本格式和采样率，要在开始运行（模拟器Reset）之前设置
+            void SetAudioFormat(AudioFormat format, int sample_rate) noexcept { m_audio_format = format; m_audio_sample_rate = sample_rate; }
+            AudioFormat GetAudioFormat() const noexcept { return m_audio_format; }
+            int GetAudioSampleRate() const noexcept { return m_audio_sample_rate; }
+            // 一个样本多少字节
+            std::size_t GetAudioSampleSize() const noexcept;
+
+            // 音频线程调用，len是字节数，按设置的格式填
+            // 攒的样本不够的时候算一次欠载，这次填静音（最后一个样本的值），攒的样本留到下次
             void FillAudioSamples(unsigned char* stream, int len);
-            void PutAudioSample(std::uint8_t sample);
+            // 模拟器线程调用，缓冲满了的话放不下的样本直接丢掉
+            void PutAudioSamples(const std::int16_t* samples, std::size_t count);
+            std::uint64_t GetAudioUnderrunCount() const noexcept { return m_audio_underrun_count.load(std::memory_order_relaxed); }
 
             void Write4016(std::uint8_t val);
             std::uint8_t Read4016();
@@ -46,6 +65,12 @@ namespace nes
             //  y : 0 (0, 0)  (1, 0), ...
             //      1 (0, 1)  (1, 1), ...
             void SetPixel(int x, int y, int palette_index);
+            // 一次设置一整行，colors是按屏幕缓冲字节顺序排好的NES_WIDTH个颜色
+            void SetLine(int y, const std::uint32_t* colors);
+            // 调色板索引模式下一次设置一整行，indices是NES_WIDTH个调色板索引
+            void SetIndexLine(int y, const std::uint32_t* indices);
+            // 调色板索引模式下这一行的强调位，第0位红，第1位绿，第2位蓝
+            void SetLineEmphasis(int y, std::uint8_t emphasis);
             
         private:
             std::uint8_t GetNesKey(Player player) const;
@@ -59,14 +84,15 @@ namespace nes
             std::uint8_t m_shift_controller1 = 0;
             std::uint8_t m_shift_controller2 = 0;
 
-            std::array<std::uint8_t, NES_WIDTH * NES_HEIGHT * 4> m_screen;
+            std::array<std::uint8_t, NES_WIDTH * NES_HEIGHT * 4> m_screen{};
+
+            bool m_palette_index_mode = false;
+            std::array<std::uint8_t, NES_WIDTH * NES_HEIGHT> m_index_screen{};
+            std::array<std::uint8_t, NES_HEIGHT> m_line_emphasis{};
 
             // 读取和写入时的锁
             std::atomic<bool> m_write_screen_finish = false;
 
-            // 操作音频buffer的时候加的锁
-            std::mutex m_audio_mutex;
-
             std::function<void(const std::uint8_t*)> m_app_update_callback;
 
             std::uint8_t m_strobe = 0;
@@ -78,13 +104,13 @@ namespace nes
             std::int64_t m_turbo_time_interval_ms = 20;
             std::chrono::steady_clock::time_point m_turbo_time{};
 
-            struct AudioSamples
-            {
-                std::array<std::uint8_t, AUDIO_BUFFER_SAMPLES> data;
-                unsigned int index = 0;
-            };
+            AudioFormat m_audio_format = AudioFormat::S16;
+            int m_audio_sample_rate = AUDIO_FREQ;
 
-            std::list<AudioSamples> m_audio_samples;
-            std::list<AudioSamples> m_garbage_audio_samples;
+            // 模拟器线程放，音频线程取，能存4个音频buffer，存的是16位的样本，取的时候再转成声卡的格式
+            SPSCRingBuffer<std::int16_t, AUDIO_BUFFER_SAMPLES * 4> m_audio_samples;
+            std::atomic<std::uint64_t> m_audio_underrun_count = 0;
+            // 音频线程上次输出的最后一个样本，欠载的时候一直输出这个值，不会有爆音
+            std::int16_t m_last_audio_sample = 0;
     };
 }
@@ -1,5 +1,10 @@
 #include "apu.h"
 #include "virtual_device.h"
+#include "scheduler.h"
+#include "cpu.h"
+#include "emulator.h"
+#include <algorithm>
+#include <limits>
 
 namespace nes
 {
@@ -35,6 +40,21 @@ namespace nes
 
         constexpr auto PULSE_TABLE = GeneratePulseTable();
         constexpr auto TND_TABLE = GenerateTndTable();
+
+        // 混音输出换成整数，1.0是1 << OUTPUT_LEVEL_BITS，记变化量的时候不用浮点
+        constexpr int OUTPUT_LEVEL_BITS = 16;
+
+        template <std::size_t N>
+        consteval auto GenerateLevelTable(const std::array<float, N>& table)
+        {
+            std::array<std::int32_t, N> result{};
+            for (std::size_t i = 0; i < N; i++)
+                result[i] = static_cast<std::int32_t>(table[i] * (1 << OUTPUT_LEVEL_BITS) + 0.5f);
+            return result;
+        }
+
+        constexpr auto PULSE_LEVEL_TABLE = GenerateLevelTable(PULSE_TABLE);
+        constexpr auto TND_LEVEL_TABLE = GenerateLevelTable(TND_TABLE);
         constexpr std::array<std::array<int, 8>, 4> PULSE_DUTY_TABLE = 
         {
             0, 1, 0, 0, 0, 0, 0, 0,
@@ -59,19 +79,65 @@ namespace nes
         };
     }
 
+    // 帧计数器每一步在这一轮开始以后第几个CPU周期，4步模式和5步模式，https://www.nesdev.org/wiki/APU_Frame_Counter
+    constexpr std::array<std::array<std::uint32_t, 5>, 2> FRAME_STEP_CYCLES =
+    {{
+        { 7457, 14913, 22371, 29829, 0 },
+        { 7457, 14913, 22371, 29829, 37281 },
+    }};
+    constexpr std::array<unsigned int, 2> FRAME_STEP_COUNT = { 4, 5 };
+    // 一轮有多少个CPU周期
+    constexpr std::array<std::uint32_t, 2> FRAME_SEQUENCE_CYCLES = { 29830, 37282 };
+
+    APU::APU() : m_blip(NTSC_CPU_FREQUENCY, AUDIO_FREQ, AUDIO_BUFFER_SAMPLES)
+    {
+
+    }
+
     void APU::Reset()
     {
         m_cycles = 0;
         m_frame_cycles = 0;
-        m_output_record = 0.0f;
-        m_frame_counter = 0.0f;
+        // 采样率跟着声卡走
+        m_blip.SetRates(NTSC_CPU_FREQUENCY, m_device->GetAudioSampleRate());
+        m_output_level = 0;
+        m_audio_frame_cycles = 0;
+        m_timestamp = m_scheduler->GetTimestamp();
+        m_frame_sequence_timestamp = m_timestamp;
+        ScheduleFrameCounter();
+        ScheduleDMCFetch();
     }
 
-    void APU::Step()
+    void APU::Run(std::uint64_t timestamp)
     {
-        constexpr float CPU_AUDIO_RATIO = NTSC_CPU_FREQUENCY / static_cast<float>(AUDIO_FREQ);
-        constexpr float CPU_FRAME_RATIO = NTSC_CPU_FREQUENCY / static_cast<float>(NTSC_FRAME_FREQUENCY);
+#ifdef NES_APU_STEP_EVERY_CYCLE
+        while (m_timestamp < timestamp)
+        {
+            Step();
+            m_timestamp += CPU_CLOCK_DIVIDER;
+        }
+#else
+        if (m_timestamp >= timestamp)
+            return;
+        auto cycles = (timestamp - m_timestamp + CPU_CLOCK_DIVIDER - 1) / CPU_CLOCK_DIVIDER;
+        m_timestamp += cycles * CPU_CLOCK_DIVIDER;
+
+        // 上次追完以后写寄存器或者帧计数器改的音量，算在现在这个周期
+        UpdateOutput();
+        // 每个声道输出只会在计时器到0的时候变，中间的周期一次跳过去，都不出声的话一次走完
+        while (cycles > 0)
+        {
+            auto step = std::min({ cycles, GetCyclesToOutputChange(), static_cast<std::uint64_t>(m_blip.GetMaxFrameClocks() - m_audio_frame_cycles) });
+            Advance(step);
+            cycles -= step;
+            if (m_audio_frame_cycles >= m_blip.GetMaxFrameClocks())
+                EndAudioFrame();
+        }
+#endif
+    }
 
+    void APU::Step()
+    {
         m_triangle.Step();
 
         if (m_cycles++ % 2 == 0)
@@ -82,80 +148,174 @@ namespace nes
             m_DMC.Step();
         }
 
-        m_frame_counter += 1.0f;
-        if (m_frame_counter > CPU_FRAME_RATIO)
+        UpdateOutput();
+        // 攒的采样快放不下了就先合成，不用等到一帧结束
+        if (++m_audio_frame_cycles >= m_blip.GetMaxFrameClocks())
+            EndAudioFrame();
+    }
+
+    void APU::Advance(std::uint64_t cycles)
+    {
+        // 脉冲、噪声和DMC在m_cycles是偶数的周期走
+        std::uint64_t start = m_cycles;
+        auto half_steps = static_cast<std::uint32_t>((start + cycles + 1) / 2 - (start + 1) / 2);
+        m_triangle.Advance(static_cast<std::uint32_t>(cycles));
+        m_pulse1.Advance(half_steps);
+        m_pulse2.Advance(half_steps);
+        m_noise.Advance(half_steps);
+        m_DMC.Advance(half_steps);
+        m_cycles += static_cast<unsigned int>(cycles);
+
+        // 和一个周期一个周期走的时候一样，记在最后一个周期上
+        m_audio_frame_cycles += static_cast<std::uint32_t>(cycles - 1);
+        UpdateOutput();
+        m_audio_frame_cycles++;
+    }
+
+    std::uint64_t APU::GetCyclesToOutputChange() const
+    {
+        constexpr auto NEVER = std::numeric_limits<std::uint64_t>::max();
+        std::uint64_t res = NEVER;
+
+        // 三角波每个周期走一步，第steps步走完以后输出会变
+        if (!m_triangle.IsSilent())
+        {
+            const auto& triangle = m_triangle;
+            res = triangle.cur_time >= 2 ? triangle.cur_time - 1 : triangle.cur_time + 1;
+        }
+
+        // 其他的两个周期走一步，第一步在这个周期还是下个周期看m_cycles的奇偶
+        auto half_steps_to_cycles = [this](std::uint64_t steps) { return (m_cycles & 1) + 2 * (steps - 1) + 1; };
+        if (!m_pulse1.IsSilent())
+            res = std::min(res, half_steps_to_cycles(m_pulse1.cur_time + 1));
+        if (!m_pulse2.IsSilent())
+            res = std::min(res, half_steps_to_cycles(m_pulse2.cur_time + 1));
+        if (!m_noise.IsSilent())
+            res = std::min(res, half_steps_to_cycles(m_noise.cur_time + 1));
+        if (m_DMC.data.enable && m_DMC.data.shift_count > 0)
+            res = std::min(res, half_steps_to_cycles(m_DMC.data.cur_freq + 1));
+        return res;
+    }
+
+    void APU::UpdateOutput()
+    {
+        auto output_pulse1 = m_pulse1.Output();
+        auto output_pulse2 = m_pulse2.Output();
+        auto output_triangle = m_triangle.Output();
+        auto output_noise = m_noise.Output();
+        auto output_dmc = m_DMC.Output();
+        auto level = meta::PULSE_LEVEL_TABLE[output_pulse1 + output_pulse2] + meta::TND_LEVEL_TABLE[3 * output_triangle + 2 * output_noise + output_dmc];
+        if (level != m_output_level)
         {
-            m_frame_counter -= CPU_FRAME_RATIO;
-            if (!m_mode)
+            m_blip.AddDelta(m_audio_frame_cycles, level - m_output_level);
+            m_output_level = level;
+        }
+    }
+
+    void APU::EndAudioFrame()
+    {
+        m_blip.EndFrame(m_audio_frame_cycles);
+        m_audio_frame_cycles = 0;
+
+        auto count = m_blip.ReadSamples(m_audio_samples.data(), m_audio_samples.size());
+        // 已经去掉了直流，1.0对应16位的满幅，带限以后在跳变的地方会有一点过冲，要限制在16位里
+        for (std::size_t i = 0; i < count; i++)
+            m_audio_output[i] = static_cast<std::int16_t>(std::clamp(m_audio_samples[i] >> (meta::OUTPUT_LEVEL_BITS - 15), -32768, 32767));
+        m_device->PutAudioSamples(m_audio_output.data(), count);
+    }
+
+    void APU::ScheduleFrameCounter()
+    {
+        // 这个周期走完以后，下个周期开始的时候处理
+        auto cycles = FRAME_STEP_CYCLES[m_mode][m_frame_cycles];
+        m_scheduler->Schedule(SchedulerEvent::APUFrameCounter, m_frame_sequence_timestamp + static_cast<std::uint64_t>(cycles) * CPU_CLOCK_DIVIDER);
+    }
+
+    void APU::StepFrameCounter()
+    {
+        if (!m_mode)
+        {
+            switch (m_frame_cycles)
             {
-                m_frame_cycles = m_frame_cycles % 4;
-                switch (m_frame_cycles)
-                {
-                    case 3:
-                        if (m_interrupt)
-                        {
-                            m_trigger_IRQ();
-                            m_frame_interrupt = true;
-                        }
-                        [[fallthrough]];
-                    case 1:
-                        m_pulse1.StepLength();
-                        m_pulse2.StepLength();
-                        m_triangle.StepLength();
-                        m_noise.StepLength();
-                        m_pulse1.StepSweep();
-                        m_pulse2.StepSweep();
-                        [[fallthrough]];
-                    case 0:
-                    case 2:
-                        m_pulse1.StepEnvelope();
-                        m_pulse2.StepEnvelope();
-                        m_triangle.StepCounter();
-                        m_noise.StepEnvelope();
-                        break;
-                }
+                case 3:
+                    if (m_interrupt)
+                    {
+                        m_CPU->Interrupt(CPU6502InterruptType::IRQ);
+                        m_frame_interrupt = true;
+                    }
+                    [[fallthrough]];
+                case 1:
+                    m_pulse1.StepLength();
+                    m_pulse2.StepLength();
+                    m_triangle.StepLength();
+                    m_noise.StepLength();
+                    m_pulse1.StepSweep();
+                    m_pulse2.StepSweep();
+                    [[fallthrough]];
+                case 0:
+                case 2:
+                    m_pulse1.StepEnvelope();
+                    m_pulse2.StepEnvelope();
+                    m_triangle.StepCounter();
+                    m_noise.StepEnvelope();
+                    break;
             }
-            else
+        }
+        else
+        {
+            switch (m_frame_cycles)
             {
-                m_frame_cycles = m_frame_cycles % 5;
-                switch (m_frame_cycles)
-                {
-                    case 3:
-                        break;
-                    case 1:
-                    case 4:
-                        m_pulse1.StepLength();
-                        m_pulse2.StepLength();
-                        m_triangle.StepLength();
-                        m_noise.StepLength();
-                        m_pulse1.StepSweep();
-                        m_pulse2.StepSweep();
-                        [[fallthrough]];
-                    case 0:
-                    case 2:
-                        m_pulse1.StepEnvelope();
-                        m_pulse2.StepEnvelope();
-                        m_triangle.StepCounter();
-                        m_noise.StepEnvelope();
-                        break;
-                }
+                case 3:
+                    break;
+                case 1:
+                case 4:
+                    m_pulse1.StepLength();
+                    m_pulse2.StepLength();
+                    m_triangle.StepLength();
+                    m_noise.StepLength();
+                    m_pulse1.StepSweep();
+                    m_pulse2.StepSweep();
+                    [[fallthrough]];
+                case 0:
+                case 2:
+                    m_pulse1.StepEnvelope();
+                    m_pulse2.StepEnvelope();
+                    m_triangle.StepCounter();
+                    m_noise.StepEnvelope();
+                    break;
             }
-            m_frame_cycles++;
         }
 
-        m_output_record += 1.0f;
-        if (m_output_record > CPU_AUDIO_RATIO)
+        // 一轮走完了，从下一轮开头重新数
+        if (++m_frame_cycles >= FRAME_STEP_COUNT[m_mode])
         {
-            m_output_record -= CPU_AUDIO_RATIO;
-            auto output_pulse1 = m_pulse1.Output();
-            auto output_pulse2 = m_pulse2.Output();
-            auto output_triangle = m_triangle.Output();
-            auto output_noise = m_noise.Output();
-            auto output_dmc = m_DMC.Output();
-            auto pulse = meta::PULSE_TABLE[output_pulse1 + output_pulse2];
-            auto tnd = meta::TND_TABLE[3 * output_triangle + 2 * output_noise + output_dmc];
-            m_device->PutAudioSample(static_cast<std::uint8_t>((pulse + tnd) * 256));
+            m_frame_cycles = 0;
+            m_frame_sequence_timestamp += static_cast<std::uint64_t>(FRAME_SEQUENCE_CYCLES[m_mode]) * CPU_CLOCK_DIVIDER;
         }
+        ScheduleFrameCounter();
+    }
+
+    void APU::FetchDMC()
+    {
+        if (m_DMC.NeedFetch())
+            m_DMC.Fetch();
+        ScheduleDMCFetch();
+    }
+
+    void APU::ScheduleDMCFetch()
+    {
+        const auto& data = m_DMC.data;
+        if (!data.enable || data.cur_length == 0)
+        {
+            m_scheduler->Cancel(SchedulerEvent::DMCFetch);
+            return;
+        }
+        // DMC在偶数周期走，移位寄存器空了以后的下一次走之前读数据
+        auto next_step = m_timestamp + (m_cycles % 2 == 0 ? 0 : CPU_CLOCK_DIVIDER);
+        std::uint64_t steps = 0;
+        if (data.shift_count > 0)
+            steps = data.cur_freq + 1 + static_cast<std::uint64_t>(data.shift_count - 1) * (data.frequency + 1);
+        m_scheduler->Schedule(SchedulerEvent::DMCFetch, next_step + steps * 2 * CPU_CLOCK_DIVIDER);
     }
 
     void APU::SetRegister(std::uint16_t addr, std::uint8_t val)
@@ -210,6 +370,7 @@ namespace nes
                 break;
             case 0x10:
                 m_DMC.data.SetControl(val);
+                ScheduleDMCFetch();
                 break;
             case 0x11:
                 m_DMC.data.SetLoadCounter(val);
@@ -241,6 +402,7 @@ namespace nes
                     m_DMC.data.cur_address = m_DMC.data.sample_address;
                     m_DMC.data.cur_length = m_DMC.data.sample_length;
                 }
+                ScheduleDMCFetch();
                 break;
             case 0x17:
                 m_mode = val & 0x80;
@@ -251,7 +413,10 @@ namespace nes
                 }
                 else
                     m_interrupt = true;
+                // 写$4017以后帧计数器从头开始数
                 m_frame_cycles = 0;
+                m_frame_sequence_timestamp = m_timestamp;
+                ScheduleFrameCounter();
                 if (m_mode)
                 {
                     m_pulse1.StepLength();
@@ -343,6 +508,25 @@ namespace nes
             }
         }
 
+        void Pulse::Advance(std::uint32_t steps)
+        {
+            if (steps <= cur_time)
+            {
+                cur_time -= steps;
+                return;
+            }
+            // 先走到0再重新装一次，后面每timer + 1步转一格
+            steps -= cur_time + 1;
+            std::uint32_t period = timer + 1u;
+            cur_duty = static_cast<std::uint8_t>((cur_duty + 1 + steps / period) % 8);
+            cur_time = static_cast<std::uint16_t>(timer - steps % period);
+        }
+
+        bool Pulse::IsSilent() const
+        {
+            return !enable || length_counter == 0 || timer < 8 || sweep_muting || (constant_volume ? volume : envelope_volume) == 0;
+        }
+
         void Pulse::StepEnvelope()
         {
             if (envelope_start_flag)
@@ -465,6 +649,26 @@ namespace nes
             }
         }
 
+        void Triangle::Advance(std::uint32_t steps)
+        {
+            if (steps <= cur_time)
+            {
+                cur_time -= steps;
+                return;
+            }
+            steps -= cur_time + 1;
+            std::uint32_t period = timer + 1u;
+            if (length_counter > 0 && counter_value > 0)
+                cur_duty = static_cast<std::uint8_t>((cur_duty + 1 + steps / period) % 32);
+            cur_time = static_cast<std::uint16_t>(timer - steps % period);
+        }
+
+        bool Triangle::IsSilent() const
+        {
+            // timer小于2的时候cur_time一直小于2，也是0
+            return !enable || counter_value == 0 || length_counter == 0 || (timer < 2 && cur_time < 2);
+        }
+
         void Triangle::StepCounter()
         {
             if (counter_reload_flag)
@@ -523,6 +727,38 @@ namespace nes
             }
         }
 
+        void Noise::Advance(std::uint32_t steps)
+        {
+            if (steps <= cur_time)
+            {
+                cur_time -= steps;
+                return;
+            }
+            steps -= cur_time + 1;
+            std::uint32_t period = timer_period + 1u;
+            std::uint32_t clocks = 1 + steps / period;
+            cur_time = static_cast<std::uint8_t>(timer_period - steps % period);
+
+            // 普通模式下所有非0的状态在一个32767长的循环里，转整圈等于没转
+            if (!mode_flag)
+                clocks %= 32767;
+            for (std::uint32_t i = 0; i < clocks; i++)
+            {
+                std::uint16_t val = 0;
+                if (mode_flag)
+                    val = ((shift_register >> 6) ^ shift_register) & 0x0001;
+                else
+                    val = ((shift_register >> 1) ^ shift_register) & 0x0001;
+                shift_register >>= 1;
+                shift_register |= (val << 14);
+            }
+        }
+
+        bool Noise::IsSilent() const
+        {
+            return !enable || length_counter == 0 || (constant_volume ? volume : envelope_volume) == 0;
+        }
+
         void Noise::StepEnvelope()
         {
             if (envelope_start_flag)
@@ -584,18 +820,6 @@ namespace nes
             if (!data.enable)
                 return;
 
-            if (data.cur_length > 0 && data.shift_count == 0) // 需要重新读一下数据
-            {
-                data.shift_reg = read_callback(data.cur_address++);
-                data.shift_count = 8;
-                data.cur_address |= 0x8000;
-                if (--data.cur_length == 0 && data.loop)
-                {
-                    data.cur_address = data.sample_address;
-                    data.cur_length = data.sample_length;
-                }
-            }
-
             if (data.cur_freq > 0)
             {
                 data.cur_freq--;
@@ -621,6 +845,50 @@ namespace nes
             }
         }
 
+        void DMC::Advance(std::uint32_t steps)
+        {
+            if (!data.enable)
+                return;
+            if (steps <= data.cur_freq)
+            {
+                data.cur_freq -= steps;
+                return;
+            }
+            steps -= data.cur_freq + 1;
+            std::uint32_t period = data.frequency + 1u;
+            std::uint32_t reloads = 1 + steps / period;
+            data.cur_freq = static_cast<std::uint8_t>(data.frequency - steps % period);
+
+            // 每次重新装的时候输出一位，移位寄存器空了以后就不动了，等调度器来读下一个字节
+            for (std::uint32_t i = 0; i < reloads && data.shift_count > 0; i++)
+            {
+                if (data.shift_reg & 1)
+                {
+                    if (data.output <= 125)
+                        data.output += 2;
+                }
+                else
+                {
+                    if (data.output >= 2)
+                        data.output -= 2;
+                }
+                data.shift_reg >>= 1;
+                data.shift_count--;
+            }
+        }
+
+        void DMC::Fetch()
+        {
+            data.shift_reg = bus->MainBusRead(data.cur_address++);
+            data.shift_count = 8;
+            data.cur_address |= 0x8000;
+            if (--data.cur_length == 0 && data.loop)
+            {
+                data.cur_address = data.sample_address;
+                data.cur_length = data.sample_length;
+            }
+        }
+
         std::uint8_t DMC::Output()
         {
             if (!data.enable)
@@ -645,8 +913,12 @@ namespace nes
         pointer = UnsafeWrite(pointer, m_mode);
         pointer = UnsafeWrite(pointer, m_interrupt);
         pointer = UnsafeWrite(pointer, m_frame_interrupt);
-        pointer = UnsafeWrite(pointer, m_output_record);
-        pointer = UnsafeWrite(pointer, m_frame_counter);
+        // 以前存的是采样用的小数计数，现在不用了，留着位置，以前的存档还能读
+        pointer = UnsafeWrite(pointer, 0.0f);
+        // 离下一步还有多少个周期，这一步可能已经到了但是还没处理（一帧结束的时候剩下的事件留到下次），那样就是负的
+        auto next_step_timestamp = m_frame_sequence_timestamp + static_cast<std::uint64_t>(FRAME_STEP_CYCLES[m_mode][m_frame_cycles]) * CPU_CLOCK_DIVIDER;
+        auto next_step_cycles = (static_cast<std::int64_t>(next_step_timestamp) - static_cast<std::int64_t>(m_timestamp)) / static_cast<std::int64_t>(CPU_CLOCK_DIVIDER);
+        pointer = UnsafeWrite(pointer, static_cast<std::int32_t>(next_step_cycles));
 
         return res;
     }
@@ -673,7 +945,41 @@ namespace nes
         pointer = UnsafeRead(pointer, m_mode);
         pointer = UnsafeRead(pointer, m_interrupt);
         pointer = UnsafeRead(pointer, m_frame_interrupt);
-        pointer = UnsafeRead(pointer, m_output_record);
-        pointer = UnsafeRead(pointer, m_frame_counter);
+        float unused_output_record;
+        pointer = UnsafeRead(pointer, unused_output_record);
+        m_frame_cycles %= FRAME_STEP_COUNT[m_mode];
+
+        // 这一轮开始以后走了多少个CPU周期，可能是负的
+        std::int64_t sequence_cycles = 0;
+        if (version == 0)
+        {
+            // 以前存的是离上一步过了多少个周期（浮点数，每步间隔一样），按上一步的位置换算，最多差一两个周期
+            float frame_counter;
+            pointer = UnsafeRead(pointer, frame_counter);
+            sequence_cycles = static_cast<std::int64_t>(std::max(frame_counter, 0.0f));
+            if (m_frame_cycles > 0)
+                sequence_cycles += FRAME_STEP_CYCLES[m_mode][m_frame_cycles - 1];
+        }
+        else if (version == 1)
+        {
+            // 存的是这一轮开始以后的周期数，一轮的最后一步走完以后下一轮的开头在后面一个周期，
+            // 64位无符号数减出来绕回去了，除完截成32位是0x55555554，其实是-1
+            std::uint32_t cycles;
+            pointer = UnsafeRead(pointer, cycles);
+            sequence_cycles = cycles > 2 * FRAME_SEQUENCE_CYCLES[m_mode] ? -1 : static_cast<std::int64_t>(cycles);
+        }
+        else
+        {
+            std::int32_t next_step_cycles;
+            pointer = UnsafeRead(pointer, next_step_cycles);
+            sequence_cycles = static_cast<std::int64_t>(FRAME_STEP_CYCLES[m_mode][m_frame_cycles]) - next_step_cycles;
+        }
+        // 坏掉的存档也不能让帧计数器一口气补上好多步，最多补两轮
+        sequence_cycles = std::clamp<std::int64_t>(sequence_cycles, -1, 2ll * FRAME_SEQUENCE_CYCLES[m_mode]);
+
+        m_timestamp = m_scheduler->GetTimestamp();
+        m_frame_sequence_timestamp = static_cast<std::uint64_t>(static_cast<std::int64_t>(m_timestamp) - sequence_cycles * static_cast<std::int64_t>(CPU_CLOCK_DIVIDER));
+        ScheduleFrameCounter();
+        ScheduleDMCFetch();
     }
 }
@@ -0,0 +1,251 @@
+#include "blip_buffer.h"
+#include <array>
+#include <algorithm>
+
+#if NES_BLIP_HAS_SIMD
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC和Clang要单独给SSE4.1和AVX2的函数打开指令集，MSVC不用
+#if NES_BLIP_HAS_SIMD && defined(__GNUC__)
+#define NES_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define NES_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define NES_TARGET_SSE41
+#define NES_TARGET_AVX2
+#endif
+
+namespace nes
+{
+    namespace meta
+    {
+        constexpr double PI = 3.14159265358979323846;
+
+        // 编译期算的，换编译器和编译选项结果都一样
+        constexpr double Sin(double x)
+        {
+            // 先挪到[-pi, pi]再展开
+            while (x > PI)
+                x -= 2 * PI;
+            while (x < -PI)
+                x += 2 * PI;
+            double term = x;
+            double sum = x;
+            for (int i = 1; i < 20; i++)
+            {
+                term *= -x * x / ((2 * i) * (2 * i + 1));
+                sum += term;
+            }
+            return sum;
+        }
+
+        constexpr double Cos(double x)
+        {
+            return Sin(x + PI / 2);
+        }
+
+        // 截止频率比奈奎斯特频率低一点，Blackman窗
+        consteval auto GenerateStepKernel()
+        {
+            constexpr double CUTOFF = 0.9;
+            constexpr int UNIT = 1 << BlipBuffer::KERNEL_UNIT_BITS;
+
+            std::array<std::array<std::int32_t, BlipBuffer::KERNEL_WIDTH>, BlipBuffer::PHASE_COUNT> result{};
+            for (int phase = 0; phase < BlipBuffer::PHASE_COUNT; phase++)
+            {
+                std::array<double, BlipBuffer::KERNEL_WIDTH> taps{};
+                double sum = 0.0;
+                for (int i = 0; i < BlipBuffer::KERNEL_WIDTH; i++)
+                {
+                    // 离冲激中心的距离，相位越大冲激越靠后
+                    double x = (i + 1 - BlipBuffer::HALF_WIDTH) - static_cast<double>(phase) / BlipBuffer::PHASE_COUNT;
+                    double sinc = x == 0.0 ? 1.0 : Sin(PI * CUTOFF * x) / (PI * CUTOFF * x);
+                    double w = (x + BlipBuffer::HALF_WIDTH) / BlipBuffer::KERNEL_WIDTH;
+                    double window = 0.42 - 0.5 * Cos(2 * PI * w) + 0.08 * Cos(4 * PI * w);
+                    taps[i] = sinc * window;
+                    sum += taps[i];
+                }
+
+                // 每个相位的和正好是UNIT，积分以后一个变化量正好变delta，不会慢慢漂
+                int total = 0;
+                int largest = 0;
+                for (int i = 0; i < BlipBuffer::KERNEL_WIDTH; i++)
+                {
+                    double value = taps[i] / sum * UNIT;
+                    result[phase][i] = static_cast<std::int32_t>(value < 0 ? value - 0.5 : value + 0.5);
+                    total += result[phase][i];
+                    if (result[phase][i] > result[phase][largest])
+                        largest = i;
+                }
+                result[phase][largest] += UNIT - total;
+            }
+            return result;
+        }
+
+        constexpr auto STEP_KERNEL = GenerateStepKernel();
+    }
+
+    namespace
+    {
+        static_assert(BlipBuffer::KERNEL_WIDTH % 4 == 0);
+
+        inline void AddKernelScalar(std::int64_t* out, const std::int32_t* kernel, std::int32_t delta)
+        {
+            for (int i = 0; i < BlipBuffer::KERNEL_WIDTH; i++)
+                out[i] += static_cast<std::int64_t>(kernel[i]) * delta;
+        }
+
+#if NES_BLIP_HAS_SIMD
+        // 冲激表符号扩展成64位再乘，_mm_mul_epi32只用每个64位的低32位，乘出来是准确的64位，和标量的结果一样
+        NES_TARGET_SSE41 void AddKernelSSE41(std::int64_t* out, const std::int32_t* kernel, std::int32_t delta)
+        {
+            const __m128i d = _mm_set1_epi64x(delta);
+            for (int i = 0; i < BlipBuffer::KERNEL_WIDTH; i += 2)
+            {
+                __m128i k = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(kernel + i)));
+                __m128i o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(out + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi64(o, _mm_mul_epi32(k, d)));
+            }
+        }
+
+        // 一次4个
+        NES_TARGET_AVX2 void AddKernelAVX2(std::int64_t* out, const std::int32_t* kernel, std::int32_t delta)
+        {
+            const __m256i d = _mm256_set1_epi64x(delta);
+            for (int i = 0; i < BlipBuffer::KERNEL_WIDTH; i += 4)
+            {
+                __m256i k = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(kernel + i)));
+                __m256i o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi64(o, _mm256_mul_epi32(k, d)));
+            }
+        }
+
+        bool IsSSE41Supported()
+        {
+#if defined(__GNUC__)
+            return __builtin_cpu_supports("sse4.1");
+#else
+            // CPUID.1:ECX第19位是SSE4.1
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 19)) != 0;
+#endif
+        }
+
+        bool IsAVX2Supported()
+        {
+#if defined(__GNUC__)
+            return __builtin_cpu_supports("avx2");
+#else
+            // CPUID.7.0:EBX第5位是AVX2，还要操作系统保存了YMM寄存器
+            int info[4];
+            __cpuid(info, 1);
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+            if (!osxsave || !avx || (_xgetbv(0) & 0x06) != 0x06)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#endif
+        }
+#endif
+    }
+
+    BlipKernel BlipBuffer::GetBestKernel()
+    {
+#if NES_BLIP_HAS_SIMD
+        if (IsAVX2Supported())
+            return BlipKernel::AVX2;
+        if (IsSSE41Supported())
+            return BlipKernel::SSE41;
+#endif
+        return BlipKernel::Scalar;
+    }
+
+    BlipAddKernelFunc BlipBuffer::GetAddKernel(BlipKernel kernel)
+    {
+        switch (kernel)
+        {
+        case BlipKernel::Scalar:
+            return AddKernelScalar;
+#if NES_BLIP_HAS_SIMD
+        case BlipKernel::SSE41:
+            return IsSSE41Supported() ? AddKernelSSE41 : nullptr;
+        case BlipKernel::AVX2:
+            return IsAVX2Supported() ? AddKernelAVX2 : nullptr;
+#endif
+        default:
+            break;
+        }
+        return nullptr;
+    }
+
+    BlipBuffer::BlipBuffer(std::uint32_t clock_rate, std::uint32_t sample_rate, std::size_t capacity)
+        : m_capacity(capacity), m_buffer(std::make_unique<std::int64_t[]>(capacity + KERNEL_WIDTH))
+    {
+        SetKernel(GetBestKernel());
+        SetRates(clock_rate, sample_rate);
+    }
+
+    void BlipBuffer::SetRates(std::uint32_t clock_rate, std::uint32_t sample_rate)
+    {
+        m_clock_rate = clock_rate;
+        m_sample_rate = sample_rate;
+        // 冲激会往后写KERNEL_WIDTH个，最后一个采样的位置也要留出来
+        m_max_frame_clocks = static_cast<std::uint32_t>(static_cast<std::uint64_t>(m_capacity - 1) * m_clock_rate / m_sample_rate);
+        Clear();
+    }
+
+    void BlipBuffer::Clear()
+    {
+        m_offset = 0;
+        m_integrator = 0;
+        std::fill_n(m_buffer.get(), m_capacity + KERNEL_WIDTH, 0);
+    }
+
+    bool BlipBuffer::SetKernel(BlipKernel kernel)
+    {
+        auto add_kernel = GetAddKernel(kernel);
+        if (add_kernel == nullptr)
+            return false;
+        // 标量的直接在AddKernel里展开，不走函数指针
+        m_add_kernel = kernel == BlipKernel::Scalar ? nullptr : add_kernel;
+        return true;
+    }
+
+    void BlipBuffer::AddKernel(std::size_t index, std::size_t phase, std::int32_t delta)
+    {
+        if (m_add_kernel == nullptr)
+            AddKernelScalar(m_buffer.get() + index, meta::STEP_KERNEL[phase].data(), delta);
+        else
+            m_add_kernel(m_buffer.get() + index, meta::STEP_KERNEL[phase].data(), delta);
+    }
+
+    void BlipBuffer::EndFrame(std::uint32_t clock_duration)
+    {
+        m_offset += static_cast<std::uint64_t>(clock_duration) * m_sample_rate;
+    }
+
+    std::size_t BlipBuffer::ReadSamples(std::int32_t* out, std::size_t count)
+    {
+        count = std::min(count, GetSamplesAvailable());
+        for (std::size_t i = 0; i < count; i++)
+        {
+            m_integrator += m_buffer[i];
+            std::int64_t sample = m_integrator >> KERNEL_UNIT_BITS;
+            out[i] = static_cast<std::int32_t>(sample);
+            // 积分值慢慢回到0，输出的直流就没了
+            m_integrator -= sample << (KERNEL_UNIT_BITS - BASS_SHIFT);
+        }
+
+        // 没读的和还没轮到的冲激挪到前面
+        std::size_t remaining = GetSamplesAvailable() - count + KERNEL_WIDTH;
+        std::copy_n(m_buffer.get() + count, remaining, m_buffer.get());
+        std::fill_n(m_buffer.get() + remaining, count, 0);
+        m_offset -= static_cast<std::uint64_t>(count) * m_clock_rate;
+        return count;
+    }
+}
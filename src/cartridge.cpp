@@ -2,7 +2,6 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
-#include "mappers/mapper_headers.h"
 
 
 namespace nes
@@ -116,7 +115,7 @@ namespace nes
             }
 
             // 上面那个额外ram标记就跟闹着玩一样。如果mapper需要标记，但是上面没创建，就再创建一遍
-            if (m_PRG_Ram == nullptr && m_mapper->HasExtendPRGRam())
+            if (m_PRG_Ram == nullptr && GetMapperInterface()->HasExtendPRGRam())
             {
                 m_PRG_Ram = std::make_unique<std::uint8_t[]>(PRG_Ram_size);
             }
@@ -132,7 +131,7 @@ namespace nes
     {
         #define MAPPER_CASE(n) \
         case n: \
-            m_mapper = std::make_unique<Mapper##n>(this); \
+            m_mapper.emplace<Mapper##n>(this); \
             break \
 
         switch (m_mapper_id)
@@ -0,0 +1,36 @@
+#include "chr_tile_cache.h"
+#include <cstring>
+
+namespace nes
+{
+    void CHRTileCache::Resize(std::size_t tile_count)
+    {
+        // 只是分配，用到的时候才解码
+        m_tiles = std::make_unique_for_overwrite<DecodedTile[]>(tile_count);
+        m_valid = std::make_unique<std::uint8_t[]>(tile_count);
+        m_tile_count = tile_count;
+    }
+
+    void CHRTileCache::Clear()
+    {
+        if (m_valid != nullptr)
+            std::memset(m_valid.get(), 0, m_tile_count);
+    }
+
+    void CHRTileCache::Decode(std::size_t index, const std::uint8_t* data)
+    {
+        auto& tile = m_tiles[index];
+        for (int y = 0; y < 8; y++)
+        {
+            std::uint8_t low = data[y];
+            std::uint8_t high = data[y + 8];
+            for (int x = 0; x < 8; x++)
+            {
+                std::uint8_t color = ((low >> (7 - x)) & 0x01) | (((high >> (7 - x)) & 0x01) << 1);
+                tile.pixels[(y << 3) | x] = color;
+                tile.flipped[(y << 3) | (7 - x)] = color;
+            }
+        }
+        m_valid[index] = 1;
+    }
+}
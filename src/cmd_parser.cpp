@@ -228,6 +228,20 @@ namespace nes_support
         key_code = key_iter->second;
     }
 
+    template <>
+    void SetValue<nes::AudioFormat>(nes::AudioFormat& format, const IniSection& section, std::string_view key_name)
+    {
+        if (!section.ExistValue(key_name))
+            return;
+        auto val = section.GetValue(key_name);
+        if (val == "u8")
+            format = nes::AudioFormat::U8;
+        else if (val == "s16")
+            format = nes::AudioFormat::S16;
+        else if (val == "f32")
+            format = nes::AudioFormat::F32;
+    }
+
     template <>
     void SetValue<std::string>(std::string& value, const IniSection& section, std::string_view key_name)
     {
@@ -307,6 +321,10 @@ namespace nes_support
             SetValue(config.Base.Scale, section, "scale");
             config.Base.Scale = std::clamp(config.Base.Scale, 1, 10);
             SetValue(config.Base.JoystickDeadZone, section, "joystick_deadzone");
+            SetValue(config.Base.PaletteIndexFrame, section, "palette_index_frame");
+            SetValue(config.Base.AudioSampleFormat, section, "audio_format");
+            SetValue(config.Base.AudioFrequency, section, "audio_frequency");
+            config.Base.AudioFrequency = std::clamp(config.Base.AudioFrequency, nes::AUDIO_MIN_FREQ, nes::AUDIO_MAX_FREQ);
         }
 
         return config;
@@ -1,8 +1,11 @@
 #include "cpu.h"
 #include "cpu_disassembly.h"
 #include "cpu_instructions.h"
+#include <algorithm>
 #include <type_traits>
 #include "def.h"
+#include "scheduler.h"
+#include "emulator.h"
 
 namespace nes
 {
@@ -20,13 +23,33 @@ namespace nes
     CPU6502::CPU6502()
     {
         CPU6502Disassembly::GetInstance().Init(this);
+#if defined(NES_CPU_JIT)
+        SetJITEnabled(true);
+#endif
+    }
+
+    void CPU6502::SetJITEnabled(bool enabled)
+    {
+        if (!enabled)
+            m_JIT = nullptr;
+        else if (m_JIT == nullptr)
+            m_JIT = std::make_unique<CPU6502JIT>(*this);
+    }
+
+    void CPU6502::SetBus(NesEmulator* bus)
+    {
+        m_bus = bus;
+        m_block_cache.SetMemoryMap(&bus->GetMemoryMap());
     }
 
     void CPU6502::Reset()
     {
+        m_block_cache.Clear();
+        if (m_JIT != nullptr)
+            m_JIT->Clear();
         m_A = m_X = m_Y = 0;
         m_SP = 0xfd;
-        m_P = 0x24;
+        SetP(0x24);
         m_PC = ReadAddress(RESET_ADDRESS);
     }
 
@@ -43,10 +66,64 @@ namespace nes
                 // 如果这种情况CPU会做错误处理
                 m_PC = ReadAddress(NMI_VECTOR);
             }
+        }
+        else
+        {
+            ExecuteInstruction();
+        }
+        --m_skip_cycles; // 本周期已经执行过了，所以-1
+        m_scheduler->Advance(CPU_CLOCK_DIVIDER);
+    }
+
+    void CPU6502::RunUntilSwitch(std::uint64_t deadline)
+    {
+        while (true)
+        {
+            auto timestamp = m_scheduler->GetTimestamp();
+            if (timestamp >= deadline || m_scheduler->GetNextTimestamp() < timestamp + CPU_CLOCK_DIVIDER)
+                return;
+
+            // 上一条没走完（BRK和IRQ的那几个周期，或者存档里读出来的），还是一个周期一个周期走
+            if (m_skip_cycles > 0)
+            {
+                Step();
+                continue;
+            }
+
+            ++m_cycles;
+            ExecuteInstruction();
+            FinishInstruction();
+        }
+    }
+
+    inline void CPU6502::FinishInstruction()
+    {
+        // BRK和IRQ进中断的那几个周期里NMI来了会被抢，要让外面在每个周期之间处理事件
+        if (m_is_executing_interrupt && m_executing_interrupt_type != CPU6502InterruptType::NMI)
+        {
             --m_skip_cycles;
+            m_scheduler->Advance(CPU_CLOCK_DIVIDER);
             return;
         }
-        
+
+        // 读写都在第一个周期做完了，剩下的周期里CPU什么都看不到，直接跳过去
+        // 非法指令周期数是0，减了以后会变成65535，和一个周期一个周期走的时候一样
+        --m_skip_cycles;
+        m_cycles += m_skip_cycles;
+        m_scheduler->Advance((m_skip_cycles + 1ull) * CPU_CLOCK_DIVIDER);
+        m_skip_cycles = 0;
+    }
+
+    inline bool CPU6502::HasPendingInterrupt() const
+    {
+        // 和ExecuteInstruction里的判断一样
+        if (m_current_interrupt == 0 || m_is_executing_interrupt)
+            return false;
+        return (m_current_interrupt & (1 << static_cast<int>(CPU6502InterruptType::NMI))) != 0 || !GetI();
+    }
+
+    void CPU6502::ExecuteInstruction()
+    {
         // 执行中断
         if (m_current_interrupt != 0 && !m_is_executing_interrupt)
         {
@@ -54,7 +131,6 @@ namespace nes
             {
                 InterruptExecute(CPU6502InterruptType::NMI);
                 m_current_interrupt = 0;
-                --m_skip_cycles; // 本周期已经执行过了，所以-1
                 return;
             }
             else if (m_current_interrupt & (1 << static_cast<int>(CPU6502InterruptType::IRQ)))
@@ -63,7 +139,6 @@ namespace nes
                 {
                     InterruptExecute(CPU6502InterruptType::IRQ);
                     m_current_interrupt = 0;
-                    --m_skip_cycles; // 本周期已经执行过了，所以-1
                     return;
                 }
             }
@@ -72,20 +147,24 @@ namespace nes
         m_is_executing_interrupt = false;
 
         // 读取指令
-        std::uint8_t op_code = m_main_bus_read(m_PC++);
+        std::uint8_t op_code = m_bus->MainBusRead(m_PC++);
         // CPU6502Disassembly::GetInstance().ShowCPUInfo(op_code);
         ExecuteCode(op_code);
-        --m_skip_cycles; // 本周期已经执行过了，所以-1
     }
 
-    void CPU6502::Interrupt(CPU6502InterruptType type)
+    void CPU6502::PushStack(std::uint8_t value)
     {
-        m_current_interrupt |= (1 << static_cast<int>(type));
+        m_bus->MainBusWrite(0x100 | m_SP--, value);
+    }
+
+    std::uint8_t CPU6502::PullStack()
+    {
+        return m_bus->MainBusRead(0x100 | ++m_SP);
     }
 
     std::uint16_t CPU6502::ReadAddress(std::uint16_t start_address)
     {
-        return m_main_bus_read(start_address) | (static_cast<std::uint16_t>(m_main_bus_read(start_address + 1)) << 8);
+        return m_bus->MainBusRead(start_address) | (static_cast<std::uint16_t>(m_bus->MainBusRead(start_address + 1)) << 8);
     }
 
     void CPU6502::SkipOAMDMACycle()
@@ -96,13 +175,15 @@ namespace nes
     void CPU6502::InterruptExecute(CPU6502InterruptType type)
     {
         m_is_executing_interrupt = true;
+        // 后面几个周期要一个一个走，线程化分派得回去走慢的那条路
+        m_batch_end = 0;
         m_executing_interrupt_type = type;
         if (type == CPU6502InterruptType::BRK)
             m_PC++;
         PushStack(static_cast<std::uint8_t>(m_PC >> 8));
         PushStack(static_cast<std::uint8_t>(m_PC));
         SetFlag(B, type == CPU6502InterruptType::BRK);
-        PushStack(m_P);
+        PushStack(GetP());
         SetFlag(I, true);
         switch (type)
         {
@@ -136,13 +217,13 @@ namespace nes
             if constexpr (std::is_void_v<Arg>) // 将寄存器的值存储到内存的时候使用的那几个指令
             {
                 static_assert(std::is_same_v<R, std::uint8_t>, "Instruction must return std::uint8_t");
-                m_main_bus_write(addr, (this->*instruction)());
+                m_bus->MainBusWrite(addr, (this->*instruction)());
             }
             else if constexpr (std::is_same_v<Arg, std::uint8_t>) // 传入从地址读出来的数
             {
-                std::uint8_t val = m_main_bus_read(addr);
+                std::uint8_t val = m_bus->MainBusRead(addr);
                 if constexpr (!std::is_void_v<R>) // 返回值不为空说明要写进地址里
-                    m_main_bus_write(addr, (this->*instruction)(val));
+                    m_bus->MainBusWrite(addr, (this->*instruction)(val));
                 else
                     (this->*instruction)(val);
             }
@@ -161,23 +242,28 @@ namespace nes
         if constexpr (std::is_void_v<R>)
             (this->*instruction)();
         else
-            m_main_bus_write(addr, (this->*instruction)());
-    }
+            m_bus->MainBusWrite(addr, (this->*instruction)());
+    }
+
+    // 一条指令的寻址、执行和周期数，几种分派共用
+    // operand_为空的时候寻址从PC读操作数，解码缓存里的指令传进来已经读好的操作数
+    #define EXECUTE_OPERATION(operand_, instruction_, addressing_, cycles_, ...) \
+        if constexpr (std::is_same_v<decltype(addressing_()), int>) \
+            CombineAddressingAndInstruction(&CPU6502::instruction_, 0); \
+        else \
+            CombineAddressingAndInstruction(&CPU6502::instruction_, addressing_(operand_)); \
+        m_skip_cycles += cycles_; \
+        if constexpr (0##__VA_ARGS__) \
+        { \
+            if (m_cross_page) \
+                m_skip_cycles += 1; \
+        } \
 
     void CPU6502::ExecuteCode(std::uint8_t op_code)
     {
         #define OPERATION(op_code_, instruction_, addressing_, cycles_, ...) \
         case op_code_: \
-            if constexpr (std::is_same_v<decltype(addressing_()), int>) \
-                CombineAddressingAndInstruction(&CPU6502::instruction_, 0); \
-            else \
-                CombineAddressingAndInstruction(&CPU6502::instruction_, addressing_()); \
-            m_skip_cycles += cycles_; \
-            if constexpr (0##__VA_ARGS__) \
-            { \
-                if (m_cross_page) \
-                    m_skip_cycles += 1; \
-            } \
+            EXECUTE_OPERATION(, instruction_, addressing_, cycles_, __VA_ARGS__) \
             break; \
 
         switch (op_code)
@@ -188,91 +274,286 @@ namespace nes
         #undef OPERATION
     }
 
+    void CPU6502::RunUntilThreaded(std::uint64_t deadline)
+    {
+#if NES_CPU_HAS_THREADED_DISPATCH
+        // 每条指令一个标签，执行完以后在自己的标签里直接跳到下一条指令，
+        // 这样每条指令都有自己的间接跳转，分支预测能按前一条指令分开记，不像switch全挤在一个跳转上
+        #define OPERATION(op_code_, ...) &&op_##op_code_,
+        static const void* const handlers[256] = { CPU6502_ALL_INSTRUCTIONS };
+        #undef OPERATION
+
+        // 时间和事件的检查都在check里一批做一次，每条指令后面只比较一下这一批有没有结束
+        #define OPERATION(op_code_, instruction_, addressing_, cycles_, ...) \
+        op_##op_code_: \
+            EXECUTE_OPERATION(, instruction_, addressing_, cycles_, __VA_ARGS__) \
+            FinishInstruction(); \
+            if (m_scheduler->GetTimestamp() >= m_batch_end) \
+                goto check; \
+            ++m_cycles; \
+            goto *handlers[m_bus->MainBusRead(m_PC++)]; \
+
+    check:
+        {
+            // 和RunUntilSwitch的循环一样：到时间或者有事件就返回，有中断或者上一条没走完就走慢的那条路
+            auto timestamp = m_scheduler->GetTimestamp();
+            auto next_timestamp = m_scheduler->GetNextTimestamp();
+            if (timestamp >= deadline || next_timestamp < timestamp + CPU_CLOCK_DIVIDER)
+                return;
+            if (m_skip_cycles > 0)
+            {
+                Step();
+                goto check;
+            }
+            if (HasPendingInterrupt())
+            {
+                ++m_cycles;
+                ExecuteInstruction();
+                FinishInstruction();
+                goto check;
+            }
+
+            // 这一批一直跑到deadline或者下一个事件之前，中间访问了寄存器或者进了BRK会把m_batch_end清零提前回来
+            // 有IRQ等着但是被屏蔽了的话，CLI、PLP、RTI以后就要进中断，只能每条指令都回来检查
+            if (m_current_interrupt != 0)
+                m_batch_end = timestamp + 1;
+            else
+                m_batch_end = std::min(deadline, next_timestamp - CPU_CLOCK_DIVIDER + 1);
+            m_is_executing_interrupt = false;
+            ++m_cycles;
+            goto *handlers[m_bus->MainBusRead(m_PC++)];
+        }
+
+        CPU6502_ALL_INSTRUCTIONS
+
+        #undef OPERATION
+#else
+        RunUntilSwitch(deadline);
+#endif
+    }
+
+    #define OPERATION(op_code_, instruction_, addressing_, cycles_, ...) \
+    template<> void CPU6502::ExecuteDecoded<op_code_>(std::uint16_t operand) \
+    { \
+        EXECUTE_OPERATION(operand, instruction_, addressing_, cycles_, __VA_ARGS__) \
+    } \
+
+    CPU6502_ALL_INSTRUCTIONS
+
+    #undef OPERATION
+    #undef EXECUTE_OPERATION
+
+    DecodedInstruction::Execute CPU6502::GetDecodedExecute(std::uint8_t op_code)
+    {
+        #define OPERATION(op_code_, ...) \
+            [](CPU6502& CPU, std::uint16_t operand) { CPU.ExecuteDecoded<op_code_>(operand); }, \
+
+        static constexpr std::array<DecodedInstruction::Execute, 256> executes = { CPU6502_ALL_INSTRUCTIONS };
+
+        #undef OPERATION
+
+        return executes[op_code];
+    }
+
+    void CPU6502::RunUntilCached(std::uint64_t deadline)
+    {
+        while (true)
+        {
+            auto timestamp = m_scheduler->GetTimestamp();
+            if (timestamp >= deadline || m_scheduler->GetNextTimestamp() < timestamp + CPU_CLOCK_DIVIDER)
+                return;
+
+            if (m_skip_cycles > 0)
+            {
+                Step();
+                continue;
+            }
+
+            // 要进中断或者代码不在ROM里，就和RunUntilSwitch一样执行一条
+            const DecodedBlock* block = HasPendingInterrupt() ? nullptr : m_block_cache.GetBlock(m_PC);
+            if (block == nullptr)
+            {
+                ++m_cycles;
+                ExecuteInstruction();
+                FinishInstruction();
+                continue;
+            }
+
+            m_is_executing_interrupt = false;
+            auto generation = m_bus->GetMemoryMap().generation;
+
+            // 有中断在等着的话（进IRQ、BRK的时候来了NMI，或者IRQ被屏蔽着），和RunUntilThreaded一样每条指令都要回来检查，
+            // 机器码中间不检查，所以走下面解码缓存的循环
+            if (m_JIT != nullptr && m_current_interrupt == 0)
+            {
+                // 机器码中间不检查时间和事件，最坏情况下跑到最后一条指令之前也不会到deadline、不会有事件才能进去
+                auto compiled = m_JIT->GetBlock(block, m_PC);
+                if (compiled != nullptr && timestamp + compiled->guard_cycles * CPU_CLOCK_DIVIDER < deadline
+                    && timestamp + (compiled->guard_cycles + 1ull) * CPU_CLOCK_DIVIDER <= m_scheduler->GetNextTimestamp())
+                {
+                    auto result = compiled->entry(this, &m_bus->GetMemoryMap());
+                    auto cycles = static_cast<std::uint32_t>(result);
+                    m_cycles += cycles;
+                    m_scheduler->Advance(cycles * CPU_CLOCK_DIVIDER);
+                    // 停在了访问寄存器之类的指令上，前面的指令之后本来就不会停，所以直接解释执行这一条
+                    if (result & CPU6502JIT::INTERPRET_NEXT)
+                    {
+                        ++m_cycles;
+                        ExecuteInstruction();
+                        FinishInstruction();
+                    }
+                    continue;
+                }
+            }
+
+            for (std::size_t i = 0; ; )
+            {
+                const auto& instruction = block->instructions[i];
+                ++m_cycles;
+                m_PC += instruction.length;
+                instruction.execute(*this, instruction.operand);
+                FinishInstruction();
+
+                if (++i == block->count)
+                    break;
+                // 块里的每条指令之间也和一条一条执行的时候一样检查，另外换了bank的话后面的指令就不对了
+                timestamp = m_scheduler->GetTimestamp();
+                if (timestamp >= deadline || m_scheduler->GetNextTimestamp() < timestamp + CPU_CLOCK_DIVIDER)
+                    return;
+                if (m_skip_cycles > 0 || HasPendingInterrupt() || m_bus->GetMemoryMap().generation != generation)
+                    break;
+            }
+        }
+    }
+
     // =========================================
     // 寻址模式
     // =========================================
 
+    // 寻址的时候先从PC读操作数，再按操作数算地址，解码缓存里的指令操作数已经读好了，直接算地址
+
     // 立即寻址
     std::uint8_t CPU6502::Immediate()
     {
-        return m_main_bus_read(m_PC++);
+        return m_bus->MainBusRead(m_PC++);
+    }
+
+    std::uint8_t CPU6502::Immediate(std::uint16_t operand)
+    {
+        return static_cast<std::uint8_t>(operand);
     }
 
     // 绝对寻址
     std::uint16_t CPU6502::Absolute()
     {
-        std::uint16_t address = m_main_bus_read(m_PC++);
-        address |= static_cast<std::uint16_t>(m_main_bus_read(m_PC++)) << 8;
+        std::uint16_t address = m_bus->MainBusRead(m_PC++);
+        address |= static_cast<std::uint16_t>(m_bus->MainBusRead(m_PC++)) << 8;
         return address;
     }
 
+    std::uint16_t CPU6502::Absolute(std::uint16_t operand)
+    {
+        return operand;
+    }
+
     std::uint16_t CPU6502::ZeroPage()
     {
-        std::uint16_t address = m_main_bus_read(m_PC++);
+        std::uint16_t address = m_bus->MainBusRead(m_PC++);
         return address;
     }
 
+    std::uint16_t CPU6502::ZeroPage(std::uint16_t operand)
+    {
+        return operand;
+    }
+
     std::uint8_t CPU6502::Accumulator()
     {
         return m_A;
     }
 
+    std::uint8_t CPU6502::Accumulator(std::uint16_t operand)
+    {
+        return m_A;
+    }
+
     std::uint16_t CPU6502::AbsoluteX()
     {
-        std::uint16_t address = m_main_bus_read(m_PC++);
-        address |= static_cast<std::uint16_t>(m_main_bus_read(m_PC++)) << 8;
-        m_cross_page = (address ^ (address + m_X)) >> 8 != 0;
-        address += m_X;
-        return address;
+        return AbsoluteX(Absolute());
+    }
+
+    std::uint16_t CPU6502::AbsoluteX(std::uint16_t operand)
+    {
+        m_cross_page = (operand ^ (operand + m_X)) >> 8 != 0;
+        return operand + m_X;
     }
 
     std::uint16_t CPU6502::AbsoluteY()
     {
-        std::uint16_t address = m_main_bus_read(m_PC++);
-        address |= static_cast<std::uint16_t>(m_main_bus_read(m_PC++)) << 8;
-        m_cross_page = (address ^ (address + m_Y)) >> 8 != 0;
-        address += m_Y;
-        return address;
+        return AbsoluteY(Absolute());
+    }
+
+    std::uint16_t CPU6502::AbsoluteY(std::uint16_t operand)
+    {
+        m_cross_page = (operand ^ (operand + m_Y)) >> 8 != 0;
+        return operand + m_Y;
     }
 
     std::uint16_t CPU6502::ZeroPageX()
     {
-        std::uint16_t address = m_main_bus_read(m_PC++);
-        address = (address + m_X) & 0xff;
-        return address;
+        return ZeroPageX(ZeroPage());
+    }
+
+    std::uint16_t CPU6502::ZeroPageX(std::uint16_t operand)
+    {
+        return (operand + m_X) & 0xff;
     }
 
     std::uint16_t CPU6502::ZeroPageY()
     {
-        std::uint16_t address = m_main_bus_read(m_PC++);
-        address = (address + m_Y) & 0xff;
-        return address;
+        return ZeroPageY(ZeroPage());
+    }
+
+    std::uint16_t CPU6502::ZeroPageY(std::uint16_t operand)
+    {
+        return (operand + m_Y) & 0xff;
     }
 
     std::uint16_t CPU6502::Indirect()
+    {
+        return Indirect(Absolute());
+    }
+
+    std::uint16_t CPU6502::Indirect(std::uint16_t operand)
     {
         // 这个仅用于JMP，而且还有bug
-        std::uint16_t address_tmp = m_main_bus_read(m_PC++);
-        address_tmp |= static_cast<std::uint16_t>(m_main_bus_read(m_PC++)) << 8;
-        std::uint16_t addresss_first = (address_tmp & 0xff00) | ((address_tmp + 1) & 0x00ff);
-        std::uint16_t address = m_main_bus_read(address_tmp);
-        address |= static_cast<std::uint16_t>(m_main_bus_read(addresss_first)) << 8;
+        std::uint16_t addresss_first = (operand & 0xff00) | ((operand + 1) & 0x00ff);
+        std::uint16_t address = m_bus->MainBusRead(operand);
+        address |= static_cast<std::uint16_t>(m_bus->MainBusRead(addresss_first)) << 8;
         return address;
     }
 
     std::uint16_t CPU6502::IndirectX()
     {
-        std::uint16_t op = static_cast<std::uint16_t>(m_main_bus_read(m_PC++));
-        std::uint16_t address = m_main_bus_read((op + m_X) & 0xff);
-        address |= static_cast<std::uint16_t>(m_main_bus_read((op + m_X + 1) & 0xff)) << 8;
+        return IndirectX(ZeroPage());
+    }
+
+    std::uint16_t CPU6502::IndirectX(std::uint16_t operand)
+    {
+        std::uint16_t address = m_bus->MainBusRead((operand + m_X) & 0xff);
+        address |= static_cast<std::uint16_t>(m_bus->MainBusRead((operand + m_X + 1) & 0xff)) << 8;
         return address;
     }
 
     std::uint16_t CPU6502::IndirectY()
     {
-        std::uint16_t op = static_cast<std::uint16_t>(m_main_bus_read(m_PC++));
-        std::uint16_t address = m_main_bus_read(op);
-        address |= static_cast<std::uint16_t>(m_main_bus_read((op + 1) & 0xff)) << 8;
+        return IndirectY(ZeroPage());
+    }
+
+    std::uint16_t CPU6502::IndirectY(std::uint16_t operand)
+    {
+        std::uint16_t address = m_bus->MainBusRead(operand);
+        address |= static_cast<std::uint16_t>(m_bus->MainBusRead((operand + 1) & 0xff)) << 8;
         m_cross_page = (address ^ (address + m_Y)) >> 8 != 0;
         address += m_Y;
         return address;
@@ -280,8 +561,13 @@ namespace nes
 
     std::uint16_t CPU6502::Relative()
     {
-        std::uint8_t m_src = m_main_bus_read(m_PC++);
-        return m_PC + static_cast<std::int8_t>(m_src);
+        return Relative(ZeroPage());
+    }
+
+    std::uint16_t CPU6502::Relative(std::uint16_t operand)
+    {
+        // PC已经指到下一条指令了
+        return m_PC + static_cast<std::int8_t>(operand);
     }
 
     // =========================================
@@ -291,8 +577,7 @@ namespace nes
     void CPU6502::ADC(std::uint8_t src)
     {
         std::uint16_t tmp = static_cast<std::uint16_t>(src) + m_A + (GetC() ? 1 : 0);
-        SetFlag(Z, (tmp & 0xff) == 0);
-        SetFlag(N, tmp & 0x80);
+        SetNZ(static_cast<std::uint8_t>(tmp));
         SetFlag(C, tmp > 0xff);
         SetFlag(V, (tmp ^ m_A) & (tmp ^ src) & 0x80);
         m_A = static_cast<std::uint8_t>(tmp & 0xff);
@@ -301,16 +586,14 @@ namespace nes
     void CPU6502::AND(std::uint8_t src)
     {
         m_A = static_cast<std::uint8_t>(src & m_A);
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0x00);
+        SetNZ(m_A);
     }
 
     std::uint8_t CPU6502::ASL(std::uint8_t src)
     {
         SetFlag(C, src & 0x80);
         src = (src << 1) & 0xff;
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         return src;
     }
 
@@ -343,9 +626,10 @@ namespace nes
 
     void CPU6502::BIT(std::uint8_t  src)
     {
-        SetFlag(N, src & 0x80);
+        // N是src的第7位，Z看的是m_A & src，两个不是同一个值
+        m_N_value = src;
+        m_Z_value = m_A & src;
         SetFlag(V, src & 0x40);
-        SetFlag(Z, (m_A & src) == 0);
     }
 
     void CPU6502::BMI(std::uint16_t addr)
@@ -422,75 +706,65 @@ namespace nes
     {
         std::uint16_t tmp = static_cast<std::uint16_t>(m_A) - src;
         SetFlag(C, tmp < 0x100);
-        SetFlag(N, tmp & 0x80);
-        SetFlag(Z, (tmp & 0xff) == 0);
+        SetNZ(static_cast<std::uint8_t>(tmp));
     }
 
     void CPU6502::CPX(std::uint8_t src)
     {
         std::uint16_t tmp = static_cast<std::uint16_t>(m_X) - src;
         SetFlag(C, tmp < 0x100);
-        SetFlag(N, tmp & 0x80);
-        SetFlag(Z, (tmp & 0xff) == 0);
+        SetNZ(static_cast<std::uint8_t>(tmp));
     }
 
     void CPU6502::CPY(std::uint8_t src)
     {
         std::uint16_t tmp = static_cast<std::uint16_t>(m_Y) - src;
         SetFlag(C, tmp < 0x100);
-        SetFlag(N, tmp & 0x80);
-        SetFlag(Z, (tmp & 0xff) == 0);
+        SetNZ(static_cast<std::uint8_t>(tmp));
     }
 
     std::uint8_t CPU6502::DEC(std::uint8_t src)
     {
         --src;
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         return src;
     }
 
     void CPU6502::DEX()
     {
         --m_X;
-        SetFlag(N, m_X & 0x80);
-        SetFlag(Z, m_X == 0);
+        SetNZ(m_X);
     }
 
     void CPU6502::DEY()
     {
         --m_Y;
-        SetFlag(N, m_Y & 0x80);
-        SetFlag(Z, m_Y == 0);
+        SetNZ(m_Y);
     }
 
     void CPU6502::EOR(std::uint8_t src)
     {
         m_A ^= src;
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
     }
 
     std::uint8_t CPU6502::INC(std::uint8_t src)
     {
         ++src;
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         return src;
     }
 
     void CPU6502::INX()
     {
         ++m_X;
-        SetFlag(N, m_X & 0x80);
-        SetFlag(Z, m_X == 0);
+        SetNZ(m_X);
     }
 
     void CPU6502::INY()
     {
         ++m_Y;
-        SetFlag(N, m_Y & 0x80);
-        SetFlag(Z, m_Y == 0);
+        SetNZ(m_Y);
     }
 
     void CPU6502::JMP(std::uint16_t addr)
@@ -508,22 +782,19 @@ namespace nes
 
     void CPU6502::LDA(std::uint8_t src)
     {
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         m_A = src;
     }
 
     void CPU6502::LDX(std::uint8_t src)
     {
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         m_X = src;
     }
 
     void CPU6502::LDY(std::uint8_t src)
     {
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         m_Y = src;
     }
 
@@ -531,8 +802,7 @@ namespace nes
     {
         SetFlag(C, src & 0x01);
         src >>= 1;
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         return src;
     }
 
@@ -543,8 +813,7 @@ namespace nes
     void CPU6502::ORA(std::uint8_t src)
     {
         m_A |= src;
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
     }
 
     void CPU6502::PHA()
@@ -554,21 +823,19 @@ namespace nes
 
     void CPU6502::PHP()
     {
-        PushStack(m_P | (1 << 4));
+        PushStack(GetP() | (1 << 4));
     }
 
     void CPU6502::PLA()
     {
         m_A = PullStack();
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
     }
 
     void CPU6502::PLP()
     {
         std::uint8_t val = PullStack();
-        m_P &= (1 << 4);
-        m_P |= (val & ~(1 << 4)) | (1 << 5);
+        SetP((m_P & (1 << 4)) | (val & ~(1 << 4)) | (1 << 5));
     }
 
     std::uint8_t CPU6502::ROL(std::uint8_t src)
@@ -576,8 +843,7 @@ namespace nes
         bool carry = static_cast<bool>(src & 0x80);
         src = (src << 1) | (GetC() ? 1 : 0);
         SetFlag(C, carry);
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         return src;
     }
 
@@ -586,15 +852,14 @@ namespace nes
         bool carry = GetC();
         SetFlag(C, src & 0x01);
         src = (src >> 1) | (carry ? 0x80 : 0);
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
         return src;
     }
 
     void CPU6502::RTI()
     {
         std::uint8_t tmp = PullStack();
-        m_P = (m_P & 0x30) | (tmp & ~0x30);
+        SetP((m_P & 0x30) | (tmp & ~0x30));
         std::uint16_t val = PullStack();
         val |= static_cast<std::uint16_t>(PullStack()) << 8;
         m_PC = val;
@@ -610,8 +875,7 @@ namespace nes
     void CPU6502::SBC(std::uint8_t src)
     {
         std::uint16_t tmp = m_A - src - (GetC() ? 0 : 1);
-        SetFlag(Z, (tmp & 0xff) == 0);
-        SetFlag(N, tmp & 0x80);
+        SetNZ(static_cast<std::uint8_t>(tmp));
         SetFlag(C, tmp < 0x100);
         SetFlag(V, (tmp ^ m_A) & (tmp ^ ~src) & 0x80);
         m_A = static_cast<std::uint8_t>(tmp & 0xff);
@@ -649,29 +913,25 @@ namespace nes
 
     void CPU6502::TAX()
     {
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
         m_X = m_A;
     }
 
     void CPU6502::TAY()
     {
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
         m_Y = m_A;
     }
 
     void CPU6502::TSX()
     {
-        SetFlag(N, m_SP & 0x80);
-        SetFlag(Z, m_SP == 0);
+        SetNZ(m_SP);
         m_X = m_SP;
     }
 
     void CPU6502::TXA()
     {
-        SetFlag(N, m_X & 0x80);
-        SetFlag(Z, m_X == 0);
+        SetNZ(m_X);
         m_A = m_X;
     }
 
@@ -682,8 +942,7 @@ namespace nes
 
     void CPU6502::TYA()
     {
-        SetFlag(N, m_Y & 0x80);
-        SetFlag(Z, m_Y == 0);
+        SetNZ(m_Y);
         m_A = m_Y;
     }
 
@@ -695,8 +954,7 @@ namespace nes
         std::uint8_t val = src << 1;
         SetFlag(C, src & 0x80);
         m_A |= val;
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
         return val;
     }
 
@@ -706,8 +964,7 @@ namespace nes
         src = (src << 1) | (GetC() ? 1 : 0);
         SetFlag(C, carry);
         m_A &= src;
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
         return src;
     }
 
@@ -716,8 +973,7 @@ namespace nes
         SetFlag(C, src & 0x01);
         std::uint8_t val = src >> 1;
         m_A ^= val;
-        SetFlag(N, m_A & 0x80);
-        SetFlag(Z, m_A == 0);
+        SetNZ(m_A);
         return val;
     }
 
@@ -727,8 +983,7 @@ namespace nes
         src = (src >> 1) | (GetC() ? 0x80 : 0);
 
         std::uint16_t tmp = static_cast<std::uint16_t>(src) + m_A + tmp_C;
-        SetFlag(Z, (tmp & 0xff) == 0);
-        SetFlag(N, tmp & 0x80);
+        SetNZ(static_cast<std::uint8_t>(tmp));
         SetFlag(C, tmp > 0xff);
         SetFlag(V, (tmp ^ m_A) & (tmp ^ src) & 0x80);
         m_A = static_cast<std::uint8_t>(tmp & 0xff);
@@ -745,16 +1000,14 @@ namespace nes
     {
         m_A = src;
         m_X = src;
-        SetFlag(N, src & 0x80);
-        SetFlag(Z, src == 0);
+        SetNZ(src);
     }
 
     std::uint8_t CPU6502::DCP(std::uint8_t src)
     {
         --src;
         SetFlag(C, m_A >= src);
-        SetFlag(N, (m_A - src) & 0x80);
-        SetFlag(Z, src == m_A);
+        SetNZ(static_cast<std::uint8_t>(m_A - src));
         return src;
     }
 
@@ -763,8 +1016,7 @@ namespace nes
         ++src;
         
         std::uint16_t tmp = m_A - src - (GetC() ? 0 : 1);
-        SetFlag(Z, (tmp & 0xff) == 0);
-        SetFlag(N, tmp & 0x80);
+        SetNZ(static_cast<std::uint8_t>(tmp));
         SetFlag(C, tmp < 0x100);
         SetFlag(V, (tmp ^ m_A) & (tmp ^ ~src) & 0x80);
         m_A = static_cast<std::uint8_t>(tmp & 0xff);
@@ -780,7 +1032,7 @@ namespace nes
 
         pointer = UnsafeWrite(pointer, m_PC);
         pointer = UnsafeWrite(pointer, m_SP);
-        pointer = UnsafeWrite(pointer, m_P);
+        pointer = UnsafeWrite(pointer, GetP());
         pointer = UnsafeWrite(pointer, m_A);
         pointer = UnsafeWrite(pointer, m_X);
         pointer = UnsafeWrite(pointer, m_Y);
@@ -808,7 +1060,9 @@ namespace nes
 
         pointer = UnsafeRead(pointer, m_PC);
         pointer = UnsafeRead(pointer, m_SP);
-        pointer = UnsafeRead(pointer, m_P);
+        std::uint8_t P = 0;
+        pointer = UnsafeRead(pointer, P);
+        SetP(P);
         pointer = UnsafeRead(pointer, m_A);
         pointer = UnsafeRead(pointer, m_X);
         pointer = UnsafeRead(pointer, m_Y);
@@ -0,0 +1,220 @@
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <chrono>
+#include <charconv>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include "cartridge.h"
+#include "emulator.h"
+#include "cpu.h"
+#include "scheduler.h"
+
+// 只跑CPU（不带PPU和APU），对比switch分派、线程化分派、解码缓存和JIT的速度，顺便检查几种跑出来的结果一样。
+// 用法 : nes_cpu_bench [cycles]
+
+namespace
+{
+    constexpr std::uint64_t DEFAULT_CYCLES = 100'000'000;
+    constexpr int REPEAT_COUNT = 5;
+
+    // 放在$8000的测试程序，只读写RAM，指令种类尽量杂一点
+    constexpr std::array<std::uint8_t, 61> BENCH_PROGRAM =
+    {
+        0x78,             // reset: SEI
+        0xd8,             //        CLD
+        0xa2, 0xff,       //        LDX #$FF
+        0x9a,             //        TXS
+        0xa9, 0x00,       //        LDA #$00
+        0x85, 0x10,       //        STA $10
+        0xa9, 0x03,       //        LDA #$03
+        0x85, 0x11,       //        STA $11
+        0xa2, 0x00,       // outer: LDX #$00
+        0xbd, 0x00, 0x02, // copy:  LDA $0200,X
+        0x18,             //        CLC
+        0x69, 0x03,       //        ADC #$03
+        0x9d, 0x00, 0x03, //        STA $0300,X
+        0x45, 0x00,       //        EOR $00
+        0x85, 0x00,       //        STA $00
+        0xe8,             //        INX
+        0xd0, 0xf0,       //        BNE copy
+        0xa0, 0x00,       //        LDY #$00
+        0xb1, 0x10,       // shift: LDA ($10),Y
+        0x0a,             //        ASL A
+        0x26, 0x01,       //        ROL $01
+        0x99, 0x00, 0x02, //        STA $0200,Y
+        0x20, 0x34, 0x80, //        JSR sub
+        0xc8,             //        INY
+        0xd0, 0xf2,       //        BNE shift
+        0xe6, 0x02,       //        INC $02
+        0x4c, 0x0d, 0x80, //        JMP outer
+        0xa5, 0x01,       // sub:   LDA $01
+        0x29, 0x0f,       //        AND #$0F
+        0xf0, 0x02,       //        BEQ skip
+        0xc6, 0x03,       //        DEC $03
+        0x60,             // skip:  RTS
+    };
+
+    // 卡带只能从文件读，所以先写一个NROM的文件
+    bool WriteBenchRom(const std::filesystem::path& path)
+    {
+        std::vector<std::uint8_t> rom(16 + 0x4000 + 0x2000, 0);
+        rom[0] = 'N'; rom[1] = 'E'; rom[2] = 'S'; rom[3] = 0x1a;
+        rom[4] = 1; // 16KB PRG ROM
+        rom[5] = 1; // 8KB CHR ROM
+        std::uint8_t* PRG = rom.data() + 16;
+        std::copy(BENCH_PROGRAM.begin(), BENCH_PROGRAM.end(), PRG);
+        // 复位向量指到$8000
+        PRG[0x3ffc] = 0x00;
+        PRG[0x3ffd] = 0x80;
+
+        std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+        if (!ofs.is_open())
+            return false;
+        ofs.write(reinterpret_cast<const char*>(rom.data()), rom.size());
+        return ofs.good();
+    }
+
+    struct BenchResult
+    {
+        double seconds = 0.0;
+        std::uint64_t cycles = 0;
+        std::uint64_t hash = 0;
+    };
+
+    // 模拟器只用来当总线，CPU和调度器是自己的，调度器里没有事件，所以CPU一直跑到deadline
+    enum class Dispatch
+    {
+        Switch,
+        Threaded,
+        Cached,
+        JIT,
+        Count
+    };
+
+    BenchResult RunBench(const std::filesystem::path& rom_path, std::uint64_t cycles, Dispatch dispatch)
+    {
+        // 读卡带的时候会打印卡带信息，跑好几次没必要每次都打
+        std::unique_ptr<nes::Cartridge> cartridge = std::make_unique<nes::Cartridge>();
+        auto cout_buffer = std::cout.rdbuf(nullptr);
+        cartridge->LoadFromFile(rom_path.string());
+        std::cout.rdbuf(cout_buffer);
+        std::cout.clear();
+        std::unique_ptr<nes::NesEmulator> bus = std::make_unique<nes::NesEmulator>();
+        bus->PutInCartridge(std::move(cartridge));
+
+        nes::Scheduler scheduler;
+        nes::CPU6502 CPU;
+        CPU.SetBus(bus.get());
+        CPU.SetScheduler(&scheduler);
+        CPU.SetJITEnabled(dispatch == Dispatch::JIT);
+        CPU.Reset();
+
+        auto deadline = cycles * nes::CPU_CLOCK_DIVIDER;
+        auto start_time = std::chrono::steady_clock::now();
+        switch (dispatch)
+        {
+        case Dispatch::Switch:
+            CPU.RunUntilSwitch(deadline);
+            break;
+        case Dispatch::Threaded:
+            CPU.RunUntilThreaded(deadline);
+            break;
+        case Dispatch::Cached:
+        case Dispatch::JIT:
+            CPU.RunUntilCached(deadline);
+            break;
+        default:
+            break;
+        }
+        auto end_time = std::chrono::steady_clock::now();
+
+        BenchResult result;
+        result.seconds = std::chrono::duration<double>(end_time - start_time).count();
+        result.cycles = CPU.GetCycles();
+        // FNV-1a 64位，RAM的内容
+        result.hash = 14695981039346656037ull;
+        for (std::uint16_t address = 0; address < 0x0800; address++)
+        {
+            result.hash ^= bus->MainBusRead(address);
+            result.hash *= 1099511628211ull;
+        }
+        return result;
+    }
+
+    void PrintResult(std::string_view name, const BenchResult& result)
+    {
+        std::cout << name << std::fixed << std::setprecision(3) << result.seconds << " s, "
+                  << std::setprecision(0) << result.cycles / result.seconds << " cycles/sec\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::uint64_t cycles = DEFAULT_CYCLES;
+    if (argc > 1)
+    {
+        std::string_view arg{argv[1]};
+        const auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), cycles);
+        if (ec != std::errc{} || cycles == 0)
+        {
+            std::cout << "Invalid cycle count : " << arg << std::endl;
+            return 0;
+        }
+    }
+
+    auto rom_path = std::filesystem::temp_directory_path() / "nes_cpu_bench.nes";
+    if (!WriteBenchRom(rom_path))
+    {
+        std::cout << "Unable to write bench rom : " << rom_path << std::endl;
+        return 0;
+    }
+
+    // 机器上别的东西会干扰，几种轮流跑几次，各取最快的
+    std::array<BenchResult, static_cast<int>(Dispatch::Count)> results;
+    for (int i = 0; i < REPEAT_COUNT; i++)
+    {
+        for (int dispatch = 0; dispatch < static_cast<int>(Dispatch::Count); dispatch++)
+        {
+            auto result = RunBench(rom_path, cycles, static_cast<Dispatch>(dispatch));
+            if (i == 0 || result.seconds < results[dispatch].seconds)
+                results[dispatch] = result;
+        }
+    }
+    std::filesystem::remove(rom_path);
+
+    const auto& switch_result = results[static_cast<int>(Dispatch::Switch)];
+    const auto& threaded_result = results[static_cast<int>(Dispatch::Threaded)];
+    const auto& cached_result = results[static_cast<int>(Dispatch::Cached)];
+    const auto& JIT_result = results[static_cast<int>(Dispatch::JIT)];
+    std::cout << "CPU cycles    : " << switch_result.cycles << "\n";
+    PrintResult("Switch        : ", switch_result);
+#if NES_CPU_HAS_THREADED_DISPATCH
+    PrintResult("Threaded      : ", threaded_result);
+#else
+    std::cout << "Threaded      : not supported by this compiler\n";
+#endif
+    PrintResult("Block cache   : ", cached_result);
+#if NES_CPU_HAS_JIT
+    PrintResult("JIT           : ", JIT_result);
+#else
+    std::cout << "JIT           : not supported on this platform\n";
+#endif
+    std::cout << "Speedup       : threaded " << std::fixed << std::setprecision(2) << switch_result.seconds / threaded_result.seconds
+              << "x, block cache " << switch_result.seconds / cached_result.seconds
+              << "x, JIT " << switch_result.seconds / JIT_result.seconds << "x\n";
+
+    for (const auto& result : results)
+    {
+        if (result.cycles != switch_result.cycles || result.hash != switch_result.hash)
+        {
+            std::cout << "Mismatch between dispatchers!" << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
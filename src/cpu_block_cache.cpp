@@ -0,0 +1,63 @@
+#include "cpu_block_cache.h"
+#include "cpu.h"
+#include "cpu_instructions.h"
+#include "memory_map.h"
+
+namespace nes
+{
+    CPU6502BlockCache::CPU6502BlockCache() : m_blocks(std::make_unique<DecodedBlock[]>(BLOCK_COUNT))
+    {
+
+    }
+
+    void CPU6502BlockCache::Clear()
+    {
+        for (std::size_t i = 0; i < BLOCK_COUNT; i++)
+            m_blocks[i].code = nullptr;
+    }
+
+    const DecodedBlock* CPU6502BlockCache::GetBlock(std::uint16_t PC)
+    {
+        if (m_memory_map == nullptr)
+            return nullptr;
+
+        // 能写的页不缓存
+        auto page = PC >> MEMORY_PAGE_SHIFT;
+        const std::uint8_t* base = m_memory_map->read[page];
+        if (base == nullptr || m_memory_map->write[page] != nullptr)
+            return nullptr;
+
+        std::size_t offset = PC & (MEMORY_PAGE_SIZE - 1);
+        auto& block = m_blocks[PC & (BLOCK_COUNT - 1)];
+        if (block.code == base + offset)
+            return block.count == 0 ? nullptr : &block;
+
+        block.code = base + offset;
+        block.count = 0;
+        // 块不跨页，跨页的话后面那页可能是另一个bank
+        while (block.count < DecodedBlock::MAX_INSTRUCTIONS && offset < MEMORY_PAGE_SIZE)
+        {
+            std::uint8_t op_code = base[offset];
+            std::size_t length = ALL_INSTRUCTION_LENGTH[op_code];
+            if (offset + length > MEMORY_PAGE_SIZE)
+                break;
+
+            auto& instruction = block.instructions[block.count++];
+            instruction.execute = CPU6502::GetDecodedExecute(op_code);
+            instruction.length = static_cast<std::uint8_t>(length);
+            instruction.op_code = op_code;
+            instruction.operand = 0;
+            if (length >= 2)
+                instruction.operand = base[offset + 1];
+            if (length == 3)
+                instruction.operand |= static_cast<std::uint16_t>(base[offset + 2]) << 8;
+
+            offset += length;
+            if (ALL_INSTRUCTION_CHANGES_PC[op_code])
+                break;
+        }
+
+        // 第一条指令就跨页了，这种就不缓存，直接解释
+        return block.count == 0 ? nullptr : &block;
+    }
+}
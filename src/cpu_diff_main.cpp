@@ -0,0 +1,514 @@
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <charconv>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include "cartridge.h"
+#include "emulator.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "virtual_device.h"
+
+// 只跑CPU，随机生成程序，用switch、线程化分派、解码缓存和JIT各跑一遍，比较RAM和CPU的状态是不是完全一样
+// deadline是随机的，IRQ和NMI也是随机来的，IRQ之后经常紧跟着来一个NMI，这样会有NMI在进IRQ或者BRK的时候到、
+// 块开始的时候已经有中断在等着的情况
+// 用法 : nes_cpu_diff [seed count] [cycles]
+
+namespace
+{
+    constexpr std::uint32_t DEFAULT_SEED_COUNT = 16;
+    constexpr std::uint64_t DEFAULT_CYCLES = 2'000'000;
+
+    // 中断处理程序的位置，NMI和IRQ共用
+    constexpr std::uint16_t HANDLER_ADDRESS = 0xff00;
+    constexpr std::uint16_t SUBROUTINE_ADDRESS = 0xf000;
+    constexpr std::uint16_t MAIN_END_ADDRESS = 0xef00;
+
+    enum Mode
+    {
+        Implied,
+        Immediate,
+        ZeroPage,
+        ZeroPageX,
+        ZeroPageY,
+        Absolute,
+        AbsoluteX,
+        AbsoluteY,
+        IndirectX,
+        IndirectY,
+        ModeCount
+    };
+
+    constexpr std::array<int, ModeCount> MODE_LENGTH = { 1, 2, 2, 2, 2, 3, 3, 3, 2, 2 };
+
+    // 每种寻址方式的操作码，0表示没有这种寻址方式，Implied对移位指令来说是累加器寻址
+    struct Operation
+    {
+        std::array<std::uint8_t, ModeCount> op_codes;
+    };
+
+    //                                                   Imp   Imm   ZP    ZPX   ZPY   Abs   AbsX  AbsY  IndX  IndY
+    constexpr std::array<Operation, 12> READ_OPERATIONS =
+    {{
+        { { 0x00, 0x69, 0x65, 0x75, 0x00, 0x6d, 0x7d, 0x79, 0x61, 0x71 } }, // ADC
+        { { 0x00, 0x29, 0x25, 0x35, 0x00, 0x2d, 0x3d, 0x39, 0x21, 0x31 } }, // AND
+        { { 0x00, 0x00, 0x24, 0x00, 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00 } }, // BIT
+        { { 0x00, 0xc9, 0xc5, 0xd5, 0x00, 0xcd, 0xdd, 0xd9, 0xc1, 0xd1 } }, // CMP
+        { { 0x00, 0xe0, 0xe4, 0x00, 0x00, 0xec, 0x00, 0x00, 0x00, 0x00 } }, // CPX
+        { { 0x00, 0xc0, 0xc4, 0x00, 0x00, 0xcc, 0x00, 0x00, 0x00, 0x00 } }, // CPY
+        { { 0x00, 0x49, 0x45, 0x55, 0x00, 0x4d, 0x5d, 0x59, 0x41, 0x51 } }, // EOR
+        { { 0x00, 0xa9, 0xa5, 0xb5, 0x00, 0xad, 0xbd, 0xb9, 0xa1, 0xb1 } }, // LDA
+        { { 0x00, 0xa2, 0xa6, 0x00, 0xb6, 0xae, 0x00, 0xbe, 0x00, 0x00 } }, // LDX
+        { { 0x00, 0xa0, 0xa4, 0xb4, 0x00, 0xac, 0xbc, 0x00, 0x00, 0x00 } }, // LDY
+        { { 0x00, 0x09, 0x05, 0x15, 0x00, 0x0d, 0x1d, 0x19, 0x01, 0x11 } }, // ORA
+        { { 0x00, 0xe9, 0xe5, 0xf5, 0x00, 0xed, 0xfd, 0xf9, 0xe1, 0xf1 } }, // SBC
+    }};
+
+    constexpr std::array<Operation, 9> WRITE_OPERATIONS =
+    {{
+        { { 0x0a, 0x00, 0x06, 0x16, 0x00, 0x0e, 0x1e, 0x00, 0x00, 0x00 } }, // ASL
+        { { 0x4a, 0x00, 0x46, 0x56, 0x00, 0x4e, 0x5e, 0x00, 0x00, 0x00 } }, // LSR
+        { { 0x2a, 0x00, 0x26, 0x36, 0x00, 0x2e, 0x3e, 0x00, 0x00, 0x00 } }, // ROL
+        { { 0x6a, 0x00, 0x66, 0x76, 0x00, 0x6e, 0x7e, 0x00, 0x00, 0x00 } }, // ROR
+        { { 0x00, 0x00, 0xe6, 0xf6, 0x00, 0xee, 0xfe, 0x00, 0x00, 0x00 } }, // INC
+        { { 0x00, 0x00, 0xc6, 0xd6, 0x00, 0xce, 0xde, 0x00, 0x00, 0x00 } }, // DEC
+        { { 0x00, 0x00, 0x85, 0x95, 0x00, 0x8d, 0x9d, 0x99, 0x81, 0x91 } }, // STA
+        { { 0x00, 0x00, 0x86, 0x00, 0x96, 0x8e, 0x00, 0x00, 0x00, 0x00 } }, // STX
+        { { 0x00, 0x00, 0x84, 0x94, 0x00, 0x8c, 0x00, 0x00, 0x00, 0x00 } }, // STY
+    }};
+
+    // CLC SEC CLV CLD SED SEI CLI TAX TAY TXA TYA TSX INX INY DEX DEY NOP
+    constexpr std::array<std::uint8_t, 17> IMPLIED_OPERATIONS =
+    {
+        0x18, 0x38, 0xb8, 0xd8, 0xf8, 0x78, 0x58, 0xaa, 0xa8, 0x8a, 0x98, 0xba, 0xe8, 0xc8, 0xca, 0x88, 0xea,
+    };
+    // PHA PLA PHP PLP
+    constexpr std::array<std::uint8_t, 4> STACK_OPERATIONS = { 0x48, 0x68, 0x08, 0x28 };
+    // BPL BMI BVC BVS BCC BCS BNE BEQ
+    constexpr std::array<std::uint8_t, 8> BRANCH_OPERATIONS = { 0x10, 0x30, 0x50, 0x70, 0x90, 0xb0, 0xd0, 0xf0 };
+
+    // 非法指令和长度
+    struct IllegalOperation
+    {
+        std::uint8_t op_code;
+        int length;
+    };
+
+    constexpr std::array<IllegalOperation, 13> ILLEGAL_OPERATIONS =
+    {{
+        { 0x04, 2 }, { 0x0c, 3 }, { 0x14, 2 }, { 0x1a, 1 }, { 0x1c, 3 }, { 0x80, 2 }, { 0xdc, 3 },
+        { 0xfc, 3 }, { 0xeb, 2 }, { 0xa7, 2 }, { 0x87, 2 }, { 0x07, 2 }, { 0xc7, 2 },
+    }};
+
+    // 生成一个32KB PRG ROM的NROM程序
+    // 主程序从$8000开始一直到MAIN_END_ADDRESS，最后跳回开头，中间随机调用$F000的子程序、随机BRK
+    // 读写RAM、PRG RAM、镜像、PPU和APU的寄存器，写RAM的时候不碰栈，所以返回地址不会被改坏
+    class ProgramGenerator
+    {
+    public:
+        explicit ProgramGenerator(std::uint32_t seed) : m_random(seed), m_PRG(0x8000, 0xea) {}
+
+        std::vector<std::uint8_t> Generate()
+        {
+            // 中断处理程序：计数、读一下PPU状态、RTI
+            m_PC = HANDLER_ADDRESS;
+            Emit(0xe6, 0x70);       // INC $70
+            Emit(0x48);             // PHA
+            Emit(0xad, 0x02, 0x20); // LDA $2002
+            Emit(0x68);             // PLA
+            Emit(0x40);             // RTI
+
+            std::vector<std::uint16_t> subroutines;
+            m_PC = SUBROUTINE_ADDRESS;
+            for (int i = 0; i < 12; i++)
+            {
+                subroutines.push_back(m_PC);
+                int count = Random(3, 20);
+                for (int j = 0; j < count; j++)
+                    RandomInstruction(false, false);
+                Emit(0x60); // RTS
+            }
+
+            m_PC = 0x8000;
+            Emit(0x78);       // SEI
+            Emit(0xd8);       // CLD
+            Emit(0xa2, 0xff); // LDX #$FF
+            Emit(0x9a);       // TXS
+            std::uint16_t main = m_PC;
+            while (m_PC < MAIN_END_ADDRESS)
+            {
+                int choice = Random(0, 1000);
+                if (choice < 40)
+                {
+                    std::uint16_t address = subroutines[Random(0, static_cast<int>(subroutines.size()))];
+                    Emit(0x20, static_cast<std::uint8_t>(address), static_cast<std::uint8_t>(address >> 8)); // JSR
+                }
+                else if (choice < 45)
+                    Emit(0x00, 0xea); // BRK
+                else
+                    RandomInstruction(true, true);
+
+                // 栈偶尔复位一下，PHA和PLA不配对也不会一直涨
+                if (choice >= 995)
+                {
+                    Emit(0xa2, 0xff); // LDX #$FF
+                    Emit(0x9a);       // TXS
+                }
+            }
+            Emit(0x4c, static_cast<std::uint8_t>(main), static_cast<std::uint8_t>(main >> 8)); // JMP main
+
+            // NMI、复位、IRQ向量
+            m_PC = 0xfffa;
+            Emit(static_cast<std::uint8_t>(HANDLER_ADDRESS), static_cast<std::uint8_t>(HANDLER_ADDRESS >> 8));
+            Emit(0x00, 0x80);
+            Emit(static_cast<std::uint8_t>(HANDLER_ADDRESS), static_cast<std::uint8_t>(HANDLER_ADDRESS >> 8));
+            return m_PRG;
+        }
+
+    private:
+        // [low, high)
+        int Random(int low, int high)
+        {
+            return low + static_cast<int>(m_random() % static_cast<std::uint32_t>(high - low));
+        }
+
+        void Emit(std::uint8_t value)
+        {
+            m_PRG[m_PC++ - 0x8000] = value;
+        }
+
+        template<typename... Args>
+        void Emit(std::uint8_t value, Args... args)
+        {
+            Emit(value);
+            Emit(args...);
+        }
+
+        void EmitOperation(std::uint8_t op_code, Mode mode, std::uint16_t value)
+        {
+            Emit(op_code);
+            if (MODE_LENGTH[mode] >= 2)
+                Emit(static_cast<std::uint8_t>(value));
+            if (MODE_LENGTH[mode] == 3)
+                Emit(static_cast<std::uint8_t>(value >> 8));
+        }
+
+        std::uint16_t RandomAddress(bool write)
+        {
+            int choice = Random(0, 100);
+            if (choice < 45)
+                return static_cast<std::uint16_t>(Random(0x0200, 0x0800));
+            if (choice < 60)
+            {
+                // RAM的镜像，也不碰零页和栈
+                auto address = static_cast<std::uint16_t>(Random(0x0800, 0x1f00));
+                return (address & 0x7ff) >= 0x200 ? address : address + 0x200;
+            }
+            if (choice < 70)
+                return static_cast<std::uint16_t>(Random(0x6000, 0x8000));
+            if (choice < 80 && !write)
+            {
+                constexpr std::array<std::uint16_t, 4> registers = { 0x2002, 0x4015, 0x2007, 0x2002 };
+                return registers[Random(0, 4)];
+            }
+            if (choice < 85 && !write)
+                return static_cast<std::uint16_t>(Random(0x8000, 0x10000));
+            if (choice < 87 && write)
+                return Random(0, 2) == 0 ? 0x4014 : 0x8000;
+            return static_cast<std::uint16_t>(Random(0x0200, 0x0800));
+        }
+
+        // 间接寻址用的指针放在$80到$9F
+        void SetPointer(std::uint8_t zero_page, bool write)
+        {
+            auto address = RandomAddress(write);
+            if (write && address >= 0x0800)
+                address = static_cast<std::uint16_t>(Random(0x0200, 0x0700));
+            Emit(0xa9, static_cast<std::uint8_t>(address));       // LDA #
+            Emit(0x85, zero_page);                                // STA zp
+            Emit(0xa9, static_cast<std::uint8_t>(address >> 8));  // LDA #
+            Emit(0x85, static_cast<std::uint8_t>(zero_page + 1)); // STA zp + 1
+        }
+
+        void RandomInstruction(bool allow_stack, bool allow_branch)
+        {
+            int kind = Random(0, 100);
+            const Operation* operation = nullptr;
+            bool write = false;
+            if (kind < 40)
+                operation = &READ_OPERATIONS[Random(0, static_cast<int>(READ_OPERATIONS.size()))];
+            else if (kind < 70)
+            {
+                operation = &WRITE_OPERATIONS[Random(0, static_cast<int>(WRITE_OPERATIONS.size()))];
+                write = true;
+            }
+            else if (kind < 90)
+            {
+                int index = Random(0, static_cast<int>(IMPLIED_OPERATIONS.size() + STACK_OPERATIONS.size()));
+                if (index < static_cast<int>(IMPLIED_OPERATIONS.size()))
+                    Emit(IMPLIED_OPERATIONS[index]);
+                else
+                    Emit(allow_stack ? STACK_OPERATIONS[index - IMPLIED_OPERATIONS.size()] : 0xea);
+                return;
+            }
+            else if (kind < 95)
+            {
+                const auto& illegal = ILLEGAL_OPERATIONS[Random(0, static_cast<int>(ILLEGAL_OPERATIONS.size()))];
+                Emit(illegal.op_code);
+                for (int i = 1; i < illegal.length; i++)
+                    Emit(static_cast<std::uint8_t>(Random(0x00, 0x80)));
+                return;
+            }
+            else
+            {
+                if (!allow_branch)
+                {
+                    Emit(0xea);
+                    return;
+                }
+                // 只往前跳过几条完整的指令，不会跳到指令中间
+                Emit(BRANCH_OPERATIONS[Random(0, static_cast<int>(BRANCH_OPERATIONS.size()))], 0x00);
+                std::uint16_t offset_address = m_PC - 1;
+                int count = Random(0, 5);
+                for (int i = 0; i < count; i++)
+                    RandomInstruction(allow_stack, false);
+                m_PRG[offset_address - 0x8000] = static_cast<std::uint8_t>(m_PC - (offset_address + 1));
+                return;
+            }
+
+            std::array<Mode, ModeCount> modes{};
+            int mode_count = 0;
+            for (int mode = 0; mode < ModeCount; mode++)
+            {
+                if (operation->op_codes[mode] != 0)
+                    modes[mode_count++] = static_cast<Mode>(mode);
+            }
+            Mode mode = modes[Random(0, mode_count)];
+            std::uint8_t op_code = operation->op_codes[mode];
+            switch (mode)
+            {
+            case IndirectX:
+            {
+                auto zero_page = static_cast<std::uint8_t>(0x80 + Random(0, 16) * 2);
+                SetPointer(zero_page, write);
+                Emit(0xa2, 0x00); // LDX #$00
+                EmitOperation(op_code, mode, zero_page);
+                break;
+            }
+            case IndirectY:
+            {
+                auto zero_page = static_cast<std::uint8_t>(0x80 + Random(0, 16) * 2);
+                SetPointer(zero_page, write);
+                EmitOperation(op_code, mode, zero_page);
+                break;
+            }
+            case Implied:
+                Emit(op_code);
+                break;
+            case Immediate:
+                EmitOperation(op_code, mode, static_cast<std::uint16_t>(Random(0, 0x100)));
+                break;
+            case ZeroPage:
+            case ZeroPageX:
+            case ZeroPageY:
+                EmitOperation(op_code, mode, static_cast<std::uint16_t>(write ? Random(0x00, 0x80) : Random(0, 0x100)));
+                break;
+            default:
+                EmitOperation(op_code, mode, RandomAddress(write));
+                break;
+            }
+        }
+
+        std::mt19937 m_random;
+        std::vector<std::uint8_t> m_PRG;
+        std::uint16_t m_PC = 0;
+    };
+
+    // 卡带只能从文件读，所以先写一个NROM的文件
+    bool WriteRom(const std::filesystem::path& path, const std::vector<std::uint8_t>& PRG)
+    {
+        std::vector<std::uint8_t> rom(16, 0);
+        rom[0] = 'N'; rom[1] = 'E'; rom[2] = 'S'; rom[3] = 0x1a;
+        rom[4] = 2; // 32KB PRG ROM
+        rom[5] = 1; // 8KB CHR ROM
+        rom.insert(rom.end(), PRG.begin(), PRG.end());
+        rom.resize(rom.size() + 0x2000, 0);
+
+        std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+        if (!ofs.is_open())
+            return false;
+        ofs.write(reinterpret_cast<const char*>(rom.data()), rom.size());
+        return ofs.good();
+    }
+
+    enum class Dispatch
+    {
+        Switch,
+        Threaded,
+        Cached,
+        JIT,
+        Count
+    };
+
+    constexpr std::array<std::string_view, static_cast<int>(Dispatch::Count)> DISPATCH_NAMES = { "switch", "threaded", "cached", "JIT" };
+
+    struct DiffResult
+    {
+        std::uint64_t cycles = 0;
+        std::uint64_t hash = 0;
+        std::uint64_t NMI_count = 0;
+        std::uint64_t IRQ_count = 0;
+    };
+
+    // FNV-1a 64位
+    void HashByte(std::uint64_t& hash, std::uint8_t value)
+    {
+        hash ^= value;
+        hash *= 1099511628211ull;
+    }
+
+    // 模拟器只用来当总线，中断是调度器里的事件按随机的时间发的，几种分派方式用同一个种子，事件的顺序完全一样
+    // MapperIRQ : 发IRQ，一半的时候几个周期以后再来一个NMI
+    // PPUSync : 发NMI
+    DiffResult RunDiff(const std::filesystem::path& rom_path, std::uint64_t cycles, std::uint32_t seed, Dispatch dispatch)
+    {
+        std::unique_ptr<nes::Cartridge> cartridge = std::make_unique<nes::Cartridge>();
+        auto cout_buffer = std::cout.rdbuf(nullptr);
+        cartridge->LoadFromFile(rom_path.string());
+        std::cout.rdbuf(cout_buffer);
+        std::cout.clear();
+        std::unique_ptr<nes::NesEmulator> bus = std::make_unique<nes::NesEmulator>();
+        bus->PutInCartridge(std::move(cartridge));
+        bus->SetVirtualDevice(std::make_shared<nes::VirtualDevice>());
+
+        nes::Scheduler scheduler;
+        nes::CPU6502 CPU;
+        CPU.SetBus(bus.get());
+        CPU.SetScheduler(&scheduler);
+        CPU.SetJITEnabled(dispatch == Dispatch::JIT);
+        CPU.Reset();
+
+        DiffResult result;
+        std::mt19937 random(seed);
+        scheduler.Schedule(nes::SchedulerEvent::MapperIRQ, 1000 * nes::CPU_CLOCK_DIVIDER);
+        scheduler.Schedule(nes::SchedulerEvent::PPUSync, 5000 * nes::CPU_CLOCK_DIVIDER);
+        while (CPU.GetCycles() < cycles)
+        {
+            // 大部分时候deadline很近，有时候很远，JIT的块才有机会进去
+            auto timestamp = scheduler.GetTimestamp();
+            auto deadline = timestamp + (random() % 4 == 0 ? random() % 40000 + 1 : random() % 400 + 1);
+            switch (dispatch)
+            {
+            case Dispatch::Switch:
+                CPU.RunUntilSwitch(deadline);
+                break;
+            case Dispatch::Threaded:
+                CPU.RunUntilThreaded(deadline);
+                break;
+            default:
+                CPU.RunUntilCached(deadline);
+                break;
+            }
+
+            while (auto event = scheduler.PopDueEvent(scheduler.GetTimestamp() + nes::CPU_CLOCK_DIVIDER))
+            {
+                if (event->event == nes::SchedulerEvent::MapperIRQ)
+                {
+                    CPU.Interrupt(nes::CPU6502InterruptType::IRQ);
+                    ++result.IRQ_count;
+                    scheduler.Schedule(nes::SchedulerEvent::MapperIRQ, event->timestamp + (random() % 3000 + 7) * nes::CPU_CLOCK_DIVIDER / 3);
+                    // 正好落在进IRQ或者BRK的那几个周期里，或者刚进完、下一个块开始的时候
+                    if (random() % 2 == 0)
+                        scheduler.Schedule(nes::SchedulerEvent::PPUSync, event->timestamp + (random() % 10 + 1) * nes::CPU_CLOCK_DIVIDER);
+                }
+                else
+                {
+                    CPU.Interrupt(nes::CPU6502InterruptType::NMI);
+                    ++result.NMI_count;
+                    scheduler.Schedule(nes::SchedulerEvent::PPUSync, event->timestamp + (random() % 20000 + 1000) * nes::CPU_CLOCK_DIVIDER);
+                }
+            }
+        }
+
+        result.cycles = CPU.GetCycles();
+        result.hash = 14695981039346656037ull;
+        for (std::uint16_t address = 0; address < 0x0800; address++)
+            HashByte(result.hash, bus->MainBusRead(address));
+        for (char value : CPU.Save())
+            HashByte(result.hash, static_cast<std::uint8_t>(value));
+        return result;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::uint32_t seed_count = DEFAULT_SEED_COUNT;
+    std::uint64_t cycles = DEFAULT_CYCLES;
+    if (argc > 1)
+    {
+        std::string_view arg{argv[1]};
+        const auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), seed_count);
+        if (ec != std::errc{} || seed_count == 0)
+        {
+            std::cout << "Invalid seed count : " << arg << std::endl;
+            return 0;
+        }
+    }
+    if (argc > 2)
+    {
+        std::string_view arg{argv[2]};
+        const auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), cycles);
+        if (ec != std::errc{} || cycles == 0)
+        {
+            std::cout << "Invalid cycle count : " << arg << std::endl;
+            return 0;
+        }
+    }
+
+    auto rom_path = std::filesystem::temp_directory_path() / "nes_cpu_diff.nes";
+    int mismatch_count = 0;
+    for (std::uint32_t seed = 1; seed <= seed_count; seed++)
+    {
+        if (!WriteRom(rom_path, ProgramGenerator(seed).Generate()))
+        {
+            std::cout << "Unable to write diff rom : " << rom_path << std::endl;
+            return 0;
+        }
+
+        std::array<DiffResult, static_cast<int>(Dispatch::Count)> results;
+        for (int dispatch = 0; dispatch < static_cast<int>(Dispatch::Count); dispatch++)
+            results[dispatch] = RunDiff(rom_path, cycles, seed, static_cast<Dispatch>(dispatch));
+
+        const auto& switch_result = results[static_cast<int>(Dispatch::Switch)];
+        std::cout << "Seed " << std::setw(4) << seed << " : " << switch_result.IRQ_count << " IRQ, " << switch_result.NMI_count << " NMI";
+        for (int dispatch = 1; dispatch < static_cast<int>(Dispatch::Count); dispatch++)
+        {
+            const auto& result = results[dispatch];
+            if (result.cycles != switch_result.cycles || result.hash != switch_result.hash)
+            {
+                std::cout << ", " << DISPATCH_NAMES[dispatch] << " mismatch";
+                ++mismatch_count;
+            }
+        }
+        std::cout << std::endl;
+    }
+    std::filesystem::remove(rom_path);
+
+#if !NES_CPU_HAS_THREADED_DISPATCH
+    std::cout << "Threaded dispatch not supported by this compiler, it ran the switch loop" << std::endl;
+#endif
+#if !NES_CPU_HAS_JIT
+    std::cout << "JIT not supported on this platform, it ran the block cache" << std::endl;
+#endif
+    if (mismatch_count != 0)
+    {
+        std::cout << "Mismatch between dispatchers!" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,982 @@
+#include "cpu_jit.h"
+#include "cpu.h"
+#include "cpu_block_cache.h"
+#include "cpu_instructions.h"
+#include "memory_map.h"
+#include <cstring>
+#include <vector>
+
+#if NES_CPU_HAS_JIT
+#include <sys/mman.h>
+#endif
+
+namespace nes
+{
+#if NES_CPU_HAS_JIT
+    namespace
+    {
+        // 按cpu_instructions.h的表，记下每个指令码是什么指令、什么寻址、几个周期
+        enum class Operation
+        {
+            ADC, AHX, ALR, ANC, AND, ARR, ASL, AXS, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK,
+            BVC, BVS, CLC, CLD, CLI, CLV, CMP, CPX, CPY, DCP, DEC, DEX, DEY, EOR, INC, INX,
+            INY, ISC, JMP, JSR, LAS, LAX, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP,
+            RLA, ROL, ROR, RRA, RTI, RTS, SAX, SBC, SEC, SED, SEI, SHX, SHY, SLO, SRE, STA,
+            STX, STY, TAS, TAX, TAY, TSX, TXA, TXS, TYA, XAA, XXX
+        };
+
+        enum class Addressing
+        {
+            Absolute, AbsoluteX, AbsoluteY, Accumulator, Immediate, Implied, Indirect,
+            IndirectX, IndirectY, Relative, ZeroPage, ZeroPageX, ZeroPageY
+        };
+
+        struct OperationInfo
+        {
+            Operation operation = Operation::XXX;
+            Addressing addressing = Addressing::Implied;
+            std::uint8_t cycles = 0;
+            // 跳页的时候加一个周期
+            bool cross_page = false;
+        };
+
+        constexpr auto GetAllOperationInfo()
+        {
+            std::array<OperationInfo, 256> result{};
+
+            #define OPERATION(op_code_, instruction_, addressing_, cycles_, ...) \
+                result[op_code_] = { Operation::instruction_, Addressing::addressing_, cycles_, 0##__VA_ARGS__ != 0 }; \
+
+            CPU6502_ALL_INSTRUCTIONS
+
+            #undef OPERATION
+
+            return result;
+        }
+
+        constexpr std::array<OperationInfo, 256> ALL_OPERATION_INFO = GetAllOperationInfo();
+
+        // 一条指令最多生成这么多字节（加上它的出口），一个块再加上开头和结尾
+        constexpr std::size_t MAX_INSTRUCTION_CODE_SIZE = 256;
+        constexpr std::size_t MAX_BLOCK_CODE_SIZE = DecodedBlock::MAX_INSTRUCTIONS * MAX_INSTRUCTION_CODE_SIZE + 64;
+
+        enum Register : std::uint8_t
+        {
+            RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+        };
+
+        enum Condition : std::uint8_t
+        {
+            CONDITION_O  = 0x0,
+            CONDITION_C  = 0x2,
+            CONDITION_NC = 0x3,
+            CONDITION_Z  = 0x4,
+            CONDITION_NZ = 0x5,
+            CONDITION_A  = 0x7,
+        };
+
+        enum class Width
+        {
+            Byte,
+            Word,
+            Dword,
+            Qword
+        };
+
+        // [base + index * (1 << scale) + displacement]，index是RSP表示没有
+        struct Memory
+        {
+            Register base = RAX;
+            std::int32_t displacement = 0;
+            Register index = RSP;
+            std::uint8_t scale = 0;
+        };
+
+        // 只实现了用到的那些x86-64指令的编码
+        class CodeWriter
+        {
+        public:
+            CodeWriter(std::uint8_t* data, std::size_t capacity) : m_data(data), m_capacity(capacity) {}
+
+            // 超过容量的部分不写，最后用IsOverflow判断
+            inline void Byte(std::uint8_t value)
+            {
+                if (m_size < m_capacity)
+                    m_data[m_size] = value;
+                ++m_size;
+            }
+            inline void U16(std::uint16_t value) { Byte(value & 0xff); Byte(value >> 8); }
+            inline void U32(std::uint32_t value) { for (int i = 0; i < 4; i++) Byte((value >> (i * 8)) & 0xff); }
+            inline std::size_t GetSize() const noexcept { return m_size; }
+            inline bool IsOverflow() const noexcept { return m_size > m_capacity; }
+
+            // 把position处的rel32改成跳到现在的位置
+            inline void Bind(std::size_t position)
+            {
+                if (position + 4 > m_capacity)
+                    return;
+                auto value = static_cast<std::uint32_t>(m_size - (position + 4));
+                std::memcpy(m_data + position, &value, 4);
+            }
+
+            // reg是ModRM里的reg字段，可以是寄存器也可以是/digit
+            void Emit(Width width, std::initializer_list<std::uint8_t> op_code, int reg, const Memory& memory)
+            {
+                Prefix(width, reg, memory.index, memory.base);
+                for (auto value : op_code)
+                    Byte(value);
+
+                // 偏移总是写出来，省得处理rbp/r13没有偏移的特殊情况
+                bool short_displacement = memory.displacement >= -128 && memory.displacement <= 127;
+                std::uint8_t mod = short_displacement ? 0x40 : 0x80;
+                if (memory.index != RSP || (memory.base & 7) == RSP)
+                {
+                    Byte(mod | ((reg & 7) << 3) | 0x04);
+                    Byte((memory.scale << 6) | ((memory.index & 7) << 3) | (memory.base & 7));
+                }
+                else
+                {
+                    Byte(mod | ((reg & 7) << 3) | (memory.base & 7));
+                }
+                if (short_displacement)
+                    Byte(static_cast<std::uint8_t>(memory.displacement));
+                else
+                    U32(static_cast<std::uint32_t>(memory.displacement));
+            }
+
+            void Emit(Width width, std::initializer_list<std::uint8_t> op_code, int reg, Register rm)
+            {
+                Prefix(width, reg, RSP, rm);
+                for (auto value : op_code)
+                    Byte(value);
+                Byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+            }
+
+            // 条件跳转和直接跳转都用rel32，返回要回填的位置
+            inline std::size_t Jump(Condition condition)
+            {
+                Byte(0x0f);
+                Byte(0x80 | condition);
+                U32(0);
+                return m_size - 4;
+            }
+            inline std::size_t Jump()
+            {
+                Byte(0xe9);
+                U32(0);
+                return m_size - 4;
+            }
+
+            // 常用的几条
+            // movzx dst, byte [memory]
+            inline void LoadByte(Register dst, const Memory& memory) { Emit(Width::Dword, { 0x0f, 0xb6 }, dst, memory); }
+            // mov byte [memory], src
+            inline void StoreByte(const Memory& memory, Register src) { Emit(Width::Byte, { 0x88 }, src, memory); }
+            inline void StoreByte(const Memory& memory, std::uint8_t value) { Emit(Width::Byte, { 0xc6 }, 0, memory); Byte(value); }
+            inline void StoreWord(const Memory& memory, Register src) { Emit(Width::Word, { 0x89 }, src, memory); }
+            inline void StoreWord(const Memory& memory, std::uint16_t value) { Emit(Width::Word, { 0xc7 }, 0, memory); U16(value); }
+            inline void LoadPointer(Register dst, const Memory& memory) { Emit(Width::Qword, { 0x8b }, dst, memory); }
+            inline void TestPointer(Register reg) { Emit(Width::Qword, { 0x85 }, reg, reg); }
+            inline void Move(Register dst, Register src) { Emit(Width::Dword, { 0x89 }, src, dst); }
+            inline void Move(Register dst, std::uint32_t value)
+            {
+                if (dst >= R8)
+                    Byte(0x41);
+                Byte(0xb8 + (dst & 7));
+                U32(value);
+            }
+            // movzx dst, src的低8位/低16位
+            inline void ZeroExtendByte(Register dst, Register src) { Emit(Width::Dword, { 0x0f, 0xb6 }, dst, src); }
+            inline void ZeroExtendWord(Register dst, Register src) { Emit(Width::Dword, { 0x0f, 0xb7 }, dst, src); }
+            // 32位的add/or/adc/sbb/and/sub/xor/cmp，operation是0到7
+            inline void Arithmetic(int operation, Register dst, Register src) { Emit(Width::Dword, { static_cast<std::uint8_t>(operation * 8 + 1) }, src, dst); }
+            inline void Arithmetic(int operation, Register dst, std::int32_t value)
+            {
+                if (value >= -128 && value <= 127)
+                {
+                    Emit(Width::Dword, { 0x83 }, operation, dst);
+                    Byte(static_cast<std::uint8_t>(value));
+                }
+                else
+                {
+                    Emit(Width::Dword, { 0x81 }, operation, dst);
+                    U32(static_cast<std::uint32_t>(value));
+                }
+            }
+            // 8位的，dst是寄存器或者内存
+            inline void ArithmeticByte(int operation, Register dst, Register src) { Emit(Width::Byte, { static_cast<std::uint8_t>(operation * 8) }, src, dst); }
+            inline void ArithmeticByte(int operation, const Memory& dst, Register src) { Emit(Width::Byte, { static_cast<std::uint8_t>(operation * 8) }, src, dst); }
+            inline void ArithmeticByte(int operation, const Memory& dst, std::uint8_t value) { Emit(Width::Byte, { 0x80 }, operation, dst); Byte(value); }
+            inline void TestByte(const Memory& memory, std::uint8_t value) { Emit(Width::Byte, { 0xf6 }, 0, memory); Byte(value); }
+            inline void ShiftLeft(Register reg, std::uint8_t count) { Emit(Width::Dword, { 0xc1 }, 4, reg); Byte(count); }
+            inline void ShiftRight(Register reg, std::uint8_t count) { Emit(Width::Dword, { 0xc1 }, 5, reg); Byte(count); }
+            inline void IncrementByte(Register reg) { Emit(Width::Byte, { 0xfe }, 0, reg); }
+            inline void DecrementByte(Register reg) { Emit(Width::Byte, { 0xfe }, 1, reg); }
+            inline void Set(Condition condition, Register reg) { Emit(Width::Byte, { 0x0f, static_cast<std::uint8_t>(0x90 | condition) }, 0, reg); }
+            inline void Set(Condition condition, const Memory& memory) { Emit(Width::Byte, { 0x0f, static_cast<std::uint8_t>(0x90 | condition) }, 0, memory); }
+            // bt reg, bit，结果在CF里
+            inline void BitTest(Register reg, std::uint8_t bit) { Emit(Width::Dword, { 0x0f, 0xba }, 4, reg); Byte(bit); }
+
+        private:
+            // 66前缀和REX前缀，用到的8位寄存器只有al、cl、dl、r8b、r9b，不用考虑spl/bpl/sil/dil
+            inline void Prefix(Width width, int reg, int index, int base)
+            {
+                if (width == Width::Word)
+                    Byte(0x66);
+                std::uint8_t rex = (width == Width::Qword ? 0x08 : 0)
+                    | ((reg & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0);
+                if (rex != 0)
+                    Byte(0x40 | rex);
+            }
+
+        private:
+            std::uint8_t* m_data;
+            std::size_t m_capacity;
+            std::size_t m_size = 0;
+        };
+
+        // 一个块翻译成的机器码：
+        //     rbx = CPU，r12 = 页表，ebp = 跳页和分支多出来的周期
+        //     6502的寄存器都在CPU对象里，每条指令直接读写；页表的读指针放rsi，写指针放rdi，页内偏移放rdx
+        //     eax是返回值，不跳页的周期在翻译的时候就算好了，出口处直接写成立即数
+        // 每条指令访问到寄存器的页就跳到这条指令自己的出口，PC停在这条指令上，让解释器来执行
+        class BlockTranslator
+        {
+        public:
+            BlockTranslator(CodeWriter& writer, const CPU6502JIT::Offsets& offsets) : m_writer(writer), m_offsets(offsets) {}
+
+            // 返回guard_cycles
+            std::uint32_t Translate(const DecodedBlock* block, std::uint16_t PC);
+
+        private:
+            static bool CanTranslate(const OperationInfo& info);
+
+            inline Memory Field(std::int32_t offset) const { return Memory{ RBX, offset }; }
+
+            // 操作数在哪里，read/write是页表里的指针（rsi/rdi）加上页内偏移
+            struct Location
+            {
+                Memory read;
+                Memory write;
+            };
+            Location Locate(const OperationInfo& info, std::uint16_t operand, bool read, bool write);
+            // 页表里是空的话跳到这条指令的出口
+            void CheckPage(Register pointer);
+            void SetNZ(Register reg);
+
+            void TranslateRead(const OperationInfo& info, std::uint16_t operand);
+            void TranslateReadModifyWrite(const OperationInfo& info, std::uint16_t operand);
+            void TranslateStore(const OperationInfo& info, std::uint16_t operand);
+            void TranslateImplied(const OperationInfo& info);
+            void TranslateNOP(const OperationInfo& info, std::uint16_t operand);
+            // 跳转和分支是块的最后一条，自己生成出口
+            void TranslateJump(const OperationInfo& info, std::uint16_t operand, std::uint16_t next_PC);
+
+            // 从机器码回去，PC设成PC，前面的指令一共cycles个周期（不算ebp）
+            void Exit(std::uint16_t PC, std::uint32_t cycles);
+            void ExitToInterpreter(std::uint16_t PC, std::uint32_t cycles);
+
+        private:
+            CodeWriter& m_writer;
+            const CPU6502JIT::Offsets& m_offsets;
+
+            // 正在翻译的这条指令：PC、前面的指令的周期和跳到它出口的位置
+            std::uint16_t m_instruction_PC = 0;
+            std::uint32_t m_cycles = 0;
+            std::vector<std::size_t> m_page_jumps;
+
+            struct InstructionExit
+            {
+                std::uint16_t PC;
+                std::uint32_t cycles;
+                std::vector<std::size_t> jumps;
+            };
+            std::vector<InstructionExit> m_instruction_exits;
+            std::vector<std::size_t> m_exit_jumps;
+            std::vector<std::size_t> m_interpret_jumps;
+        };
+
+        bool BlockTranslator::CanTranslate(const OperationInfo& info)
+        {
+            // 非法指令的周期数是0
+            if (info.cycles == 0)
+                return false;
+
+            switch (info.operation)
+            {
+            case Operation::ADC: case Operation::AND: case Operation::BIT: case Operation::CMP:
+            case Operation::CPX: case Operation::CPY: case Operation::EOR: case Operation::LDA:
+            case Operation::LDX: case Operation::LDY: case Operation::ORA: case Operation::SBC:
+            case Operation::ASL: case Operation::LSR: case Operation::ROL: case Operation::ROR:
+            case Operation::INC: case Operation::DEC:
+            case Operation::STA: case Operation::STX: case Operation::STY:
+            case Operation::CLC: case Operation::SEC: case Operation::CLV: case Operation::CLD:
+            case Operation::SED: case Operation::SEI:
+            case Operation::TAX: case Operation::TAY: case Operation::TXA: case Operation::TYA:
+            case Operation::TSX: case Operation::TXS:
+            case Operation::INX: case Operation::INY: case Operation::DEX: case Operation::DEY:
+            case Operation::PHA: case Operation::PHP: case Operation::PLA:
+            case Operation::NOP: case Operation::JSR: case Operation::RTS:
+            case Operation::BCC: case Operation::BCS: case Operation::BEQ: case Operation::BNE:
+            case Operation::BMI: case Operation::BPL: case Operation::BVC: case Operation::BVS:
+                return true;
+            case Operation::JMP:
+                // 间接跳转可能从寄存器里读地址
+                return info.addressing == Addressing::Absolute;
+            default:
+                // CLI、PLP、RTI、BRK会改中断状态，非法指令也不翻译
+                return false;
+            }
+        }
+
+        std::uint32_t BlockTranslator::Translate(const DecodedBlock* block, std::uint16_t PC)
+        {
+            // System V调用约定，rdi = CPU，rsi = 页表
+            m_writer.Byte(0x53);                     // push rbx
+            m_writer.Byte(0x55);                     // push rbp
+            m_writer.Byte(0x41);
+            m_writer.Byte(0x54);                     // push r12
+            m_writer.Emit(Width::Qword, { 0x89 }, RDI, RBX);
+            m_writer.Emit(Width::Qword, { 0x89 }, RSI, R12);
+            m_writer.Arithmetic(6, RBP, RBP);        // xor ebp, ebp
+
+            std::uint32_t guard_cycles = 0;
+            std::uint16_t next_PC = PC;
+            bool ended = false;
+            for (std::size_t i = 0; i < block->count && !ended; i++)
+            {
+                const auto& instruction = block->instructions[i];
+                const auto& info = ALL_OPERATION_INFO[instruction.op_code];
+                m_instruction_PC = next_PC;
+                next_PC = static_cast<std::uint16_t>(next_PC + instruction.length);
+
+                if (!CanTranslate(info))
+                {
+                    ExitToInterpreter(m_instruction_PC, m_cycles);
+                    ended = true;
+                    break;
+                }
+
+                m_page_jumps.clear();
+                switch (info.operation)
+                {
+                case Operation::ADC: case Operation::AND: case Operation::BIT: case Operation::CMP:
+                case Operation::CPX: case Operation::CPY: case Operation::EOR: case Operation::LDA:
+                case Operation::LDX: case Operation::LDY: case Operation::ORA: case Operation::SBC:
+                    TranslateRead(info, instruction.operand);
+                    break;
+                case Operation::ASL: case Operation::LSR: case Operation::ROL: case Operation::ROR:
+                case Operation::INC: case Operation::DEC:
+                    TranslateReadModifyWrite(info, instruction.operand);
+                    break;
+                case Operation::STA: case Operation::STX: case Operation::STY:
+                    TranslateStore(info, instruction.operand);
+                    break;
+                case Operation::NOP:
+                    TranslateNOP(info, instruction.operand);
+                    break;
+                case Operation::JMP: case Operation::JSR: case Operation::RTS:
+                case Operation::BCC: case Operation::BCS: case Operation::BEQ: case Operation::BNE:
+                case Operation::BMI: case Operation::BPL: case Operation::BVC: case Operation::BVS:
+                    TranslateJump(info, instruction.operand, next_PC);
+                    ended = true;
+                    break;
+                default:
+                    TranslateImplied(info);
+                    break;
+                }
+                if (!m_page_jumps.empty())
+                    m_instruction_exits.push_back({ m_instruction_PC, m_cycles, m_page_jumps });
+
+                m_cycles += info.cycles;
+                if (i + 1 < block->count)
+                    guard_cycles += info.cycles + (info.cross_page ? 1 : 0);
+            }
+            if (!ended)
+                Exit(next_PC, m_cycles);
+
+            // 每条指令自己的出口：PC停在这条指令上
+            for (const auto& instruction_exit : m_instruction_exits)
+            {
+                for (auto position : instruction_exit.jumps)
+                    m_writer.Bind(position);
+                ExitToInterpreter(instruction_exit.PC, instruction_exit.cycles);
+            }
+
+            // 要解释执行下一条指令的话，返回值的第32位设成1
+            for (auto position : m_interpret_jumps)
+                m_writer.Bind(position);
+            m_writer.Arithmetic(0, RAX, RBP);        // add eax, ebp
+            m_writer.Emit(Width::Qword, { 0x0f, 0xba }, 5, RAX);
+            m_writer.Byte(32);                       // bts rax, 32
+            auto interpret_return = m_writer.Jump();
+
+            for (auto position : m_exit_jumps)
+                m_writer.Bind(position);
+            m_writer.Arithmetic(0, RAX, RBP);        // add eax, ebp
+            m_writer.Bind(interpret_return);
+            m_writer.Byte(0x41);
+            m_writer.Byte(0x5c);                     // pop r12
+            m_writer.Byte(0x5d);                     // pop rbp
+            m_writer.Byte(0x5b);                     // pop rbx
+            m_writer.Byte(0xc3);                     // ret
+
+            return guard_cycles;
+        }
+
+        void BlockTranslator::CheckPage(Register pointer)
+        {
+            m_writer.TestPointer(pointer);
+            m_page_jumps.push_back(m_writer.Jump(CONDITION_Z));
+        }
+
+        void BlockTranslator::SetNZ(Register reg)
+        {
+            m_writer.StoreByte(Field(m_offsets.N_value), reg);
+            m_writer.StoreByte(Field(m_offsets.Z_value), reg);
+        }
+
+        BlockTranslator::Location BlockTranslator::Locate(const OperationInfo& info, std::uint16_t operand, bool read, bool write)
+        {
+            constexpr std::int32_t WRITE_TABLE = static_cast<std::int32_t>(offsetof(MemoryMap, write));
+            static_assert(offsetof(MemoryMap, read) == 0);
+
+            // 零页和栈一直是内存，不用检查
+            auto zero_page = [&](Memory offset) {
+                if (read)
+                    m_writer.LoadPointer(RSI, Memory{ R12, 0 });
+                if (write)
+                    m_writer.LoadPointer(RDI, Memory{ R12, WRITE_TABLE });
+                return Location{ Memory{ RSI, offset.displacement, offset.index }, Memory{ RDI, offset.displacement, offset.index } };
+            };
+            // 地址在edx里，换成页指针加页内偏移
+            auto dynamic = [&]() {
+                m_writer.Move(RCX, RDX);
+                m_writer.ShiftRight(RCX, MEMORY_PAGE_SHIFT);
+                m_writer.Arithmetic(4, RDX, MEMORY_PAGE_SIZE - 1);
+                if (read)
+                {
+                    m_writer.LoadPointer(RSI, Memory{ R12, 0, RCX, 3 });
+                    CheckPage(RSI);
+                }
+                if (write)
+                {
+                    m_writer.LoadPointer(RDI, Memory{ R12, WRITE_TABLE, RCX, 3 });
+                    CheckPage(RDI);
+                }
+                return Location{ Memory{ RSI, 0, RDX }, Memory{ RDI, 0, RDX } };
+            };
+            // 页都检查过了才加跳页的周期，跳到出口的话这条指令的周期由解释器来算
+            auto cross_page = [&]() {
+                if (info.cross_page)
+                {
+                    m_writer.LoadByte(RAX, Field(m_offsets.cross_page));
+                    m_writer.Arithmetic(0, RBP, RAX);
+                }
+            };
+
+            Location location;
+            switch (info.addressing)
+            {
+            case Addressing::ZeroPage:
+                return zero_page(Memory{ RAX, operand });
+            case Addressing::ZeroPageX:
+            case Addressing::ZeroPageY:
+                m_writer.LoadByte(RDX, Field(info.addressing == Addressing::ZeroPageX ? m_offsets.X : m_offsets.Y));
+                m_writer.Arithmetic(0, RDX, operand);
+                m_writer.ZeroExtendByte(RDX, RDX);
+                return zero_page(Memory{ RAX, 0, RDX });
+            case Addressing::Absolute:
+            {
+                auto page = operand >> MEMORY_PAGE_SHIFT;
+                auto offset = operand & (MEMORY_PAGE_SIZE - 1);
+                if (page == 0)
+                    return zero_page(Memory{ RAX, offset });
+                if (read)
+                {
+                    m_writer.LoadPointer(RSI, Memory{ R12, page * 8 });
+                    CheckPage(RSI);
+                }
+                if (write)
+                {
+                    m_writer.LoadPointer(RDI, Memory{ R12, WRITE_TABLE + page * 8 });
+                    CheckPage(RDI);
+                }
+                return Location{ Memory{ RSI, offset }, Memory{ RDI, offset } };
+            }
+            case Addressing::AbsoluteX:
+            case Addressing::AbsoluteY:
+                m_writer.LoadByte(RDX, Field(info.addressing == Addressing::AbsoluteX ? m_offsets.X : m_offsets.Y));
+                m_writer.Arithmetic(0, RDX, operand);
+                // operand + X超过operand所在的那256字节就是跳页了
+                m_writer.Arithmetic(7, RDX, operand | 0xff);
+                m_writer.Set(CONDITION_A, Field(m_offsets.cross_page));
+                m_writer.ZeroExtendWord(RDX, RDX);
+                location = dynamic();
+                cross_page();
+                return location;
+            case Addressing::IndirectX:
+                m_writer.LoadByte(RCX, Field(m_offsets.X));
+                m_writer.Arithmetic(0, RCX, operand);
+                m_writer.ZeroExtendByte(RCX, RCX);
+                m_writer.LoadPointer(RAX, Memory{ R12, 0 });
+                m_writer.LoadByte(RDX, Memory{ RAX, 0, RCX });
+                m_writer.IncrementByte(RCX);
+                m_writer.LoadByte(RCX, Memory{ RAX, 0, RCX });
+                m_writer.ShiftLeft(RCX, 8);
+                m_writer.Arithmetic(1, RDX, RCX);
+                return dynamic();
+            case Addressing::IndirectY:
+                m_writer.LoadPointer(RAX, Memory{ R12, 0 });
+                m_writer.LoadByte(RDX, Memory{ RAX, operand });
+                m_writer.LoadByte(RCX, Memory{ RAX, (operand + 1) & 0xff });
+                m_writer.ShiftLeft(RCX, 8);
+                m_writer.Arithmetic(1, RDX, RCX);
+                m_writer.LoadByte(RCX, Field(m_offsets.Y));
+                m_writer.ZeroExtendByte(RAX, RDX);
+                m_writer.Arithmetic(0, RAX, RCX);
+                m_writer.Arithmetic(7, RAX, 0xff);
+                m_writer.Set(CONDITION_A, Field(m_offsets.cross_page));
+                m_writer.Arithmetic(0, RDX, RCX);
+                m_writer.ZeroExtendWord(RDX, RDX);
+                location = dynamic();
+                cross_page();
+                return location;
+            default:
+                return location;
+            }
+        }
+
+        void BlockTranslator::TranslateRead(const OperationInfo& info, std::uint16_t operand)
+        {
+            // 读出来的值放在ecx里
+            if (info.addressing == Addressing::Immediate)
+                m_writer.Move(RCX, operand & 0xff);
+            else
+                m_writer.LoadByte(RCX, Locate(info, operand, true, false).read);
+
+            auto A = Field(m_offsets.A);
+            auto P = Field(m_offsets.P);
+            switch (info.operation)
+            {
+            case Operation::LDA:
+                m_writer.StoreByte(A, RCX);
+                SetNZ(RCX);
+                break;
+            case Operation::LDX:
+                m_writer.StoreByte(Field(m_offsets.X), RCX);
+                SetNZ(RCX);
+                break;
+            case Operation::LDY:
+                m_writer.StoreByte(Field(m_offsets.Y), RCX);
+                SetNZ(RCX);
+                break;
+            case Operation::AND:
+            case Operation::ORA:
+            case Operation::EOR:
+                m_writer.LoadByte(RAX, A);
+                m_writer.Arithmetic(info.operation == Operation::AND ? 4 : info.operation == Operation::ORA ? 1 : 6, RAX, RCX);
+                m_writer.StoreByte(A, RAX);
+                SetNZ(RAX);
+                break;
+            case Operation::ADC:
+            case Operation::SBC:
+                // 二进制的加减法x86和6502一样，C和V直接从CF和OF拿
+                // SBC的借位是6502的C取反
+                m_writer.LoadByte(RAX, A);
+                m_writer.LoadByte(R8, P);
+                m_writer.BitTest(R8, 0);
+                if (info.operation == Operation::ADC)
+                {
+                    m_writer.ArithmeticByte(2, RAX, RCX);   // adc al, cl
+                    m_writer.Set(CONDITION_C, RCX);
+                }
+                else
+                {
+                    m_writer.Byte(0xf5);                    // cmc
+                    m_writer.ArithmeticByte(3, RAX, RCX);   // sbb al, cl
+                    m_writer.Set(CONDITION_NC, RCX);
+                }
+                m_writer.Set(CONDITION_O, RDX);
+                m_writer.Arithmetic(4, R8, 0xbe);
+                m_writer.ZeroExtendByte(RCX, RCX);
+                m_writer.Arithmetic(1, R8, RCX);
+                m_writer.ZeroExtendByte(RDX, RDX);
+                m_writer.ShiftLeft(RDX, 6);
+                m_writer.Arithmetic(1, R8, RDX);
+                m_writer.StoreByte(P, R8);
+                m_writer.StoreByte(A, RAX);
+                SetNZ(RAX);
+                break;
+            case Operation::CMP:
+            case Operation::CPX:
+            case Operation::CPY:
+                m_writer.LoadByte(RAX, Field(info.operation == Operation::CMP ? m_offsets.A : info.operation == Operation::CPX ? m_offsets.X : m_offsets.Y));
+                m_writer.ArithmeticByte(5, RAX, RCX);       // sub al, cl
+                m_writer.Set(CONDITION_NC, RCX);
+                m_writer.ArithmeticByte(4, P, 0xfe);
+                m_writer.ArithmeticByte(1, P, RCX);
+                SetNZ(RAX);
+                break;
+            case Operation::BIT:
+                // N是读出来的值，Z看的是A & 值，V是值的第6位
+                m_writer.StoreByte(Field(m_offsets.N_value), RCX);
+                m_writer.LoadByte(RAX, A);
+                m_writer.Arithmetic(4, RAX, RCX);
+                m_writer.StoreByte(Field(m_offsets.Z_value), RAX);
+                m_writer.ArithmeticByte(4, P, 0xbf);
+                m_writer.Arithmetic(4, RCX, 0x40);
+                m_writer.ArithmeticByte(1, P, RCX);
+                break;
+            default:
+                break;
+            }
+        }
+
+        void BlockTranslator::TranslateReadModifyWrite(const OperationInfo& info, std::uint16_t operand)
+        {
+            // 值放在eax里，内存的话读写的页都先检查完再改，出口之前不能有副作用
+            bool accumulator = info.addressing == Addressing::Accumulator;
+            Location location;
+            if (accumulator)
+            {
+                m_writer.LoadByte(RAX, Field(m_offsets.A));
+            }
+            else
+            {
+                location = Locate(info, operand, true, true);
+                m_writer.LoadByte(RAX, location.read);
+            }
+
+            auto P = Field(m_offsets.P);
+            switch (info.operation)
+            {
+            case Operation::ASL:
+                m_writer.ArithmeticByte(4, P, 0xfe);
+                m_writer.Move(RCX, RAX);
+                m_writer.ShiftRight(RCX, 7);
+                m_writer.ArithmeticByte(1, P, RCX);
+                m_writer.ShiftLeft(RAX, 1);
+                break;
+            case Operation::LSR:
+                m_writer.ArithmeticByte(4, P, 0xfe);
+                m_writer.Move(RCX, RAX);
+                m_writer.Arithmetic(4, RCX, 1);
+                m_writer.ArithmeticByte(1, P, RCX);
+                m_writer.ShiftRight(RAX, 1);
+                break;
+            case Operation::ROL:
+            case Operation::ROR:
+                // 原来的C在ecx里，移出去的那一位在r8里
+                m_writer.LoadByte(RCX, P);
+                m_writer.Arithmetic(4, RCX, 1);
+                m_writer.ArithmeticByte(4, P, 0xfe);
+                m_writer.Move(R8, RAX);
+                if (info.operation == Operation::ROL)
+                {
+                    m_writer.ShiftRight(R8, 7);
+                    m_writer.ShiftLeft(RAX, 1);
+                }
+                else
+                {
+                    m_writer.Arithmetic(4, R8, 1);
+                    m_writer.ShiftLeft(RCX, 7);
+                    m_writer.ShiftRight(RAX, 1);
+                }
+                m_writer.ArithmeticByte(1, P, R8);
+                m_writer.Arithmetic(1, RAX, RCX);
+                break;
+            case Operation::INC:
+                m_writer.IncrementByte(RAX);
+                break;
+            case Operation::DEC:
+                m_writer.DecrementByte(RAX);
+                break;
+            default:
+                break;
+            }
+
+            m_writer.StoreByte(accumulator ? Field(m_offsets.A) : location.write, RAX);
+            SetNZ(RAX);
+        }
+
+        void BlockTranslator::TranslateStore(const OperationInfo& info, std::uint16_t operand)
+        {
+            auto location = Locate(info, operand, false, true);
+            auto source = info.operation == Operation::STA ? m_offsets.A : info.operation == Operation::STX ? m_offsets.X : m_offsets.Y;
+            m_writer.LoadByte(RAX, Field(source));
+            m_writer.StoreByte(location.write, RAX);
+        }
+
+        void BlockTranslator::TranslateImplied(const OperationInfo& info)
+        {
+            auto P = Field(m_offsets.P);
+            // 传送指令：源和目的
+            auto transfer = [&](std::int32_t source, std::int32_t destination, bool flags) {
+                m_writer.LoadByte(RAX, Field(source));
+                m_writer.StoreByte(Field(destination), RAX);
+                if (flags)
+                    SetNZ(RAX);
+            };
+            auto increment = [&](std::int32_t reg, bool increment) {
+                m_writer.LoadByte(RAX, Field(reg));
+                if (increment)
+                    m_writer.IncrementByte(RAX);
+                else
+                    m_writer.DecrementByte(RAX);
+                m_writer.StoreByte(Field(reg), RAX);
+                SetNZ(RAX);
+            };
+            // 压栈，值在eax里，地址是0x100 | SP
+            auto push = [&]() {
+                m_writer.LoadByte(RCX, Field(m_offsets.SP));
+                m_writer.LoadPointer(RDI, Memory{ R12, static_cast<std::int32_t>(offsetof(MemoryMap, write)) });
+                m_writer.StoreByte(Memory{ RDI, 0x100, RCX }, RAX);
+                m_writer.DecrementByte(RCX);
+                m_writer.StoreByte(Field(m_offsets.SP), RCX);
+            };
+
+            switch (info.operation)
+            {
+            case Operation::CLC: m_writer.ArithmeticByte(4, P, 0xfe); break;
+            case Operation::SEC: m_writer.ArithmeticByte(1, P, 0x01); break;
+            case Operation::CLV: m_writer.ArithmeticByte(4, P, 0xbf); break;
+            case Operation::CLD: m_writer.ArithmeticByte(4, P, 0xf7); break;
+            case Operation::SED: m_writer.ArithmeticByte(1, P, 0x08); break;
+            // 只会关中断，不会让等着的IRQ进来，所以可以翻译
+            case Operation::SEI: m_writer.ArithmeticByte(1, P, 0x04); break;
+            case Operation::TAX: transfer(m_offsets.A, m_offsets.X, true); break;
+            case Operation::TAY: transfer(m_offsets.A, m_offsets.Y, true); break;
+            case Operation::TXA: transfer(m_offsets.X, m_offsets.A, true); break;
+            case Operation::TYA: transfer(m_offsets.Y, m_offsets.A, true); break;
+            case Operation::TSX: transfer(m_offsets.SP, m_offsets.X, true); break;
+            case Operation::TXS: transfer(m_offsets.X, m_offsets.SP, false); break;
+            case Operation::INX: increment(m_offsets.X, true); break;
+            case Operation::INY: increment(m_offsets.Y, true); break;
+            case Operation::DEX: increment(m_offsets.X, false); break;
+            case Operation::DEY: increment(m_offsets.Y, false); break;
+            case Operation::PHA:
+                m_writer.LoadByte(RAX, Field(m_offsets.A));
+                push();
+                break;
+            case Operation::PHP:
+                // 和GetP() | B一样
+                m_writer.LoadByte(RAX, P);
+                m_writer.Arithmetic(4, RAX, 0x7d);
+                m_writer.Arithmetic(1, RAX, 0x10);
+                m_writer.LoadByte(RCX, Field(m_offsets.N_value));
+                m_writer.Arithmetic(4, RCX, 0x80);
+                m_writer.Arithmetic(1, RAX, RCX);
+                m_writer.ArithmeticByte(7, Field(m_offsets.Z_value), 0x00);
+                m_writer.Set(CONDITION_Z, RCX);
+                m_writer.ZeroExtendByte(RCX, RCX);
+                m_writer.ShiftLeft(RCX, 1);
+                m_writer.Arithmetic(1, RAX, RCX);
+                push();
+                break;
+            case Operation::PLA:
+                m_writer.LoadByte(RCX, Field(m_offsets.SP));
+                m_writer.IncrementByte(RCX);
+                m_writer.StoreByte(Field(m_offsets.SP), RCX);
+                m_writer.LoadPointer(RSI, Memory{ R12, 0 });
+                m_writer.LoadByte(RAX, Memory{ RSI, 0x100, RCX });
+                m_writer.StoreByte(Field(m_offsets.A), RAX);
+                SetNZ(RAX);
+                break;
+            default:
+                break;
+            }
+        }
+
+        void BlockTranslator::TranslateNOP(const OperationInfo& info, std::uint16_t operand)
+        {
+            // 解释器里NOP不读内存，只有AbsoluteX要算跳页
+            if (info.addressing != Addressing::AbsoluteX)
+                return;
+            m_writer.LoadByte(RDX, Field(m_offsets.X));
+            m_writer.Arithmetic(0, RDX, operand);
+            m_writer.Arithmetic(7, RDX, operand | 0xff);
+            m_writer.Set(CONDITION_A, Field(m_offsets.cross_page));
+            if (info.cross_page)
+            {
+                m_writer.LoadByte(RAX, Field(m_offsets.cross_page));
+                m_writer.Arithmetic(0, RBP, RAX);
+            }
+        }
+
+        void BlockTranslator::TranslateJump(const OperationInfo& info, std::uint16_t operand, std::uint16_t next_PC)
+        {
+            auto cycles = m_cycles + info.cycles;
+            auto SP = Field(m_offsets.SP);
+            switch (info.operation)
+            {
+            case Operation::JMP:
+                Exit(operand, cycles);
+                return;
+            case Operation::JSR:
+            {
+                // 压的是JSR最后一个字节的地址，先压高位
+                std::uint16_t return_address = next_PC - 1;
+                m_writer.LoadByte(RCX, SP);
+                m_writer.LoadPointer(RDI, Memory{ R12, static_cast<std::int32_t>(offsetof(MemoryMap, write)) });
+                m_writer.StoreByte(Memory{ RDI, 0x100, RCX }, static_cast<std::uint8_t>(return_address >> 8));
+                m_writer.DecrementByte(RCX);
+                m_writer.StoreByte(Memory{ RDI, 0x100, RCX }, static_cast<std::uint8_t>(return_address));
+                m_writer.DecrementByte(RCX);
+                m_writer.StoreByte(SP, RCX);
+                Exit(operand, cycles);
+                return;
+            }
+            case Operation::RTS:
+                m_writer.LoadByte(RCX, SP);
+                m_writer.LoadPointer(RSI, Memory{ R12, 0 });
+                m_writer.IncrementByte(RCX);
+                m_writer.LoadByte(RAX, Memory{ RSI, 0x100, RCX });
+                m_writer.IncrementByte(RCX);
+                m_writer.LoadByte(RDX, Memory{ RSI, 0x100, RCX });
+                m_writer.StoreByte(SP, RCX);
+                m_writer.ShiftLeft(RDX, 8);
+                m_writer.Arithmetic(1, RAX, RDX);
+                m_writer.Arithmetic(0, RAX, 1);
+                m_writer.StoreWord(Field(m_offsets.PC), RAX);
+                m_writer.Move(RAX, cycles);
+                m_exit_jumps.push_back(m_writer.Jump());
+                return;
+            default:
+                break;
+            }
+
+            // 分支：条件成立的时候跳到taken
+            Condition taken = CONDITION_NZ;
+            switch (info.operation)
+            {
+            case Operation::BCC: m_writer.TestByte(Field(m_offsets.P), 0x01); taken = CONDITION_Z; break;
+            case Operation::BCS: m_writer.TestByte(Field(m_offsets.P), 0x01); taken = CONDITION_NZ; break;
+            case Operation::BVC: m_writer.TestByte(Field(m_offsets.P), 0x40); taken = CONDITION_Z; break;
+            case Operation::BVS: m_writer.TestByte(Field(m_offsets.P), 0x40); taken = CONDITION_NZ; break;
+            case Operation::BPL: m_writer.TestByte(Field(m_offsets.N_value), 0x80); taken = CONDITION_Z; break;
+            case Operation::BMI: m_writer.TestByte(Field(m_offsets.N_value), 0x80); taken = CONDITION_NZ; break;
+            case Operation::BEQ: m_writer.ArithmeticByte(7, Field(m_offsets.Z_value), 0x00); taken = CONDITION_Z; break;
+            case Operation::BNE: m_writer.ArithmeticByte(7, Field(m_offsets.Z_value), 0x00); taken = CONDITION_NZ; break;
+            default: break;
+            }
+            auto taken_jump = m_writer.Jump(taken);
+            Exit(next_PC, cycles);
+            m_writer.Bind(taken_jump);
+            std::uint16_t target = next_PC + static_cast<std::int8_t>(operand);
+            Exit(target, cycles + ((next_PC & 0xff00) != (target & 0xff00) ? 2 : 1));
+        }
+
+        void BlockTranslator::Exit(std::uint16_t PC, std::uint32_t cycles)
+        {
+            m_writer.StoreWord(Field(m_offsets.PC), PC);
+            m_writer.Move(RAX, cycles);
+            m_exit_jumps.push_back(m_writer.Jump());
+        }
+
+        void BlockTranslator::ExitToInterpreter(std::uint16_t PC, std::uint32_t cycles)
+        {
+            m_writer.StoreWord(Field(m_offsets.PC), PC);
+            m_writer.Move(RAX, cycles);
+            m_interpret_jumps.push_back(m_writer.Jump());
+        }
+    }
+#endif
+
+    CPU6502JIT::CPU6502JIT(const CPU6502& CPU) : m_blocks(std::make_unique<CompiledBlock[]>(BLOCK_COUNT))
+    {
+        auto offset = [&](const auto& member) {
+            return static_cast<std::int32_t>(reinterpret_cast<const char*>(&member) - reinterpret_cast<const char*>(&CPU));
+        };
+        m_offsets.PC = offset(CPU.m_PC);
+        m_offsets.SP = offset(CPU.m_SP);
+        m_offsets.P = offset(CPU.m_P);
+        m_offsets.N_value = offset(CPU.m_N_value);
+        m_offsets.Z_value = offset(CPU.m_Z_value);
+        m_offsets.A = offset(CPU.m_A);
+        m_offsets.X = offset(CPU.m_X);
+        m_offsets.Y = offset(CPU.m_Y);
+        m_offsets.cross_page = offset(CPU.m_cross_page);
+
+#if NES_CPU_HAS_JIT
+        // 平时只能读和执行，写机器码的时候才临时改成可写
+        void* buffer = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer != MAP_FAILED)
+            m_code_buffer = static_cast<std::uint8_t*>(buffer);
+#endif
+    }
+
+    CPU6502JIT::~CPU6502JIT()
+    {
+#if NES_CPU_HAS_JIT
+        if (m_code_buffer != nullptr)
+            munmap(m_code_buffer, CODE_BUFFER_SIZE);
+#endif
+    }
+
+    bool CPU6502JIT::Compile(const DecodedBlock* block, std::uint16_t PC, CompiledBlock& compiled)
+    {
+#if NES_CPU_HAS_JIT
+        // 满了就全部扔掉重新来，已经翻译的块会再热一次
+        if (m_code_size + MAX_BLOCK_CODE_SIZE > CODE_BUFFER_SIZE)
+            Clear();
+
+        if (mprotect(m_code_buffer, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+            return false;
+
+        std::uint8_t* start = m_code_buffer + m_code_size;
+        CodeWriter writer(start, CODE_BUFFER_SIZE - m_code_size);
+        BlockTranslator translator(writer, m_offsets);
+        auto guard_cycles = translator.Translate(block, PC);
+        bool success = !writer.IsOverflow();
+        if (success)
+        {
+            m_code_size += writer.GetSize();
+            compiled.entry = reinterpret_cast<Entry>(start);
+            compiled.guard_cycles = guard_cycles;
+        }
+
+        if (mprotect(m_code_buffer, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0)
+        {
+            // 改不回可执行就没法用了，以后都走解释器
+            munmap(m_code_buffer, CODE_BUFFER_SIZE);
+            m_code_buffer = nullptr;
+            return false;
+        }
+        return success;
+#else
+        return false;
+#endif
+    }
+
+    void CPU6502JIT::Clear()
+    {
+        for (std::size_t i = 0; i < BLOCK_COUNT; i++)
+            m_blocks[i] = CompiledBlock{};
+        m_code_size = 0;
+    }
+
+    const CPU6502JIT::CompiledBlock* CPU6502JIT::GetBlock(const DecodedBlock* block, std::uint16_t PC)
+    {
+        if (!IsAvailable())
+            return nullptr;
+
+        auto& compiled = m_blocks[PC & (BLOCK_COUNT - 1)];
+        // 同一个位置换了块（换bank或者别的PC）就重新计数，原来的机器码留在缓冲区里等清空
+        if (compiled.code != block->code || compiled.PC != PC)
+        {
+            compiled = CompiledBlock{};
+            compiled.code = block->code;
+            compiled.PC = PC;
+        }
+        if (compiled.entry == nullptr && ++compiled.count >= HOT_THRESHOLD)
+        {
+            // 缓冲区满了的话Compile里会清空所有的块，所以翻译完再整个写回去，失败了就重新计数
+            CompiledBlock result{ block->code, PC };
+            Compile(block, PC, result);
+            compiled = result;
+        }
+        return compiled.entry == nullptr ? nullptr : &compiled;
+    }
+}
+
@@ -13,13 +13,18 @@ namespace nes
     NesEmulator::NesEmulator()
         : m_RAM(std::make_unique<std::uint8_t[]>(0x0800))
     {
-        m_CPU.SetReadFunction([this](std::uint16_t addr)->std::uint8_t{ return MainBusRead(addr); });
-        m_CPU.SetWriteFunction([this](std::uint16_t addr, std::uint8_t val)->void{ MainBusWrite(addr, val); });
-        m_PPU.SetReadMapperCHRCallback([this](std::uint16_t addr)->std::uint8_t { return m_cartridge->GetMapper()->ReadCHR(addr); });
-        m_PPU.SetWriteMapperCHRCallback([this](std::uint16_t addr, std::uint8_t val)->void{ m_cartridge->GetMapper()->WriteCHR(addr, val); });
-        m_PPU.SetNMICallback([this]()->void{ m_CPU.Interrupt(CPU6502InterruptType::NMI); });
-        m_APU.SetIRQCallback([this]()->void{ m_CPU.Interrupt(CPU6502InterruptType::IRQ); });
-        m_APU.SetDMCReadCallback([this](std::uint16_t addr)->std::uint8_t{ return MainBusRead(addr); });
+        // 只有2K内存，[0, 0x2000)剩下的全是镜像
+        for (std::uint16_t address = 0; address < 0x2000; address += 0x0800)
+        {
+            m_memory_map.MapRead(address, 0x0800, m_RAM.get());
+            m_memory_map.MapWrite(address, 0x0800, m_RAM.get());
+        }
+        m_CPU.SetBus(this);
+        m_PPU.SetCPU(&m_CPU);
+        m_APU.SetCPU(&m_CPU);
+        m_APU.SetBus(this);
+        m_CPU.SetScheduler(&m_scheduler);
+        m_APU.SetScheduler(&m_scheduler);
     }
 
     NesEmulator::~NesEmulator()
@@ -27,66 +32,162 @@ namespace nes
 
     }
 
-    void NesEmulator::Run(const bool& running)
+    void NesEmulator::Reset()
     {
+        m_scheduler.Reset();
         m_CPU.Reset();
         m_PPU.Reset();
         m_APU.Reset();
+        m_PPU_timestamp = 0;
+        m_target_timestamp = 0;
+        UpdatePPUSyncPoint();
+    }
+
+    bool NesEmulator::RunUntil(std::uint64_t timestamp, bool stop_at_frame_end)
+    {
+        bool frame_changed = false;
+        while (m_scheduler.GetTimestamp() < timestamp)
+        {
+            // 时间点落在当前这个CPU周期里或者之前（上一条指令执行的时候）的事件，都在CPU执行下一条指令之前处理
+            auto cycle_end = m_scheduler.GetTimestamp() + CPU_CLOCK_DIVIDER;
+            if (m_scheduler.GetNextTimestamp() < cycle_end && RunEvents(cycle_end))
+            {
+                frame_changed = true;
+                if (stop_at_frame_end)
+                    break;
+            }
+            m_CPU.RunUntil(timestamp);
+        }
+        return frame_changed;
+    }
+
+    void NesEmulator::RunFrame()
+    {
+        RunUntil(Scheduler::NO_EVENT, true);
+        // PPU就停在一帧结束的地方，不然画面里会混进下一帧的内容
+        SyncAPU(m_scheduler.GetTimestamp());
+        m_APU.EndAudioFrame();
+        m_target_timestamp = m_scheduler.GetTimestamp();
+    }
+
+    bool NesEmulator::RunCycles(std::uint64_t cycles)
+    {
+        return RunCycles(cycles, false);
+    }
+
+    bool NesEmulator::RunCycles(std::uint64_t cycles, bool stop_at_frame_end)
+    {
+        // 停在一帧结束的地方的话，没跑完的周期还算在m_target_timestamp里，下次接着跑
+        m_target_timestamp += cycles * CPU_CLOCK_DIVIDER;
+        bool frame_changed = RunUntil(m_target_timestamp, stop_at_frame_end);
+        // 返回的时候PPU和APU也要是最新的，外面可能会存档之类的
+        SyncPPU(m_scheduler.GetTimestamp());
+        SyncAPU(m_scheduler.GetTimestamp());
+        // 音频一帧合成一次
+        if (frame_changed)
+            m_APU.EndAudioFrame();
+        return frame_changed;
+    }
+
+    bool NesEmulator::RunEvents(std::uint64_t until)
+    {
+        while (auto event = m_scheduler.PopDueEvent(until))
+        {
+            switch (event->event)
+            {
+            case SchedulerEvent::PPUSync:
+                // 只追到事件所在的CPU周期结束，CPU多跑的那几个周期等下次再追
+                SyncPPU(event->timestamp - event->timestamp % CPU_CLOCK_DIVIDER + CPU_CLOCK_DIVIDER);
+                break;
+            case SchedulerEvent::APUFrameCounter:
+                SyncAPU(event->timestamp);
+                m_APU.StepFrameCounter();
+                break;
+            case SchedulerEvent::DMCFetch:
+                SyncAPU(event->timestamp);
+                m_APU.FetchDMC();
+                break;
+            case SchedulerEvent::MapperIRQ:
+                VisitMapper(m_cartridge->GetMapper(), [](auto& mapper) { mapper.OnScheduledIRQ(); });
+                break;
+            default:
+                break;
+            }
+
+            auto PPU_frame = m_PPU.GetFrame();
+            if (PPU_frame != m_frame)
+            {
+                m_frame = PPU_frame;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void NesEmulator::SyncPPU(std::uint64_t timestamp)
+    {
+        if (timestamp > m_PPU_timestamp)
+        {
+            auto dots = (timestamp - m_PPU_timestamp) / PPU_CLOCK_DIVIDER;
+            m_PPU.Run(static_cast<std::uint32_t>(dots));
+            m_PPU_timestamp += dots * PPU_CLOCK_DIVIDER;
+        }
+        UpdatePPUSyncPoint();
+    }
+
+    void NesEmulator::UpdatePPUSyncPoint()
+    {
+        // 登记的是那个点开始的时间，它在哪个CPU周期里，就在那个周期开始的时候同步
+        bool scanline_IRQ = VisitMapper(m_cartridge->GetMapper(), [](const auto& mapper) { return mapper.IsScanlineIRQEnabled(); });
+        auto dots = m_PPU.GetDotsToNextEvent(scanline_IRQ);
+        m_scheduler.Schedule(SchedulerEvent::PPUSync, m_PPU_timestamp + (dots - 1) * PPU_CLOCK_DIVIDER);
+    }
+
+    void NesEmulator::Run(const bool& running)
+    {
+        Reset();
         auto last_time = std::chrono::steady_clock::now();
         while (running)
         {
             auto current_time = std::chrono::steady_clock::now();
             auto delta_time = std::chrono::duration_cast<std::chrono::milliseconds>(current_time - last_time);
             double time_s = delta_time.count() / 1000.0;
-            int step_n = static_cast<int>(time_s * NTSC_CPU_FREQUENCY);
-            bool frame_changed = false;
-            int step_tick = 0;
-            while (step_tick++ < step_n)
-            {
-                m_PPU.Step();
-                m_PPU.Step();
-                m_PPU.Step();
-                m_CPU.Step();
-                m_APU.Step(); // APU自己在里面降频吧，因为三角波是CPU周期刷新的。
-
-                m_cartridge->GetMapper()->CPUCycleCounter();
-
-                auto PPU_frame = m_PPU.GetFrame();
-                if (PPU_frame != m_frame)
-                {
-                    m_frame = PPU_frame;
-                    frame_changed = true;
-                    break;
-                }
-            }
+            auto step_n = static_cast<std::uint64_t>(time_s * NTSC_CPU_FREQUENCY);
+            // 一帧结束就停下来，存档只能在PreRender开头（PPU读档的时候从这一行开头重新走），不能跑到下一帧中间去
+            bool frame_changed = RunCycles(step_n, true);
+
             constexpr auto remainder = 1000000000ll % NTSC_CPU_FREQUENCY;
             constexpr auto quotient = 1000000000ll / NTSC_CPU_FREQUENCY;
-            last_time += std::chrono::nanoseconds(step_tick * quotient + step_tick * remainder / NTSC_CPU_FREQUENCY);
+            last_time += std::chrono::nanoseconds(step_n * quotient + step_n * remainder / NTSC_CPU_FREQUENCY);
 
             // 只有在一帧结束之后才会读取对应的快捷操作
             if (frame_changed)
-            {
-                auto op = m_operation.exchange(EmulatorOperation::None);
-                switch (op)
-                {
-                case EmulatorOperation::None:
-                    break;
-                case EmulatorOperation::Save:
-                    Save();
-                    break;
-                case EmulatorOperation::Load:
-                    Load();
-                    m_frame = m_PPU.GetFrame();
-                    break;
-                case EmulatorOperation::Screenshot:
-                    m_screenshot_callback();
-                    break;
-                }
-            }
+                HandleOperation();
             else
-            {
                 std::this_thread::sleep_for(std::chrono::milliseconds(2));
-            }
+        }
+    }
+
+    void NesEmulator::HandleOperation()
+    {
+        auto op = m_operation.exchange(EmulatorOperation::None);
+        switch (op)
+        {
+        case EmulatorOperation::None:
+            break;
+        case EmulatorOperation::Save:
+            Save();
+            break;
+        case EmulatorOperation::Load:
+            Load();
+            m_frame = m_PPU.GetFrame();
+            m_PPU_timestamp = m_scheduler.GetTimestamp();
+            m_target_timestamp = m_scheduler.GetTimestamp();
+            UpdatePPUSyncPoint();
+            break;
+        case EmulatorOperation::Screenshot:
+            m_screenshot_callback();
+            break;
         }
     }
 
@@ -100,79 +201,85 @@ namespace nes
         else
             m_PPU.SetMirrorType(MirroringType::Horizontal);
 
-        m_cartridge->GetMapper()->OnMirroringChanged([this](MirroringType type)->void
+        auto mapper = m_cartridge->GetMapperInterface();
+        mapper->OnMirroringChanged([this](MirroringType type)->void
         {
             m_PPU.SetMirrorType(type);
         });
-        m_cartridge->GetMapper()->SetTriggerIRQCallback([this]()->void
-        {
-            m_CPU.Interrupt(CPU6502InterruptType::IRQ);
-        });
-        m_PPU.SetMapperReduceIRQCounterCallback([this]()->void
-        {
-            m_cartridge->GetMapper()->ReduceIRQCounter();
-        });
+        mapper->SetCPU(&m_CPU);
+        mapper->SetScheduler(&m_scheduler);
+        mapper->SetMemoryMap(&m_memory_map);
+        m_PPU.ResizeTileCache(m_cartridge->GetCHRRom().size());
+        mapper->SetCHRMap(m_PPU.GetCHRMap());
+        m_memory_map.MapRead(0x6000, 0x2000, m_cartridge->GetPRGRam());
+        m_memory_map.MapWrite(0x6000, 0x2000, m_cartridge->GetPRGRam());
+        m_PPU.SetMapper(&m_cartridge->GetMapper());
     }
 
-    std::uint8_t NesEmulator::MainBusRead(std::uint16_t address)
+    std::uint8_t NesEmulator::MainBusReadSlow(std::uint16_t address)
     {
+        m_CPU.EndDispatchBatch();
         // 知乎上看到的高手使用位运算减少了if的分支判断
         switch (address >> 13)
         {
-        case 0x00:  // 地址范围 : [0, 0x2000)
-            return m_RAM[address & 0x07ff]; // 只有2K内存，剩下的全是镜像
         case 0x01:  // 地址范围 : [0x2000, 0x4000)
+            SyncPPU();
             return m_PPU.GetRegister(address & 0x2007);
         case 0x02:  // 地址范围 : [0x4000, 0x6000)
             if (address == 0x4015)
+            {
+                SyncAPU(m_scheduler.GetTimestamp());
                 return m_APU.ReadStatus();
+            }
             else if (address == 0x4016)
                 return m_device->Read4016();
             else if (address == 0x4017)
                 return m_device->Read4017();
             break;
-        case 0x03:  // 地址范围 : [0x6000, 0x8000)
+        case 0x03:  // 地址范围 : [0x6000, 0x8000)，卡带上没有PRG RAM的时候才会到这里
             return m_cartridge->ReadPRGRam(address & 0x1fff);
-        case 0x04:  // 地址范围 : [0x8000, 0xA000)
-        case 0x05:  // 地址范围 : [0xA000, 0xC000)
-        case 0x06:  // 地址范围 : [0xC000, 0xE000)
-        case 0x07:  // 地址范围 : [0xE000, 0x10000)
-            return m_cartridge->GetMapper()->ReadPRG(address);
         default:
             break;
         }
         return 0;
     }
 
-    void NesEmulator::MainBusWrite(std::uint16_t address, std::uint8_t value)
+    void NesEmulator::MainBusWriteSlow(std::uint16_t address, std::uint8_t value)
     {
+        m_CPU.EndDispatchBatch();
         switch (address >> 13)
         {
-        case 0x00:  // 地址范围 : [0, 0x2000)
-            m_RAM[address & 0x07ff] = value; // 只有2K内存，剩下的全是镜像
-            break;
         case 0x01:  // 地址范围 : [0x2000, 0x4000)
+            SyncPPU();
             m_PPU.SetRegister(address & 0x2007, value);
+            UpdatePPUSyncPoint();
             break;
         case 0x02:  // 地址范围 : [0x4000, 0x6000)
             if (address <= 0x4013 || address == 0x4015 || address == 0x4017)  // 所有写APU的都算进去了
+            {
+                SyncAPU(m_scheduler.GetTimestamp());
                 m_APU.SetRegister(address, value);
+            }
             else if (address == 0x4014) // OAMDMA
             {
                 m_CPU.SkipOAMDMACycle();
+                SyncPPU();
                 m_PPU.OAMDMA(m_RAM.get() + ((value << 8) & 0x700));
             }
             if (address == 0x4016)
                 m_device->Write4016(value);
             break;
-        case 0x03:  // 地址范围 : [0x6000, 0x8000)
+        case 0x03:  // 地址范围 : [0x6000, 0x8000)，卡带上没有PRG RAM的时候才会到这里
             m_cartridge->WritePRGRam(address & 0x1fff, value);
             break;
         case 0x04:  // 地址范围 : [0x8000, 0xA000)
         case 0x05:  // 地址范围 : [0xA000, 0xC000)
         case 0x06:  // 地址范围 : [0xC000, 0xE000)
         case 0x07:  // 地址范围 : [0xE000, 0x10000)
-            m_cartridge->GetMapper()->WritePRG(address, value);
+            // 换bank、改镜像、改IRQ都会影响PPU
+            SyncPPU();
+            VisitMapper(m_cartridge->GetMapper(), [address, value](auto& mapper) { mapper.WritePRG(address, value); });
+            UpdatePPUSyncPoint();
             break;
         default:
             break;
@@ -224,9 +331,9 @@ namespace nes
         ofs.write(PPU_data.data(), PPU_data.size());
 
         // 保存Mapper
-        if (m_cartridge->GetMapper() != nullptr)
+        if (auto mapper = m_cartridge->GetMapperInterface(); mapper != nullptr)
         {
-            auto Mapper_data = m_cartridge->GetMapper()->Save();
+            auto Mapper_data = mapper->Save();
             ofs.write(Mapper_data.data(), Mapper_data.size());
         }
 
@@ -273,11 +380,13 @@ namespace nes
             m_PPU.Load(data, save_version);
 
             // 读取Mapper
-            if (m_cartridge->GetMapper() != nullptr)
+            if (auto mapper = m_cartridge->GetMapperInterface(); mapper != nullptr)
             {
-                data.resize(m_cartridge->GetMapper()->GetSaveFileSize(save_version));
+                data.resize(mapper->GetSaveFileSize(save_version));
                 ifs.read(data.data(), data.size());
-                m_cartridge->GetMapper()->Load(data, save_version);
+                mapper->Load(data, save_version);
+                // CHR RAM被整个换掉了，解码过的tile都不能用了
+                m_PPU.ClearTileCache();
             }
 
             // 读取APU
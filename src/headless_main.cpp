@@ -0,0 +1,89 @@
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <chrono>
+#include <charconv>
+#include <string_view>
+#include <vector>
+#include "cartridge.h"
+#include "emulator.h"
+#include "def.h"
+#include "virtual_device.h"
+
+// 不需要显示和音频设备，不限速跑指定的帧数，输出性能数据和最后一帧画面的hash。
+// 用法 : nes_headless <rom_file> [frames]
+
+namespace
+{
+    constexpr std::uint64_t DEFAULT_FRAMES = 600;
+
+    // FNV-1a 64位
+    std::uint64_t HashScreen(const std::uint8_t* data, std::size_t size)
+    {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (std::size_t i = 0; i < size; i++)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "usage: nes_headless <rom_file> [frames]" << std::endl;
+        return 0;
+    }
+
+    std::uint64_t frames = DEFAULT_FRAMES;
+    if (argc > 2)
+    {
+        std::string_view arg{argv[2]};
+        const auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), frames);
+        if (ec != std::errc{} || frames == 0)
+        {
+            std::cout << "Invalid frame count : " << arg << std::endl;
+            return 0;
+        }
+    }
+
+    std::unique_ptr<nes::Cartridge> cartridge = std::make_unique<nes::Cartridge>();
+    if (!cartridge->LoadFromFile(argv[1]))
+    {
+        std::cout << "Unable to load nes file : " << argv[1] << std::endl;
+        return 0;
+    }
+
+    std::shared_ptr<nes::VirtualDevice> device = std::make_shared<nes::VirtualDevice>();
+    std::shared_ptr<nes::NesEmulator> nes_emulator = std::make_shared<nes::NesEmulator>();
+    nes_emulator->SetVirtualDevice(device);
+    nes_emulator->PutInCartridge(std::move(cartridge));
+    nes_emulator->Reset();
+
+    // 没有声卡来消耗音频，每帧手动取走一块，不然音频缓冲会一直变多
+    std::vector<unsigned char> audio_buffer(nes::AUDIO_BUFFER_SAMPLES * device->GetAudioSampleSize());
+
+    auto start_time = std::chrono::steady_clock::now();
+    for (std::uint64_t frame = 0; frame < frames; frame++)
+    {
+        nes_emulator->RunFrame();
+        device->FillAudioSamples(audio_buffer.data(), static_cast<int>(audio_buffer.size()));
+    }
+    auto end_time = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end_time - start_time).count();
+    auto cycles = nes_emulator->GetCycles();
+    auto hash = HashScreen(device->GetScreenPtr(), nes::NES_WIDTH * nes::NES_HEIGHT * 4);
+
+    std::cout << "Frames        : " << frames << "\n";
+    std::cout << "CPU cycles    : " << cycles << "\n";
+    std::cout << "Time          : " << std::fixed << std::setprecision(3) << seconds << " s\n";
+    std::cout << "Frames/sec    : " << std::fixed << std::setprecision(2) << frames / seconds << "\n";
+    std::cout << "Cycles/sec    : " << std::fixed << std::setprecision(0) << cycles / seconds << "\n";
+    std::cout << "Screen hash   : " << std::hex << std::setw(16) << std::setfill('0') << hash << std::dec << std::endl;
+
+    return 0;
+}
@@ -39,6 +39,9 @@ int main(int argc, char *argv[])
     
     // 根据配置参数设置
     device->SetScale(config.Base.Scale);
+    device->SetPaletteIndexMode(config.Base.PaletteIndexFrame != 0);
+    // 打开声卡的时候可能换成声卡支持的采样率
+    device->SetAudioFormat(config.Base.AudioSampleFormat, config.Base.AudioFrequency);
     
     nes_emulator->SetVirtualDevice(device);
     // 卡带插入机器中
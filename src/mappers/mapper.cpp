@@ -0,0 +1,60 @@
+#include "mappers/mapper.h"
+#include "cartridge.h"
+#include "memory_map.h"
+
+namespace nes
+{
+    void Mapper::SetMemoryMap(MemoryMap* memory_map)
+    {
+        m_memory_map = memory_map;
+        UpdatePRGMap();
+    }
+
+    void Mapper::SetCHRMap(CHRMap* CHR_map)
+    {
+        m_CHR_map = CHR_map;
+        UpdateCHRMap();
+    }
+
+    void Mapper::MapPRG(std::uint16_t address, std::size_t size, std::size_t offset)
+    {
+        if (m_memory_map == nullptr)
+            return;
+        // PRG ROM大小是16KB的整数倍，超出去的bank取模以后还是对齐的
+        const auto& PRG_rom = m_cartridge->GetPRGRom();
+        for (std::size_t i = 0; i < size; i += MEMORY_PAGE_SIZE)
+            m_memory_map->MapRead(static_cast<std::uint16_t>(address + i), MEMORY_PAGE_SIZE, PRG_rom.data() + (offset + i) % PRG_rom.size());
+    }
+
+    void Mapper::MapCHR(std::uint16_t address, std::size_t size, std::size_t offset)
+    {
+        if (m_CHR_map == nullptr)
+            return;
+        // CHR ROM大小是8KB的整数倍，和PRG一样取模
+        const auto& CHR_rom = m_cartridge->GetCHRRom();
+        ++m_CHR_map->generation;
+        for (std::size_t i = 0; i < size; i += MEMORY_PAGE_SIZE)
+        {
+            auto page = (address + i) >> MEMORY_PAGE_SHIFT;
+            m_CHR_map->read[page] = CHR_rom.empty() ? nullptr : CHR_rom.data() + (offset + i) % CHR_rom.size();
+            m_CHR_map->write[page] = nullptr;
+            m_CHR_map->tile[page] = CHR_rom.empty() ? 0 : static_cast<std::uint32_t>((offset + i) % CHR_rom.size() / CHR_TILE_SIZE);
+        }
+    }
+
+    void Mapper::MapCHRRam(std::uint16_t address, std::size_t size, std::uint8_t* ram, std::size_t offset)
+    {
+        if (m_CHR_map == nullptr)
+            return;
+        // CHR RAM的tile在tile缓存里排在CHR ROM后面
+        auto first_tile = m_cartridge->GetCHRRom().size() / CHR_TILE_SIZE;
+        ++m_CHR_map->generation;
+        for (std::size_t i = 0; i < size; i += MEMORY_PAGE_SIZE)
+        {
+            auto page = (address + i) >> MEMORY_PAGE_SHIFT;
+            m_CHR_map->read[page] = ram + offset + i;
+            m_CHR_map->write[page] = ram + offset + i;
+            m_CHR_map->tile[page] = static_cast<std::uint32_t>(first_tile + (offset + i) / CHR_TILE_SIZE);
+        }
+    }
+}
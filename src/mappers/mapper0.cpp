@@ -1,11 +1,10 @@
 #include "mappers/mapper0.h"
 #include "cartridge.h"
+#include "memory_map.h"
 #include <memory>
 
 namespace nes
 {
-    constexpr std::size_t CHR_RAM_SIZE = 0x2000;
-
     Mapper0::Mapper0(Cartridge* cartridge) : Mapper(cartridge)
     {
         if (cartridge->GetCHRRom().size() == 0)
@@ -14,26 +13,18 @@ namespace nes
         }
     }
 
-    std::uint8_t Mapper0::ReadCHR(std::uint16_t address)
-    {
-        if (m_cartridge->GetCHRRom().size() == 0)
-            return m_CHR_ram[address];
-        else
-            return m_cartridge->GetCHRRom()[address];
-    }
-
-    void Mapper0::WriteCHR(std::uint16_t address, std::uint8_t value)
+    void Mapper0::UpdatePRGMap()
     {
-         if (m_cartridge->GetCHRRom().size() == 0)
-            m_CHR_ram[address] = value;
+        // 只有16KB的话$C000开始是镜像
+        MapPRG(0x8000, 0x8000, 0);
     }
 
-    std::uint8_t Mapper0::ReadPRG(std::uint16_t address)
+    void Mapper0::UpdateCHRMap()
     {
-        if (m_cartridge->GetPRGRom().size() == 0x4000)
-            return m_cartridge->GetPRGRom()[(address - 0x8000) & 0x3fff];
+        if (m_CHR_ram != nullptr)
+            MapCHRRam(0, CHR_RAM_SIZE, m_CHR_ram.get(), 0);
         else
-            return m_cartridge->GetPRGRom()[address - 0x8000];
+            MapCHR(0, 0x2000, 0);
     }
 
     void Mapper0::WritePRG(std::uint16_t address, std::uint8_t value)
@@ -1,11 +1,10 @@
 #include "mappers/mapper1.h"
 #include "cartridge.h"
+#include "memory_map.h"
 #include "def.h"
 
 namespace nes
 {
-    constexpr std::size_t CHR_RAM_SIZE = 0x2000;
-
     Mapper1::Mapper1(Cartridge* cartridge) : Mapper(cartridge)
     {
         m_first_bank_PRG = 0x0000;
@@ -16,28 +15,21 @@ namespace nes
             m_CHR_Ram = std::make_unique<std::uint8_t[]>(CHR_RAM_SIZE);
     }
 
-    std::uint8_t Mapper1::ReadCHR(std::uint16_t address)
-    {
-        if (m_CHR_Ram)
-            return m_CHR_Ram[address & 0x1fff];
-        if (address < 0x1000)
-            return m_cartridge->GetCHRRom()[m_CHR_bank_low + address];
-        else
-            return m_cartridge->GetCHRRom()[m_CHR_bank_high + (address & 0x0fff)];
-    }
-
-    void Mapper1::WriteCHR(std::uint16_t address, std::uint8_t value)
+    void Mapper1::UpdatePRGMap()
     {
-        if (m_CHR_Ram)
-            m_CHR_Ram[address & 0x1fff] = value;
+        MapPRG(0x8000, 0x4000, m_first_bank_PRG);
+        MapPRG(0xc000, 0x4000, m_last_bank_PRG);
     }
 
-    std::uint8_t Mapper1::ReadPRG(std::uint16_t address)
+    void Mapper1::UpdateCHRMap()
     {
-        if (address < 0xc000)
-            return m_cartridge->GetPRGRom()[m_first_bank_PRG + (address & 0x3fff)];
-        else
-            return m_cartridge->GetPRGRom()[m_last_bank_PRG + (address & 0x3fff)];
+        if (m_CHR_Ram != nullptr)
+        {
+            MapCHRRam(0, CHR_RAM_SIZE, m_CHR_Ram.get(), 0);
+            return;
+        }
+        MapCHR(0x0000, 0x1000, m_CHR_bank_low);
+        MapCHR(0x1000, 0x1000, m_CHR_bank_high);
     }
 
     void Mapper1::WritePRG(std::uint16_t address, std::uint8_t value)
@@ -113,6 +105,7 @@ namespace nes
             default: // 没有这种情况
                 break;
         }
+        UpdatePRGMap();
     }
 
     void Mapper1::SwitchCHRBank()
@@ -127,6 +120,7 @@ namespace nes
             m_CHR_bank_low = static_cast<std::uint32_t>(m_CHR_bank0 & ~0x01) << 12;
             m_CHR_bank_high = m_CHR_bank_low + 0x1000;
         }
+        UpdateCHRMap();
     }
 
     MirroringType Mapper1::GetMirroringType(std::uint8_t mirroring)
@@ -199,5 +193,8 @@ namespace nes
             for (std::size_t i = 0; i < CHR_RAM_SIZE; i++)
                 pointer = UnsafeRead(pointer, m_CHR_Ram[i]);
         }
+
+        UpdatePRGMap();
+        UpdateCHRMap();
     }
 }
@@ -1,36 +1,29 @@
 #include "mappers/mapper2.h"
 #include "cartridge.h"
+#include "memory_map.h"
 
 namespace nes
 {
-    constexpr std::size_t CHR_RAM_SIZE = 0x2000;
-
     Mapper2::Mapper2(Cartridge* cartridge) : Mapper(cartridge)
     {
         m_CHR_ram = std::make_unique<std::uint8_t[]>(CHR_RAM_SIZE);
     }
 
-    std::uint8_t Mapper2::ReadCHR(std::uint16_t address)
+    void Mapper2::UpdatePRGMap()
     {
-        return m_CHR_ram[address];
+        MapPRG(0x8000, 0x4000, static_cast<std::size_t>(m_select) << 14);
+        MapPRG(0xc000, 0x4000, m_cartridge->GetPRGRom().size() - 0x4000);
     }
 
-    void Mapper2::WriteCHR(std::uint16_t address, std::uint8_t value)
+    void Mapper2::UpdateCHRMap()
     {
-        m_CHR_ram[address] = value;
-    }
-
-    std::uint8_t Mapper2::ReadPRG(std::uint16_t address)
-    {
-        if (address < 0xc000)
-            return m_cartridge->GetPRGRom()[(address - 0x8000) | (m_select << 14)];
-        else
-            return m_cartridge->GetPRGRom()[m_cartridge->GetPRGRom().size() - 0x4000 + (address & 0x3fff)];
+        MapCHRRam(0, CHR_RAM_SIZE, m_CHR_ram.get(), 0);
     }
 
     void Mapper2::WritePRG(std::uint16_t address, std::uint8_t value)
     {
         m_select = value & 0x0f;
+        UpdatePRGMap();
     }
 
     std::vector<char> Mapper2::Save() const
@@ -67,5 +60,7 @@ namespace nes
         {
             pointer = UnsafeRead(pointer, m_CHR_ram[i]);
         }
+
+        UpdatePRGMap();
     }
 }
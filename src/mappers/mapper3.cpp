@@ -1,10 +1,9 @@
 #include "mappers/mapper3.h"
 #include "cartridge.h"
+#include "memory_map.h"
 
 namespace nes
 {
-    constexpr std::size_t CHR_RAM_SIZE = 0x2000;
-
     Mapper3::Mapper3(Cartridge* cartridge) : Mapper(cartridge)
     {
         if (cartridge->GetCHRRom().size() == 0)
@@ -13,30 +12,24 @@ namespace nes
         }
     }
 
-    std::uint8_t Mapper3::ReadCHR(std::uint16_t address)
+    void Mapper3::UpdatePRGMap()
     {
-        if (m_CHR_ram != nullptr)
-            return m_CHR_ram[address];
-        return m_cartridge->GetCHRRom()[(m_CHR_bank << 13) | address];
+        // 只有16KB的话$C000开始是镜像
+        MapPRG(0x8000, 0x8000, 0);
     }
 
-    void Mapper3::WriteCHR(std::uint16_t address, std::uint8_t value)
+    void Mapper3::UpdateCHRMap()
     {
-         if (m_CHR_ram != nullptr)
-            m_CHR_ram[address] = value;
-    }
-
-    std::uint8_t Mapper3::ReadPRG(std::uint16_t address)
-    {
-        if (m_cartridge->GetPRGRom().size() == 0x4000)
-            return m_cartridge->GetPRGRom()[(address - 0x8000) & 0x3fff];
+        if (m_CHR_ram != nullptr)
+            MapCHRRam(0, CHR_RAM_SIZE, m_CHR_ram.get(), 0);
         else
-            return m_cartridge->GetPRGRom()[address - 0x8000];
+            MapCHR(0, 0x2000, static_cast<std::size_t>(m_CHR_bank) << 13);
     }
 
     void Mapper3::WritePRG(std::uint16_t address, std::uint8_t value)
     {
         m_CHR_bank = value & 0x03;
+        UpdateCHRMap();
     }
 
     std::vector<char> Mapper3::Save() const
@@ -75,5 +68,7 @@ namespace nes
             for (std::size_t i = 0; i < CHR_RAM_SIZE; i++)
                 pointer = UnsafeRead(pointer, m_CHR_ram[i]);
         }
+
+        UpdateCHRMap();
     }
 }
@@ -1,10 +1,10 @@
 #include "mappers/mapper4.h"
 #include "cartridge.h"
+#include "memory_map.h"
+#include "cpu.h"
 
 namespace nes
 {
-    constexpr std::size_t CHR_RAM_SIZE = 0x2000;
-
     Mapper4::Mapper4(Cartridge* cartridge) : Mapper(cartridge)
     {
         if (cartridge->GetCHRRom().empty())
@@ -14,22 +14,21 @@ namespace nes
         m_CHR_bank[1] = 0x400;
     }
 
-    std::uint8_t Mapper4::ReadCHR(std::uint16_t address)
+    void Mapper4::UpdatePRGMap()
     {
-        if (m_CHR_ram != nullptr)
-            return m_CHR_ram[address];
-        return m_cartridge->GetCHRRom()[m_CHR_bank[(address >> 10) & 0x07] + (address & 0x03ff)];
+        for (std::size_t i = 0; i < m_PRG_bank.size(); i++)
+            MapPRG(static_cast<std::uint16_t>(0x8000 + i * 0x2000), 0x2000, m_PRG_bank[i]);
     }
 
-    void Mapper4::WriteCHR(std::uint16_t address, std::uint8_t value)
+    void Mapper4::UpdateCHRMap()
     {
         if (m_CHR_ram != nullptr)
-            m_CHR_ram[address] = value;
-    }
-
-    std::uint8_t Mapper4::ReadPRG(std::uint16_t address)
-    {
-        return m_cartridge->GetPRGRom()[m_PRG_bank[(address >> 13) & 0x03] + (address & 0x1fff)];
+        {
+            MapCHRRam(0, CHR_RAM_SIZE, m_CHR_ram.get(), 0);
+            return;
+        }
+        for (std::size_t i = 0; i < m_CHR_bank.size(); i++)
+            MapCHR(static_cast<std::uint16_t>(i * 0x400), 0x400, m_CHR_bank[i]);
     }
 
     void Mapper4::WritePRG(std::uint16_t address, std::uint8_t value)
@@ -82,7 +81,7 @@ namespace nes
         else
         {
             if (--m_IRQ_counter == 0 && m_IRQ_enabled)
-                m_trigger_IRQ();
+                m_CPU->Interrupt(CPU6502InterruptType::IRQ);
         }
     }
 
@@ -151,11 +150,16 @@ namespace nes
                     m_PRG_bank[0] = static_cast<std::uint32_t>(val & 0x3f) % (size >> 13) << 13;
                     m_PRG_bank[2] = size - 0x4000;
                 }
+                UpdatePRGMap();
                 break;
             case 7: // R7: Select 8 KB PRG ROM bank at $A000-$BFFF
                 m_PRG_bank[1] = static_cast<std::uint32_t>(val & 0x3f) % (static_cast<std::uint32_t>(m_cartridge->GetPRGRom().size()) >> 13) << 13;
+                UpdatePRGMap();
                 break;
         }
+        // R0到R5换的是CHR
+        if ((m_bank_select & 0x07) < 6)
+            UpdateCHRMap();
     }
 
     std::vector<char> Mapper4::Save() const
@@ -204,5 +208,8 @@ namespace nes
             for (std::size_t i = 0; i < CHR_RAM_SIZE; i++)
                 pointer = UnsafeRead(pointer, m_CHR_ram[i]);
         }
+
+        UpdatePRGMap();
+        UpdateCHRMap();
     }
 }
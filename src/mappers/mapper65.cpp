@@ -1,5 +1,8 @@
 #include "mappers/mapper65.h"
 #include "cartridge.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include <algorithm>
 
 namespace nes
 {
@@ -11,22 +14,16 @@ namespace nes
         m_PRG_bank[3] = 0x3f;
     }
 
-    std::uint8_t Mapper65::ReadCHR(std::uint16_t address)
+    void Mapper65::UpdatePRGMap()
     {
-        auto add = (static_cast<std::size_t>(m_CHR_bank[(address >> 10) & 0x07]) << 10) | (address & 0x03ff);
-        add = add % m_cartridge->GetCHRRom().size(); // 这样更安全
-        return m_cartridge->GetCHRRom()[add];
+        for (std::size_t i = 0; i < m_PRG_bank.size(); i++)
+            MapPRG(static_cast<std::uint16_t>(0x8000 + i * 0x2000), 0x2000, static_cast<std::size_t>(m_PRG_bank[i]) << 13);
     }
 
-    void Mapper65::WriteCHR(std::uint16_t address, std::uint8_t value)
+    void Mapper65::UpdateCHRMap()
     {
-    }
-
-    std::uint8_t Mapper65::ReadPRG(std::uint16_t address)
-    {
-        auto add = (static_cast<std::size_t>(m_PRG_bank[(address >> 13) & 0x03]) << 13) | (address & 0x1fff);
-        add = add % m_cartridge->GetPRGRom().size(); // 这样更安全
-        return m_cartridge->GetPRGRom()[add];
+        for (std::size_t i = 0; i < m_CHR_bank.size(); i++)
+            MapCHR(static_cast<std::uint16_t>(i * 0x400), 0x400, static_cast<std::size_t>(m_CHR_bank[i]) << 10);
     }
 
     void Mapper65::WritePRG(std::uint16_t address, std::uint8_t value)
@@ -45,9 +42,13 @@ namespace nes
                 m_PRG_bank[0] = 0x3e;
                 m_PRG_bank[2] = value;
             }
+            UpdatePRGMap();
         }
         else if (address == 0xa000)
+        {
             m_PRG_bank[1] = value;
+            UpdatePRGMap();
+        }
         else if (address == 0x9000)
         {
             if ((value & 0x80) == 0)
@@ -62,11 +63,15 @@ namespace nes
                 m_PRG_bank[0] = 0x3e;
                 m_PRG_bank[2] = m_Write_0x8000;
             }
+            UpdatePRGMap();
         }
 
         // CHR
         else if (address >= 0xb000 && address <= 0xb007)
+        {
             m_CHR_bank[static_cast<std::size_t>(address & 0x07)] = value;
+            UpdateCHRMap();
+        }
 
         else if (address == 0x9001)
         {
@@ -84,26 +89,52 @@ namespace nes
         }
 
         // IRQ
-        else if (address == 0x9003)
-            m_IRQ_enable = (value & 0x80) != 0;
-        else if (address == 0x9004)
-            m_IRQ_tick = m_IRQ_counter;
-        else if (address == 0x9005)
-            m_IRQ_counter = static_cast<std::uint16_t>(value) << 8;
-        else if (address == 0x9006)
-            m_IRQ_counter |= value;
+        else if (address >= 0x9003 && address <= 0x9006)
+        {
+            UpdateIRQCounter();
+            if (address == 0x9003)
+                m_IRQ_enable = (value & 0x80) != 0;
+            else if (address == 0x9004)
+                m_IRQ_tick = m_IRQ_counter;
+            else if (address == 0x9005)
+                m_IRQ_counter = static_cast<std::uint16_t>(value) << 8;
+            else if (address == 0x9006)
+                m_IRQ_counter |= value;
+            ScheduleIRQ();
+        }
+    }
+
+    std::uint16_t Mapper65::GetIRQCounter() const
+    {
+        // 每个CPU周期减1，减到0停
+        if (!m_IRQ_enable)
+            return m_IRQ_counter;
+        auto cycles = (m_scheduler->GetTimestamp() - m_IRQ_timestamp) / CPU_CLOCK_DIVIDER;
+        return static_cast<std::uint16_t>(m_IRQ_counter - std::min<std::uint64_t>(cycles, m_IRQ_counter));
+    }
+
+    void Mapper65::UpdateIRQCounter()
+    {
+        m_IRQ_counter = GetIRQCounter();
+        m_IRQ_timestamp = m_scheduler->GetTimestamp();
     }
 
-    void Mapper65::CPUCycleCounter()
+    void Mapper65::ScheduleIRQ()
     {
-        if (m_IRQ_counter > 0 && m_IRQ_enable)
+        // 计数器减到0的那个周期触发IRQ，CPU下个周期才能看到
+        if (m_IRQ_enable && m_IRQ_counter > 0)
+            m_scheduler->Schedule(SchedulerEvent::MapperIRQ, m_IRQ_timestamp + m_IRQ_counter * CPU_CLOCK_DIVIDER);
+        else
+            m_scheduler->Cancel(SchedulerEvent::MapperIRQ);
+    }
+
+    void Mapper65::OnScheduledIRQ()
+    {
+        UpdateIRQCounter();
+        if (m_IRQ_enable && m_IRQ_counter == 0)
         {
-            m_IRQ_counter--;
-            if (m_IRQ_counter == 0)
-            {
-                m_trigger_IRQ();
-                m_IRQ_enable = false;
-            }
+            m_CPU->Interrupt(CPU6502InterruptType::IRQ);
+            m_IRQ_enable = false;
         }
     }
 
@@ -113,7 +144,7 @@ namespace nes
 
         auto pointer = res.data();
 
-        pointer = UnsafeWrite(pointer, m_IRQ_counter);
+        pointer = UnsafeWrite(pointer, GetIRQCounter());
         pointer = UnsafeWrite(pointer, m_IRQ_tick);
         pointer = UnsafeWrite(pointer, m_IRQ_enable);
         pointer = UnsafeWrite(pointer, m_PRG_layout);
@@ -143,5 +174,11 @@ namespace nes
         pointer = UnsafeRead(pointer, m_PRG_bank);
         pointer = UnsafeRead(pointer, m_CHR_bank);
         pointer = UnsafeRead(pointer, m_Write_0x8000);
+
+        UpdatePRGMap();
+        UpdateCHRMap();
+
+        m_IRQ_timestamp = m_scheduler->GetTimestamp();
+        ScheduleIRQ();
     }
 }
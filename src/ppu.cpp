@@ -1,15 +1,137 @@
 #include "ppu.h"
 #include <cstring>
+#include <algorithm>
 #include "virtual_device.h"
+#include "cpu.h"
+#include "palette.h"
 
 namespace nes
 {
     constexpr int SCANLINE_PER_FRAME = 262;
     constexpr int CYCLE_PER_SCANLINE = 340;
+    constexpr int PRE_RENDER_SCANLINE = 261;
+    constexpr int DOTS_PER_SCANLINE = CYCLE_PER_SCANLINE + 1;
+    constexpr int DOTS_PER_FRAME = SCANLINE_PER_FRAME * DOTS_PER_SCANLINE;
 
-    PPU::PPU() : m_VRAM(std::make_unique<std::uint8_t[]>(0x0800)), m_step_coro(StepCoro())
+    namespace
+    {
+        // 每个点要做的事，一个点可以有好几个
+        enum PPUDotAction : std::uint32_t
+        {
+            DOT_RENDER_PIXEL      = 1 << 0,  // 可见扫描线上画一个像素（顺便取背景数据），这些点上没有别的事
+            DOT_RENDER_LINE       = 1 << 1,  // 可见扫描线第1个点，后面的点都在这次Run里的话可以整行一起画
+            DOT_FETCH_NAMETABLE   = 1 << 2,  // 下一行前两个tile的预取
+            DOT_FETCH_ATTRIBUTE   = 1 << 3,
+            DOT_FETCH_PATTERN_LOW = 1 << 4,
+            DOT_FETCH_PATTERN_HIGH= 1 << 5,
+            DOT_RELOAD_SHIFTERS   = 1 << 6,  // 预取的tile放进移位寄存器，coarse X加一
+            DOT_COPY_HORIZONTAL   = 1 << 7,  // v: ....A.. ...BCDEF <- t: ....A.. ...BCDEF
+            DOT_COPY_VERTICAL     = 1 << 8,  // v: GHIA.BC DEF..... <- t: GHIA.BC DEF.....
+            DOT_RESET_OAMADDR     = 1 << 9,
+            DOT_MAPPER_IRQ        = 1 << 10, // mapper数扫描线
+            DOT_CLEAR_VBLANK      = 1 << 11, // 清除sprite 0 hit和vertical blank标记
+            DOT_SET_VBLANK        = 1 << 12,
+            DOT_TRIGGER_NMI       = 1 << 13,
+            DOT_NMI_CONFLICT_BEGIN= 1 << 14, // 从这个点开始读PPUSTATUS会和设置vertical blank冲突
+            DOT_NMI_CONFLICT_END  = 1 << 15,
+            DOT_CLEAR_NMI_CONFLICT= 1 << 16,
+            DOT_ODD_FRAME_SKIP    = 1 << 17, // 奇数帧并且在渲染的话没有这个点，直接到下一行
+        };
+
+        // 不同的扫描线只有这几种，每种一行表
+        enum PPULineKind
+        {
+            LINE_PRE_RENDER,
+            LINE_VISIBLE,
+            LINE_POST_RENDER,
+            LINE_VBLANK_START, // 241，设置vertical blank和NMI
+            LINE_VBLANK,       // 242到260，什么都不做
+            LINE_KIND_COUNT
+        };
+
+        using PPULineActions = std::array<std::uint32_t, DOTS_PER_SCANLINE>;
+
+        constexpr std::array<PPULineActions, LINE_KIND_COUNT> MakeDotActions()
+        {
+            std::array<PPULineActions, LINE_KIND_COUNT> res{};
+
+            auto& pre_render = res[LINE_PRE_RENDER];
+            pre_render[1] |= DOT_CLEAR_VBLANK;
+            for (int cycle = 280; cycle <= 304; cycle++)
+                pre_render[cycle] |= DOT_COPY_VERTICAL;
+            pre_render[260] |= DOT_MAPPER_IRQ;
+            pre_render[340] |= DOT_ODD_FRAME_SKIP;
+
+            auto& visible = res[LINE_VISIBLE];
+            visible[1] |= DOT_RENDER_LINE;
+            for (int cycle = 1; cycle <= 256; cycle++)
+                visible[cycle] |= DOT_RENDER_PIXEL;
+            visible[257] |= DOT_COPY_HORIZONTAL;
+            for (int cycle = 257; cycle <= 320; cycle++)
+                visible[cycle] |= DOT_RESET_OAMADDR;
+            visible[260] |= DOT_MAPPER_IRQ;
+            for (int cycle = 321; cycle <= 336; cycle++)
+            {
+                switch (cycle % 8)
+                {
+                    case 1: visible[cycle] |= DOT_FETCH_NAMETABLE; break;
+                    case 3: visible[cycle] |= DOT_FETCH_ATTRIBUTE; break;
+                    case 5: visible[cycle] |= DOT_FETCH_PATTERN_LOW; break;
+                    case 7: visible[cycle] |= DOT_FETCH_PATTERN_HIGH; break;
+                    case 0: visible[cycle] |= DOT_RELOAD_SHIFTERS; break;
+                    default: break;
+                }
+            }
+
+            res[LINE_POST_RENDER][340] |= DOT_NMI_CONFLICT_BEGIN;
+
+            auto& vblank_start = res[LINE_VBLANK_START];
+            vblank_start[0] |= DOT_CLEAR_NMI_CONFLICT;
+            vblank_start[1] |= DOT_SET_VBLANK;
+            vblank_start[2] |= DOT_NMI_CONFLICT_END;
+            vblank_start[15] |= DOT_TRIGGER_NMI;
+
+            return res;
+        }
+
+        constexpr auto DOT_ACTIONS = MakeDotActions();
+
+        // 每种扫描线最后一个有事做的点，后面的点可以一次跳过去
+        constexpr std::array<int, LINE_KIND_COUNT> MakeLastActionCycles()
+        {
+            std::array<int, LINE_KIND_COUNT> res{};
+            for (int kind = 0; kind < LINE_KIND_COUNT; kind++)
+            {
+                for (int cycle = 0; cycle < DOTS_PER_SCANLINE; cycle++)
+                {
+                    if (DOT_ACTIONS[kind][cycle] != 0)
+                        res[kind] = cycle;
+                }
+            }
+            return res;
+        }
+
+        constexpr auto LAST_ACTION_CYCLES = MakeLastActionCycles();
+
+        constexpr PPULineKind GetLineKind(int scanline)
+        {
+            if (scanline == PRE_RENDER_SCANLINE)
+                return LINE_PRE_RENDER;
+            if (scanline < 240)
+                return LINE_VISIBLE;
+            if (scanline == 240)
+                return LINE_POST_RENDER;
+            if (scanline == 241)
+                return LINE_VBLANK_START;
+            return LINE_VBLANK;
+        }
+    }
+
+    PPU::PPU() : m_VRAM(std::make_unique<std::uint8_t[]>(0x0800)), m_compose_scanline(GetComposeScanline(GetBestComposeKernel())), m_render_dots(SelectRenderDots(0))
     {
         m_secondary_OAM.reserve(8);
+        UpdateNametableMap();
+        Reset();
     }
 
     PPU::~PPU()
@@ -19,290 +141,449 @@ namespace nes
 
     void PPU::Reset()
     {
-        m_step_coro = StepCoro();
+        m_sprite_line_valid = false;
+        // 下一个点就是PreRender的第0个点
+        SetScanline(PRE_RENDER_SCANLINE);
+        m_cycle = -1;
     }
 
-    void PPU::Step()
+    void PPU::Run(std::uint32_t dots)
+    {
+        while (dots > 0)
+        {
+            dots--;
+            NextDot();
+
+            auto actions = m_line_actions[m_cycle];
+            if (actions & DOT_RENDER_PIXEL)
+            {
+                // 这一行后面的255个点都在这次Run里的话，中间CPU不会改寄存器、bank和镜像，可以整行一起画
+                if ((actions & DOT_RENDER_LINE) && dots >= 255)
+                {
+                    RenderScanline(m_scanline);
+                    m_cycle = 256;
+                    dots -= 255;
+                    continue;
+                }
+                // 不够的话说明中间CPU要插进来（光栅效果之类的），这次能走到的像素一个点一个点画
+                int last = std::min(256, m_cycle + static_cast<int>(std::min(dots, 255u)));
+                dots -= last - m_cycle;
+                (this->*m_render_dots)(m_scanline, m_cycle, last);
+                m_cycle = last;
+                continue;
+            }
+            if (actions != 0)
+                ExecuteDot(actions);
+
+            // 这一行后面都没事做了，直接走到行尾
+            if (m_cycle >= m_line_last_action)
+            {
+                auto idle = std::min(dots, static_cast<std::uint32_t>(CYCLE_PER_SCANLINE - m_cycle));
+                m_cycle += static_cast<int>(idle);
+                dots -= idle;
+            }
+        }
+    }
+
+    inline void PPU::NextDot()
     {
-        // if (m_scanline == 261) // PreRender
-        //     StepPreRenderScanline();
-        // else if (m_scanline >= 0 && m_scanline <= 239) // Visible
-        //     StepVisibleScanlines();
-        // else if (m_scanline == 240) // PostRender
-        //     StepPostRenderScanline();
-        // else // m_scanline >= 241 && m_scanline <= 260, VerticalBlanking
-        //     StepVerticalBlankingLines();
         m_cycle++;
-        m_step_coro.m_handle.resume();
+        if (m_cycle > CYCLE_PER_SCANLINE)
+            NextScanline();
+        else if ((m_line_actions[m_cycle] & DOT_ODD_FRAME_SKIP) && IsRenderingEnabled() && m_frame % 2 != 0)
+            NextScanline();
     }
 
-    PPUCycleCoro PPU::StepCoro()
+    void PPU::NextScanline()
     {
-        while (true)
+        m_cycle = 0;
+        m_sprite_line_valid = false;
+        if (m_scanline == PRE_RENDER_SCANLINE)
         {
-            // =========================================
-            // PreRender (scanline == 261)
-            // =========================================
-            {
-                m_scanline_type = PPUScanlineType::PreRender;
-                // cycle == 0
-                m_cycle = 0;
-                co_await std::suspend_always{};
-
-                // cycle == 1
-                m_PPUSTATUS &= ~0xC0; // 清除sprite 0 hit和vertical blank标记
-                m_has_trigger_NMI = false;
-                co_await std::suspend_always{};
-
-                // cycle -> [2, 339]
-                for (int cycle = 2; cycle <= 339; cycle++)
-                {
-                    if (IsRenderingEnabled() && cycle >= 280 && cycle <= 304)
-                    {
-                        // v: GHIA.BC DEF..... <- t: GHIA.BC DEF.....
-                        m_PPUADDR &= ~0x7be0;
-                        m_PPUADDR |= m_internal_register_wt & 0x7be0;
-                    }
-                    if (cycle == 260 && (IsShowBackgroundEnabled() || IsShowSpriteEnabled()))
-                        m_mapper_reduce_IRQ_counter();
-                    co_await std::suspend_always{};
-                }
+            SetScanline(0);
+            m_device->StartPPURender();
+        }
+        else
+        {
+            // 一帧结束，m_frame在PreRender的第0个点加一
+            if (m_scanline == PRE_RENDER_SCANLINE - 1)
+                m_frame++;
+            SetScanline(m_scanline + 1);
+            if (m_scanline == 240)
+                m_device->EndPPURender();
+        }
+    }
 
-                // 有没有cycle == 340??
-                // 奇数帧的时候会少一个cycle，直接跳到下一个渲染，偶数帧就还得有个340
-                if (!IsRenderingEnabled() || m_frame % 2 == 0)
-                {
-                    co_await std::suspend_always{};
-                }
+    void PPU::SetScanline(int scanline)
+    {
+        static constexpr std::array<PPUScanlineType, LINE_KIND_COUNT> SCANLINE_TYPES =
+        {
+            PPUScanlineType::PreRender,
+            PPUScanlineType::Visible,
+            PPUScanlineType::PostRender,
+            PPUScanlineType::VerticalBlanking,
+            PPUScanlineType::VerticalBlanking,
+        };
+
+        auto kind = GetLineKind(scanline);
+        m_scanline = scanline;
+        m_scanline_type = SCANLINE_TYPES[kind];
+        m_line_actions = DOT_ACTIONS[kind].data();
+        m_line_last_action = LAST_ACTION_CYCLES[kind];
+    }
 
-                m_device->StartPPURender();
+    void PPU::ExecuteDot(std::uint32_t actions)
+    {
+        if (IsRenderingEnabled())
+        {
+            if (actions & DOT_FETCH_NAMETABLE)
+                FetchingNametable();
+            if (actions & DOT_FETCH_ATTRIBUTE)
+                FetchingAttribute();
+            if (actions & DOT_FETCH_PATTERN_LOW)
+                FetchingPatternLow();
+            if (actions & DOT_FETCH_PATTERN_HIGH)
+                FetchingPatternHigh();
+            if (actions & DOT_RELOAD_SHIFTERS)
+            {
+                m_fetched_attribute_table <<= 8;
+                m_fetched_attribute_table |= m_attribute_table;
+                m_fetched_pattern_low <<= 8;
+                m_fetched_pattern_low |= m_pattern_low;
+                m_fetched_pattern_high <<= 8;
+                m_fetched_pattern_high |= m_pattern_high;
+                IncHorizontal();
+            }
+            if (actions & DOT_COPY_HORIZONTAL)
+            {
+                m_PPUADDR &= ~0x041f;
+                m_PPUADDR |= m_internal_register_wt & 0x041f;
+            }
+            if (actions & DOT_COPY_VERTICAL)
+            {
+                m_PPUADDR &= ~0x7be0;
+                m_PPUADDR |= m_internal_register_wt & 0x7be0;
             }
+            if (actions & DOT_MAPPER_IRQ)
+                VisitMapper(*m_mapper, [](auto& mapper) { mapper.ReduceIRQCounter(); });
+        }
+
+        if (actions & DOT_RESET_OAMADDR)
+            m_OAMADDR = 0;
 
-            // =========================================
-            // Visible (scanline -> [0, 239])
-            // =========================================
+        if (actions & DOT_CLEAR_VBLANK)
+        {
+            m_PPUSTATUS &= ~0xC0;
+            m_has_trigger_NMI = false;
+        }
+        if (actions & DOT_NMI_CONFLICT_BEGIN)
+            m_may_cause_NMI_conflict = true;
+        if (actions & DOT_CLEAR_NMI_CONFLICT)
+            m_NMI_conflict = false;
+        if (actions & DOT_SET_VBLANK)
+        {
+            if (!m_NMI_conflict)
+                m_PPUSTATUS |= 0x80; // 设置vertical blank标记
+        }
+        if (actions & DOT_NMI_CONFLICT_END)
+            m_may_cause_NMI_conflict = false;
+        if (actions & DOT_TRIGGER_NMI)
+        {
+            if ((m_PPUSTATUS & 0x80) && IsNMIEnabled() && !m_has_trigger_NMI)
             {
-                m_scanline_type = PPUScanlineType::Visible;
+                m_CPU->Interrupt(CPU6502InterruptType::NMI);
+                m_has_trigger_NMI = true;
+            }
+        }
+    }
 
-                for (int scanline = 0; scanline <= 239; scanline++)
-                {
-                    // cycle == 0
-                    m_cycle = 0;
-                    co_await std::suspend_always{};
+    std::uint32_t PPU::GetDotsToNextEvent(bool scanline_IRQ) const
+    {
+        // 把PreRender当成一帧的第0行来算位置
+        auto position = [](int scanline, int cycle) { return (scanline + 1) % SCANLINE_PER_FRAME * DOTS_PER_SCANLINE + cycle; };
+        int current = position(m_scanline, m_cycle);
 
-                    // cycle -> [1, 256]
-                    for (int cycle = 1; cycle <= 256; cycle++)
-                    {
-                        StepExecVisibleRendering(scanline, cycle);
-                        co_await std::suspend_always{};
-                    }
+        auto distance = [&](int scanline, int cycle)
+        {
+            int res = (position(scanline, cycle) - current + DOTS_PER_FRAME) % DOTS_PER_FRAME;
+            if (res == 0)
+                res = DOTS_PER_FRAME;
+            // 奇数帧PreRender会少一个点，不管这帧跳不跳都按跳算，早一点同步没关系
+            if (m_scanline == PRE_RENDER_SCANLINE && m_cycle < CYCLE_PER_SCANLINE && res > CYCLE_PER_SCANLINE - m_cycle)
+                res--;
+            return res;
+        };
+
+        // 一帧结束，m_frame在PreRender的第0个点加一
+        int res = distance(PRE_RENDER_SCANLINE, 0);
+        // 触发NMI的位置
+        res = std::min(res, distance(241, 15));
+        // mapper在第260个点数扫描线
+        if (scanline_IRQ && IsRenderingEnabled())
+        {
+            int scanline = m_scanline;
+            if (m_cycle >= 260 || (scanline >= 240 && scanline < PRE_RENDER_SCANLINE))
+                scanline = (scanline + 1) % SCANLINE_PER_FRAME;
+            if (scanline >= 240 && scanline < PRE_RENDER_SCANLINE)
+                scanline = PRE_RENDER_SCANLINE;
+            res = std::min(res, distance(scanline, 260));
+        }
+        return static_cast<std::uint32_t>(res);
+    }
 
-                    // cycle == 257
-                    if (IsRenderingEnabled())
-                    {
-                        // v: ....A.. ...BCDEF <- t: ....A.. ...BCDEF
-                        m_PPUADDR &= ~0x041f;
-                        m_PPUADDR |= m_internal_register_wt & 0x041f;
-                    }
-                    m_OAMADDR = 0;
-                    co_await std::suspend_always{};
+    template <std::uint8_t MASK>
+    void PPU::RenderDots(int scanline, int first, int last)
+    {
+        constexpr bool SHOW_BACKGROUND = (MASK & 0x08) != 0;
+        constexpr bool SHOW_SPRITE = (MASK & 0x10) != 0;
+        constexpr bool BACKGROUND_LEFTMOST8 = (MASK & 0x02) != 0;
+        constexpr bool SPRITE_LEFTMOST8 = (MASK & 0x04) != 0;
+
+        if (first == 1)
+            m_device->SetLineEmphasis(scanline, m_PPUMASK >> 5);
+
+        if constexpr (!SHOW_BACKGROUND && !SHOW_SPRITE)
+        {
+            // 关了渲染的时候不取数据，v和移位寄存器都不动，每个点都是背景色
+            std::uint8_t color = GetPalette(0) & 0x3f;
+            for (int cycle = first; cycle <= last; cycle++)
+                m_device->SetPixel(cycle - 1, scanline, color);
+        }
+        else
+        {
+            // 一次Run里CPU不会插进来，这一行的精灵不会变
+            const std::uint8_t* sprite_line = SHOW_SPRITE ? GetSpriteLine(scanline).data() : nullptr;
+
+            for (int cycle = first; cycle <= last; cycle++)
+            {
+                int x = (m_fine_x_scroll + cycle - 1) & 0x07;
 
-                    // cycle -> [258, 320]
-                    for (int cycle = 258; cycle <= 320; cycle++)
+                FetchingData(cycle);
+
+                std::uint8_t color_index = 0;
+                if constexpr (SHOW_BACKGROUND)
+                {
+                    if (BACKGROUND_LEFTMOST8 || cycle > 8)
                     {
-                        if (cycle == 260 && (IsShowBackgroundEnabled() || IsShowSpriteEnabled()))
-                            m_mapper_reduce_IRQ_counter();
-                        m_OAMADDR = 0;
-                        co_await std::suspend_always{};
+                        color_index = ((m_fetched_pattern_high >> (15 - x) << 1) & 0x02) | (m_fetched_pattern_low >> (15 - x) & 0x01);
+                        if (color_index != 0)
+                            color_index |= ((m_fetched_attribute_table >> 6) & 0x0c);
                     }
+                }
 
-                    // cycle -> [321, 336]
-                    for (int cycle = 321; cycle <= 336; cycle++)
+                if constexpr (SHOW_SPRITE)
+                {
+                    if (SPRITE_LEFTMOST8 || cycle > 8)
                     {
-                        if (IsRenderingEnabled())
+                        std::uint8_t sprite_pixel = sprite_line[cycle - 1];
+                        if ((sprite_pixel & 0x80) != 0)
                         {
-                            FetchingData(cycle);
-                            if (cycle % 8 == 0)
+                            if constexpr (SHOW_BACKGROUND)
                             {
-                                m_fetched_attribute_table <<= 8;
-                                m_fetched_attribute_table |= m_attribute_table;
-                                m_fetched_pattern_low <<= 8;
-                                m_fetched_pattern_low |= m_pattern_low;
-                                m_fetched_pattern_high <<= 8;
-                                m_fetched_pattern_high |= m_pattern_high;
-                                IncHorizontal();
+                                if ((sprite_pixel & 0x40) != 0 && color_index != 0)
+                                    m_PPUSTATUS |= 0x40;
                             }
+                            // 背景透明或者精灵在前面
+                            if (color_index == 0 || (sprite_pixel & 0x20) == 0)
+                                color_index = sprite_pixel & 0x1f;
                         }
-                        co_await std::suspend_always{};
                     }
-
-                    // cycle -> [337, 340]
-                    for (int cycle = 337; cycle <= 340; cycle++)
-                        co_await std::suspend_always{};
                 }
-            }
 
-            // =========================================
-            // PostRender (scanline == 240)
-            // =========================================
-            {
-                m_scanline_type = PPUScanlineType::PostRender;
-
-                m_device->EndPPURender();
-                m_cycle = 0;
-                for (int cycle = 0; cycle <= 339; cycle++)
-                    co_await std::suspend_always{};
-                m_may_cause_NMI_conflict = true;
-                co_await std::suspend_always{};
-            }
+                m_device->SetPixel(cycle - 1, scanline, GetPalette(color_index) & 0x3f);
 
-            // =========================================
-            // VerticalBlanking (scanline -> [241, 260])
-            // =========================================
-            {
-                m_scanline_type = PPUScanlineType::VerticalBlanking;
-
-                // scanline == 241 事太多，单独拿出来
-                // cycle == 0
-                m_cycle = 0;
-                m_NMI_conflict = false;
-                co_await std::suspend_always{};
-
-                // cycle == 1
-                if (!m_NMI_conflict)
-                    m_PPUSTATUS |= 0x80; // 设置vertical blank标记
-                co_await std::suspend_always{};
-
-                m_may_cause_NMI_conflict = false;
-                // cycle -> [2, 340]
-                for (int cycle = 2; cycle <= 340; cycle++)
+                if (x == 7)
                 {
-                    if (cycle == 15 && (m_PPUSTATUS & 0x80) && IsNMIEnabled() && !m_has_trigger_NMI)
-                    {
-                        m_trigger_NMI();
-                        m_has_trigger_NMI = true;
-                    }
-                    co_await std::suspend_always{};
+                    m_fetched_attribute_table <<= 8;
+                    m_fetched_pattern_low <<= 8;
+                    m_fetched_pattern_high <<= 8;
                 }
-
-                // 剩余scanline和cycle
-                for (int scanline = 242; scanline <= 260; scanline++)
+                if (cycle % 8 == 0)
                 {
-                    m_cycle = 0;
-                    for (int cycle = 0; cycle <= 340; cycle++)
-                        co_await std::suspend_always{};
+                    m_fetched_attribute_table |= m_attribute_table;
+                    m_fetched_pattern_low |= m_pattern_low;
+                    m_fetched_pattern_high |= m_pattern_high;
+                    IncHorizontal();
                 }
             }
 
-            m_frame++;
+            if (last == 256)
+            {
+                IncVertical();
+                // 本来是65~256cycle去做这个事，省了，就在最后一周期搞了，以后有问题以后再说
+                if constexpr (SHOW_SPRITE)
+                    SpriteEvaluation(scanline + 1);
+            }
         }
     }
 
-    void PPU::StepExecVisibleRendering(int scanline, int cycle)
+    PPU::RenderDotsFunc PPU::SelectRenderDots(std::uint8_t mask)
     {
-        std::uint8_t background_color_index = 0;
-        std::uint8_t sprite_color_index = 0;
-        bool bg_transparent = false;
-        bool sp_foreground = false;
+        // 没显示的那一层，左边8像素裁不裁都一样，归到同一个版本
+        mask &= 0x1e;
+        if ((mask & 0x08) == 0)
+            mask &= ~0x02;
+        if ((mask & 0x10) == 0)
+            mask &= ~0x04;
+
+        switch (mask)
+        {
+        case 0x00: return &PPU::RenderDots<0x00>; // 关了渲染
+        case 0x08: return &PPU::RenderDots<0x08>; // 只有背景
+        case 0x0a: return &PPU::RenderDots<0x0a>;
+        case 0x10: return &PPU::RenderDots<0x10>; // 只有精灵
+        case 0x14: return &PPU::RenderDots<0x14>;
+        case 0x18: return &PPU::RenderDots<0x18>; // 都有
+        case 0x1a: return &PPU::RenderDots<0x1a>;
+        case 0x1c: return &PPU::RenderDots<0x1c>;
+        case 0x1e: return &PPU::RenderDots<0x1e>;
+        default: return &PPU::RenderDots<0x00>;
+        }
+    }
 
+    void PPU::RenderScanline(int scanline)
+    {
+        // 和RenderDots走256个点的结果完全一样，包括v、移位寄存器和PPUSTATUS
+        // 背景的颜色索引，0是透明（包括被左边8像素裁掉的）
+        std::array<std::uint8_t, 256> background{};
         if (IsRenderingEnabled())
         {
-            int x = (m_fine_x_scroll + cycle - 1) & 0x07;
-
-            FetchingData(cycle);
+            // 按顺序排好的这一行的背景，第p个像素是line[p + fine_x]
+            // 前两个tile是上一行最后预取的，已经在移位寄存器里了，后面的是这一行取的，最后一个tile画不到
+            std::array<std::uint8_t, 33 * 8> line;
+            for (int i = 0; i < 16; i++)
+            {
+                std::uint8_t color = ((m_fetched_pattern_high >> (15 - i) << 1) & 0x02) | (m_fetched_pattern_low >> (15 - i) & 0x01);
+                std::uint8_t attribute = i < 8 ? ((m_fetched_attribute_table >> 6) & 0x0c) : ((m_fetched_attribute_table << 2) & 0x0c);
+                line[i] = color != 0 ? (color | attribute) : 0;
+            }
 
-            if (IsShowBackgroundLeftmost8() || cycle > 8)
+            // 一个tile的四次读取都在这8个点的最后才用到，中间v也不会变，所以可以一起读
+            for (int tile = 0; tile < 32; tile++)
             {
-                background_color_index = ((m_fetched_pattern_high >> (15 - x) << 1) & 0x02) | (m_fetched_pattern_low >> (15 - x) & 0x01);
-                if (background_color_index != 0)
+                FetchingNametable();
+                FetchingAttribute();
+                if (tile < 31)
                 {
-                    background_color_index |= ((m_fetched_attribute_table >> 6) & 0x0c);
+                    std::uint16_t pattern_address = (static_cast<std::uint16_t>(m_nametable) << 4) | ((m_PPUADDR >> 12) & 0x07) | GetBackgroundPatternTableAddress();
+                    const std::uint8_t* row = GetTileRow(pattern_address, false);
+                    std::uint8_t attribute = m_attribute_table << 2;
+                    auto out = line.data() + ((tile + 2) << 3);
+                    for (int i = 0; i < 8; i++)
+                        out[i] = row[i] != 0 ? (row[i] | attribute) : 0;
+                }
+                // 最后两个tile留在移位寄存器里，和逐点画完的状态一样
+                if (tile >= 30)
+                {
+                    FetchingPatternLow();
+                    FetchingPatternHigh();
+                    m_fetched_attribute_table = (m_fetched_attribute_table << 8) | m_attribute_table;
+                    m_fetched_pattern_low = (m_fetched_pattern_low << 8) | m_pattern_low;
+                    m_fetched_pattern_high = (m_fetched_pattern_high << 8) | m_pattern_high;
                 }
-            }
-            if (background_color_index == 0 || !IsShowBackgroundEnabled())
-                bg_transparent = true;
-            
-            if (x == 7)
-            {
-                m_fetched_attribute_table <<= 8;
-                m_fetched_pattern_low <<= 8;
-                m_fetched_pattern_high <<= 8;
-            }
-            if (cycle % 8 == 0)
-            {
-                m_fetched_attribute_table |= m_attribute_table;
-                m_fetched_pattern_low |= m_pattern_low;
-                m_fetched_pattern_high |= m_pattern_high;
                 IncHorizontal();
             }
-            if (cycle == 256)
+            IncVertical();
+
+            if (IsShowBackgroundEnabled())
             {
-                IncVertical();
+                int background_start = IsShowBackgroundLeftmost8() ? 0 : 8;
+                for (int pixel = background_start; pixel < 256; pixel++)
+                    background[pixel] = line[pixel + m_fine_x_scroll];
             }
         }
-        if (IsShowSpriteEnabled() && (IsShowSpriteLeftmost8() || cycle > 8))
-        {
-            for (int i : m_secondary_OAM)
-            {
-                int x = m_primary_OAM[(i << 2) | 3];
-                int diff_x = cycle - x - 1;
-                if (diff_x >= 0 && diff_x < 8)
-                {
-                    int y = m_primary_OAM[(i << 2) | 0] + 1;
-                    int index = m_primary_OAM[(i << 2) | 1];
-                    int attribute = m_primary_OAM[(i << 2) | 2];
 
-                    std::uint16_t pattern_addr = 0;
-                    int diff_y = scanline - y;
+        // 精灵在左边8像素被裁掉的时候当成没有
+        std::array<std::uint8_t, 256> sprite{};
+        if (IsShowSpriteEnabled())
+        {
+            const auto& sprite_line = GetSpriteLine(scanline);
+            int sprite_start = IsShowSpriteLeftmost8() ? 0 : 8;
+            std::copy(sprite_line.begin() + sprite_start, sprite_line.end(), sprite.begin() + sprite_start);
+        }
 
-                    if ((attribute & 0x40) == 0)
-                        diff_x = 7 - diff_x;
-                    if ((attribute & 0x80) != 0)
-                        diff_y = (IsSpriteSize8x16() ? 15 : 7) - diff_y;
+        // 优先级、调色板镜像和查颜色一起按整行做，调色板索引模式下查出来的是索引
+        bool palette_index_mode = m_device->IsPaletteIndexMode();
+        std::array<std::uint32_t, 0x20> colors;
+        for (std::size_t i = 0; i < colors.size(); i++)
+            colors[i] = palette_index_mode ? (m_palette[i] & 0x3f) : ToScreenColor(DEFAULT_PALETTE[m_palette[i] & 0x3f]);
+        std::array<std::uint32_t, NES_WIDTH> pixels;
+        if (!IsRenderingEnabled())
+            pixels.fill(colors[0]); // 关了渲染的时候整行都是背景色，不用合成
+        else if (m_compose_scanline(background.data(), sprite.data(), colors.data(), pixels.data()) && IsBothBgAndSpEnabled())
+            m_PPUSTATUS |= 0x40;
+        if (palette_index_mode)
+        {
+            m_device->SetIndexLine(scanline, pixels.data());
+            m_device->SetLineEmphasis(scanline, m_PPUMASK >> 5);
+        }
+        else
+            m_device->SetLine(scanline, pixels.data());
 
-                    if (IsSpriteSize8x16())
-                    {
-                        diff_y = (diff_y & 0x07) | ((diff_y & 0x08) << 1);
-                        pattern_addr = ((index >> 1) << 5) + diff_y;
-                        pattern_addr |= (index & 0x01) << 12;
-                    }
-                    else
-                    {
-                        pattern_addr = ((index << 4) | diff_y) | GetSpritePatternTableAddress();
-                    }
+        // 和逐点的一样，放在这一行最后做
+        if (IsShowSpriteEnabled())
+            SpriteEvaluation(scanline + 1);
+    }
 
-                    std::uint8_t color = (PPUBusRead(pattern_addr) >> diff_x) & 0x01;
-                    color |= ((PPUBusRead(pattern_addr + 8) >> diff_x) & 0x01) << 1;
-                    if (color == 0)
-                        continue;
+    void PPU::DrawSpriteLine(int scanline)
+    {
+        // 每个精灵只取一次这一行的图案，按第二OAM的顺序，前面的不透明像素优先
+        m_sprite_line.fill(0);
+        for (int i : m_secondary_OAM)
+        {
+            int x = m_primary_OAM[(i << 2) | 3];
+            int y = m_primary_OAM[(i << 2) | 0] + 1;
+            int index = m_primary_OAM[(i << 2) | 1];
+            int attribute = m_primary_OAM[(i << 2) | 2];
 
-                    color |= ((attribute & 0x03) << 2) | 0x10;
+            std::uint16_t pattern_addr = 0;
+            int diff_y = scanline - y;
+            if ((attribute & 0x80) != 0)
+                diff_y = (IsSpriteSize8x16() ? 15 : 7) - diff_y;
 
-                    if (!IsSprite0Hit() && IsBothBgAndSpEnabled() && i == 0 && !bg_transparent)
-                    {
-                        m_PPUSTATUS |= 0x40;
-                    }
-                    sp_foreground = (attribute & 0x20) == 0;
-                    sprite_color_index = color;
+            if (IsSpriteSize8x16())
+            {
+                diff_y = (diff_y & 0x07) | ((diff_y & 0x08) << 1);
+                pattern_addr = ((index >> 1) << 5) + diff_y;
+                pattern_addr |= (index & 0x01) << 12;
+            }
+            else
+            {
+                pattern_addr = ((index << 4) | diff_y) | GetSpritePatternTableAddress();
+            }
 
-                    break;
+            // 正常的精灵是tile里的一行，直接用解码好的
+            // 帧中间改了OAM的话地址可能超出图案表或者跨到下一个tile，这种和逐点的一样走PPUBusRead
+            bool flip = (attribute & 0x40) != 0;
+            std::array<std::uint8_t, 8> uncached_row;
+            const std::uint8_t* row = nullptr;
+            if (pattern_addr < 0x2000 && (pattern_addr & 0x08) == 0)
+                row = GetTileRow(pattern_addr, flip);
+            else
+            {
+                std::uint8_t pattern_low = PPUBusRead(pattern_addr);
+                std::uint8_t pattern_high = PPUBusRead(pattern_addr + 8);
+                for (int diff_x = 0; diff_x < 8; diff_x++)
+                {
+                    int bit = flip ? diff_x : 7 - diff_x;
+                    uncached_row[diff_x] = ((pattern_low >> bit) & 0x01) | (((pattern_high >> bit) & 0x01) << 1);
                 }
+                row = uncached_row.data();
             }
 
-            if (cycle == 256)
+            std::uint8_t flag = 0x80 | (i == 0 ? 0x40 : 0x00) | ((attribute & 0x20) != 0 ? 0x20 : 0x00) | ((attribute & 0x03) << 2) | 0x10;
+            for (int diff_x = 0; diff_x < 8; diff_x++)
             {
-                // 本来是65~256cycle去做这个事，省了，就在最后一周期搞了，以后有问题以后再说
-                SpriteEvaluation(scanline + 1);
+                int pixel = x + diff_x;
+                if (pixel >= 256)
+                    break;
+                if ((m_sprite_line[pixel] & 0x80) == 0 && row[diff_x] != 0)
+                    m_sprite_line[pixel] = flag | row[diff_x];
             }
         }
 
-        std::uint8_t color_index = 0;
-        if (bg_transparent || sp_foreground)
-            color_index = sprite_color_index;
-        else
-            color_index = background_color_index;
-        
-        m_device->SetPixel(cycle - 1, scanline, GetPalette(color_index & 0x1f) & 0x3f);
+        m_sprite_line_valid = true;
+        m_sprite_line_CHR_generation = m_CHR_map.generation;
     }
 
     void PPU::IncHorizontal()
@@ -343,25 +624,25 @@ namespace nes
     void PPU::FetchingNametable()
     {
         std::uint16_t name_addr = 0x2000 | (m_PPUADDR & 0x0fff);
-        m_nametable = PPUBusRead(name_addr);
+        m_nametable = Nametable(name_addr);
     }
 
     void PPU::FetchingAttribute()
     {
         std::uint16_t attribute_addr = 0x23c0 | (m_PPUADDR & 0x0c00) | ((m_PPUADDR >> 4) & 0x38) | ((m_PPUADDR >> 2) & 0x07);
-        m_attribute_table = PPUBusRead(attribute_addr) >> ((m_PPUADDR >> 4 & 0x04) | (m_PPUADDR & 0x02)) & 0x03;
+        m_attribute_table = Nametable(attribute_addr) >> ((m_PPUADDR >> 4 & 0x04) | (m_PPUADDR & 0x02)) & 0x03;
     }
 
     void PPU::FetchingPatternLow()
     {
         std::uint16_t pattern_address = (static_cast<std::uint16_t>(m_nametable) << 4) | ((m_PPUADDR >> 12) & 0x07) | GetBackgroundPatternTableAddress();
-        m_pattern_low = PPUBusRead(pattern_address);
+        m_pattern_low = ReadCHR(pattern_address);
     }
 
     void PPU::FetchingPatternHigh()
     {
         std::uint16_t pattern_address = (static_cast<std::uint16_t>(m_nametable) << 4) | ((m_PPUADDR >> 12) & 0x07) | GetBackgroundPatternTableAddress() | 0x08;
-        m_pattern_high = PPUBusRead(pattern_address);
+        m_pattern_high = ReadCHR(pattern_address);
     }
 
     void PPU::FetchingData(int cycle)
@@ -441,7 +722,7 @@ namespace nes
             SetPPUCTRL(value);
             break;
         case 1:
-            m_PPUMASK = value;
+            SetPPUMASK(value);
             break;
         case 2:
             // Can not write PPUSTATUS
@@ -465,6 +746,8 @@ namespace nes
             break;
         }
         m_open_bus = value;
+        // 精灵大小、图案表、CHR RAM都可能变了，这一行剩下的精灵重新画
+        m_sprite_line_valid = false;
     }
 
     void PPU::SetPPUCTRL(std::uint8_t value)
@@ -473,13 +756,19 @@ namespace nes
         m_PPUCTRL = value;
         if (IsNMIEnabled() && (m_PPUSTATUS & 0x80) && (!m_has_trigger_NMI || !last_NMI_enable))
         {
-            m_trigger_NMI();
+            m_CPU->Interrupt(CPU6502InterruptType::NMI);
             m_has_trigger_NMI = true;
         }
         m_internal_register_wt &= ~0x0c00;
         m_internal_register_wt |= (value & 0x3) << 10;
     }
 
+    void PPU::SetPPUMASK(std::uint8_t value)
+    {
+        m_PPUMASK = value;
+        m_render_dots = SelectRenderDots(value);
+    }
+
     std::uint8_t PPU::GetPPUSTATUS()
     {
         m_internal_register_wt &= ~0x8000;
@@ -572,33 +861,38 @@ namespace nes
         return res;
     }
 
-    std::uint16_t PPU::GetVRAMAddress(std::uint16_t address)
+    void PPU::SetMirrorType(MirroringType type)
+    {
+        m_mirror_type = type;
+        UpdateNametableMap();
+    }
+
+    void PPU::UpdateNametableMap()
     {
+        // 每个名称表对应的那1KB显存
+        std::array<int, 4> banks{};
         switch (m_mirror_type)
         {
             case MirroringType::Horizontal:
-                if (address >= 0x2400 && address < 0x2c00)
-                    address -= 0x0400;
-                else if (address >= 0x2c00 && address < 0x3000)
-                    address -= 0x0800;
+                banks = { 0, 0, 1, 1 };
                 break;
             case MirroringType::Vertical:
-                if (address >= 0x2800 && address < 0x3000)
-                    address -= 0x0800;
+                banks = { 0, 1, 0, 1 };
                 break;
             case MirroringType::OneScreenLowerBank:
-                address &= 0x3ff;
+                banks = { 0, 0, 0, 0 };
                 break;
             case MirroringType::OneScreenUpperBank:
-                address = (address & 0x3ff) + 0x0400;
+                banks = { 1, 1, 1, 1 };
                 break;
         }
-
-        return address & 0x07ff;
+        for (std::size_t i = 0; i < m_nametables.size(); i++)
+            m_nametables[i] = m_VRAM.get() + banks[i] * 0x0400;
     }
 
     void PPU::OAMDMA(std::uint8_t *data)
     {
+        m_sprite_line_valid = false;
         // 从OAMADDR为起始下标，拷贝256字节
         if (m_OAMADDR == 0)
             std::memcpy(m_primary_OAM.data(), data, 256);
@@ -615,13 +909,13 @@ namespace nes
         {
         case 0x00:  // 地址范围 : [0, 0x1000)
         case 0x01:  // 地址范围 : [0x1000, 0x2000)
-            return m_mapper_read_CHR(address);
+            return ReadCHR(address);
         case 0x02:  // 地址范围 : [0x2000, 0x3000)
             // 名称表0 ：[0x2000, 0x2400)
             // 名称表1 ：[0x2400, 0x2800)
             // 名称表2 ：[0x2800, 0x2C00)
             // 名称表3 ：[0x2C00, 0x3000)
-            return m_VRAM[GetVRAMAddress(address)];
+            return Nametable(address);
         case 0x03:  // 地址范围 : [0x3000, 0x4000)
             if (address < 0x3eff) // [0x2000, 0x2eff)镜像
                 return PPUBusRead(address & 0x2fff);
@@ -639,14 +933,19 @@ namespace nes
         {
         case 0x00:  // 地址范围 : [0, 0x1000)
         case 0x01:  // 地址范围 : [0x1000, 0x2000)
-            m_mapper_write_CHR(address, value);
+            if (auto page = m_CHR_map.write[address >> MEMORY_PAGE_SHIFT]; page != nullptr)
+            {
+                page[address & (MEMORY_PAGE_SIZE - 1)] = value;
+                // 解码过的tile作废
+                m_tile_cache.Invalidate(m_CHR_map.tile[address >> MEMORY_PAGE_SHIFT] + ((address & (MEMORY_PAGE_SIZE - 1)) >> 4));
+            }
             break;
         case 0x02:  // 地址范围 : [0x2000, 0x3000)
             // 名称表0 ：[0x2000, 0x2400)
             // 名称表1 ：[0x2400, 0x2800)
             // 名称表2 ：[0x2800, 0x2C00)
             // 名称表3 ：[0x2C00, 0x3000)
-            m_VRAM[GetVRAMAddress(address)] = value;
+            Nametable(address) = value;
             break;
         case 0x03:  // 地址范围 : [0x3000, 0x4000)
             if (address < 0x3eff) // [0x2000, 0x2eff)镜像
@@ -734,13 +1033,12 @@ namespace nes
         if (data.size() != GetSaveFileSize(version))
             return;
 
-        // PPU重新加载的时候需要清空一下协程
-        Reset();
         auto pointer = data.data();
 
         pointer = UnsafeRead(pointer, m_open_bus);
         pointer = UnsafeRead(pointer, m_PPUCTRL);
         pointer = UnsafeRead(pointer, m_PPUMASK);
+        m_render_dots = SelectRenderDots(m_PPUMASK);
         pointer = UnsafeRead(pointer, m_PPUSTATUS);
         pointer = UnsafeRead(pointer, m_OAMADDR);
         pointer = UnsafeRead(pointer, m_OAMDATA);
@@ -762,6 +1060,7 @@ namespace nes
         pointer = UnsafeRead(pointer, m_frame);
         pointer = UnsafeRead(pointer, m_cycle);
         pointer = UnsafeRead(pointer, m_mirror_type);
+        UpdateNametableMap();
         
         std::size_t secondary_OAM_size;
         pointer = UnsafeRead(pointer, secondary_OAM_size);
@@ -779,8 +1078,9 @@ namespace nes
             pointer = UnsafeRead(pointer, m_VRAM[i]);
         }
 
+        // 存档的时候停在PreRender，从这一行开头重新走到存档的那个点
         auto cycle = m_cycle;
-        for (int c = 0; c < cycle + 1; c++)
-            Step();
+        Reset();
+        Run(static_cast<std::uint32_t>(cycle + 1));
     }
 }
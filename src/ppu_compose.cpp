@@ -0,0 +1,176 @@
+#include "ppu_compose.h"
+
+#if NES_PPU_HAS_SSE2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC和Clang要单独给AVX2的函数打开指令集，MSVC不用
+#if NES_PPU_HAS_SSE2 && (defined(__GNUC__) || defined(_MSC_VER))
+#define NES_PPU_HAS_AVX2 1
+#if defined(__GNUC__)
+#define NES_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define NES_TARGET_AVX2
+#endif
+#else
+#define NES_PPU_HAS_AVX2 0
+#endif
+
+namespace nes
+{
+    namespace
+    {
+        constexpr int SCANLINE_PIXELS = 256;
+
+        bool ComposeScanlineScalar(const std::uint8_t* background, const std::uint8_t* sprite, const std::uint32_t* colors, std::uint32_t* out)
+        {
+            bool sprite0_hit = false;
+            for (int i = 0; i < SCANLINE_PIXELS; i++)
+            {
+                std::uint8_t bg = background[i];
+                std::uint8_t sp = sprite[i];
+                if ((sp & 0x40) != 0 && bg != 0)
+                    sprite0_hit = true;
+
+                std::uint8_t index = (bg == 0 || (sp & 0xa0) == 0x80) ? (sp & 0x1f) : bg;
+                // 调色板镜像，$10/$14/$18/$1C就是$00/$04/$08/$0C
+                if ((index & 0x03) == 0)
+                    index &= 0x0f;
+                out[i] = colors[index];
+            }
+            return sprite0_hit;
+        }
+
+#if NES_PPU_HAS_SSE2
+        // 一次16个像素算出调色板索引，SSE2没有查表的指令，颜色还是一个一个查
+        bool ComposeScanlineSSE2(const std::uint8_t* background, const std::uint8_t* sprite, const std::uint32_t* colors, std::uint32_t* out)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i mask_front = _mm_set1_epi8(static_cast<char>(0xa0));
+            const __m128i sprite_front = _mm_set1_epi8(static_cast<char>(0x80));
+            const __m128i mask_sprite0 = _mm_set1_epi8(0x40);
+            const __m128i mask_index = _mm_set1_epi8(0x1f);
+            const __m128i mask_low = _mm_set1_epi8(0x03);
+            const __m128i mask_mirror = _mm_set1_epi8(0x10);
+
+            int sprite0_hit = 0;
+            alignas(16) std::uint8_t indices[16];
+            for (int i = 0; i < SCANLINE_PIXELS; i += 16)
+            {
+                __m128i bg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + i));
+                __m128i sp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprite + i));
+
+                __m128i bg_transparent = _mm_cmpeq_epi8(bg, zero);
+                __m128i use_sprite = _mm_or_si128(bg_transparent, _mm_cmpeq_epi8(_mm_and_si128(sp, mask_front), sprite_front));
+                __m128i index = _mm_or_si128(_mm_and_si128(use_sprite, _mm_and_si128(sp, mask_index)), _mm_andnot_si128(use_sprite, bg));
+                __m128i mirror = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(index, mask_low), zero), mask_mirror);
+                index = _mm_andnot_si128(mirror, index);
+
+                __m128i hit = _mm_andnot_si128(bg_transparent, _mm_cmpeq_epi8(_mm_and_si128(sp, mask_sprite0), mask_sprite0));
+                sprite0_hit |= _mm_movemask_epi8(hit);
+
+                _mm_store_si128(reinterpret_cast<__m128i*>(indices), index);
+                for (int j = 0; j < 16; j++)
+                    out[i + j] = colors[indices[j]];
+            }
+            return sprite0_hit != 0;
+        }
+#endif
+
+#if NES_PPU_HAS_AVX2
+        // 一次32个像素，颜色用gather一次查8个
+        NES_TARGET_AVX2 bool ComposeScanlineAVX2(const std::uint8_t* background, const std::uint8_t* sprite, const std::uint32_t* colors, std::uint32_t* out)
+        {
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i mask_front = _mm256_set1_epi8(static_cast<char>(0xa0));
+            const __m256i sprite_front = _mm256_set1_epi8(static_cast<char>(0x80));
+            const __m256i mask_sprite0 = _mm256_set1_epi8(0x40);
+            const __m256i mask_index = _mm256_set1_epi8(0x1f);
+            const __m256i mask_low = _mm256_set1_epi8(0x03);
+            const __m256i mask_mirror = _mm256_set1_epi8(0x10);
+            const int* table = reinterpret_cast<const int*>(colors);
+
+            int sprite0_hit = 0;
+            for (int i = 0; i < SCANLINE_PIXELS; i += 32)
+            {
+                __m256i bg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(background + i));
+                __m256i sp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sprite + i));
+
+                __m256i bg_transparent = _mm256_cmpeq_epi8(bg, zero);
+                __m256i use_sprite = _mm256_or_si256(bg_transparent, _mm256_cmpeq_epi8(_mm256_and_si256(sp, mask_front), sprite_front));
+                __m256i index = _mm256_blendv_epi8(bg, _mm256_and_si256(sp, mask_index), use_sprite);
+                __m256i mirror = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(index, mask_low), zero), mask_mirror);
+                index = _mm256_andnot_si256(mirror, index);
+
+                __m256i hit = _mm256_andnot_si256(bg_transparent, _mm256_cmpeq_epi8(_mm256_and_si256(sp, mask_sprite0), mask_sprite0));
+                sprite0_hit |= _mm256_movemask_epi8(hit);
+
+                __m128i low = _mm256_castsi256_si128(index);
+                __m128i high = _mm256_extracti128_si256(index, 1);
+                __m256i color0 = _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(low), 4);
+                __m256i color1 = _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)), 4);
+                __m256i color2 = _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(high), 4);
+                __m256i color3 = _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)), 4);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), color0);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 8), color1);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 16), color2);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 24), color3);
+            }
+            return sprite0_hit != 0;
+        }
+
+        bool IsAVX2Supported()
+        {
+#if defined(__GNUC__)
+            return __builtin_cpu_supports("avx2");
+#else
+            // CPUID.7.0:EBX第5位是AVX2，还要操作系统保存了YMM寄存器
+            int info[4];
+            __cpuid(info, 1);
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+            if (!osxsave || !avx || (_xgetbv(0) & 0x06) != 0x06)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#endif
+        }
+#endif
+    }
+
+    ComposeKernel GetBestComposeKernel()
+    {
+#if NES_PPU_HAS_AVX2
+        if (IsAVX2Supported())
+            return ComposeKernel::AVX2;
+#endif
+#if NES_PPU_HAS_SSE2
+        return ComposeKernel::SSE2;
+#else
+        return ComposeKernel::Scalar;
+#endif
+    }
+
+    ComposeScanlineFunc GetComposeScanline(ComposeKernel kernel)
+    {
+        switch (kernel)
+        {
+        case ComposeKernel::Scalar:
+            return ComposeScanlineScalar;
+#if NES_PPU_HAS_SSE2
+        case ComposeKernel::SSE2:
+            return ComposeScanlineSSE2;
+#endif
+#if NES_PPU_HAS_AVX2
+        case ComposeKernel::AVX2:
+            return IsAVX2Supported() ? ComposeScanlineAVX2 : nullptr;
+#endif
+        default:
+            break;
+        }
+        return nullptr;
+    }
+}
@@ -0,0 +1,46 @@
+#include "scheduler.h"
+
+namespace nes
+{
+    Scheduler::Scheduler()
+    {
+        m_deadline.fill(NO_EVENT);
+    }
+
+    void Scheduler::Reset()
+    {
+        m_timestamp = 0;
+        m_deadline.fill(NO_EVENT);
+        m_queue = {};
+    }
+
+    void Scheduler::Schedule(SchedulerEvent event, std::uint64_t timestamp)
+    {
+        auto& deadline = m_deadline[static_cast<int>(event)];
+        if (deadline == timestamp)
+            return;
+        deadline = timestamp;
+        m_queue.push({ timestamp, event });
+    }
+
+    void Scheduler::Cancel(SchedulerEvent event)
+    {
+        m_deadline[static_cast<int>(event)] = NO_EVENT;
+    }
+
+    std::optional<ScheduledEvent> Scheduler::PopDueEvent(std::uint64_t until)
+    {
+        while (!m_queue.empty() && m_queue.top().timestamp < until)
+        {
+            auto entry = m_queue.top();
+            m_queue.pop();
+
+            auto& deadline = m_deadline[static_cast<int>(entry.event)];
+            if (deadline != entry.timestamp)
+                continue;
+            deadline = NO_EVENT;
+            return entry;
+        }
+        return std::nullopt;
+    }
+}
@@ -184,23 +184,38 @@ bool SDLApplication::Init(int width, int height)
     m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TextureAccess::SDL_TEXTUREACCESS_STREAMING, nes::NES_WIDTH, nes::NES_HEIGHT);
 
     // 音频相关部分。如果这部分初始化失败了就不播放声音。
-    SDL_AudioSpec spec
+    // 格式用设置的，采样率声卡不支持的话用声卡给的，模拟器按实际的采样率合成
+    SDL_AudioSpec desired
     {
-        .freq = nes::AUDIO_FREQ,
-        .format = AUDIO_U8,
+        .freq = m_device->GetAudioSampleRate(),
+        .format = AUDIO_S16SYS,
         .channels = 1,
         .silence = 0,
         .samples = nes::AUDIO_BUFFER_SAMPLES,
         .userdata = this,
     };
-    spec.callback = [](void* userdata, Uint8* stream, int len)->void
+    switch (m_device->GetAudioFormat())
+    {
+    case nes::AudioFormat::U8:
+        desired.format = AUDIO_U8;
+        break;
+    case nes::AudioFormat::F32:
+        desired.format = AUDIO_F32SYS;
+        break;
+    default:
+        break;
+    }
+    desired.callback = [](void* userdata, Uint8* stream, int len)->void
     {
         static_cast<SDLApplication*>(userdata)->FillAudioBuffer(stream, len);
     };
 
-    if (SDL_OpenAudio(&spec, nullptr) == 0)
+    SDL_AudioSpec obtained{};
+    m_audio_device = SDL_OpenAudioDevice(nullptr, 0, &desired, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (m_audio_device != 0)
     {
-        SDL_PauseAudio(0);
+        m_device->SetAudioFormat(m_device->GetAudioFormat(), obtained.freq);
+        SDL_PauseAudioDevice(m_audio_device, 0);
     }
 
     // 初始化手柄
@@ -380,7 +395,8 @@ void SDLApplication::Terminate()
         SDL_JoystickClose(m_joysticks[0].joy);
     if (m_joysticks[1].joy != nullptr)
         SDL_JoystickClose(m_joysticks[1].joy);
-    SDL_CloseAudio();
+    if (m_audio_device != 0)
+        SDL_CloseAudioDevice(m_audio_device);
     SDL_DestroyRenderer(m_renderer);
     SDL_DestroyTexture(m_texture);
     SDL_DestroyWindow(m_window);
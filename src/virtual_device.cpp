@@ -1,12 +1,45 @@
 #include "virtual_device.h"
 #include "palette.h"
 #include <assert.h>
+#include <cstring>
+#include <algorithm>
 
 namespace nes
 {
+    namespace
+    {
+        // 强调位每有一位，另外两种颜色就变暗一点
+        constexpr double EMPHASIS_ATTENUATION = 0.816328;
+
+        // 8种强调位组合 x 64种颜色，下标是(强调位 << 6) | 调色板索引
+        std::array<std::uint32_t, 8 * PALETTE_COUNT> MakeEmphasisPalette()
+        {
+            std::array<std::uint32_t, 8 * PALETTE_COUNT> res{};
+            for (int emphasis = 0; emphasis < 8; emphasis++)
+            {
+                double r_scale = 1.0, g_scale = 1.0, b_scale = 1.0;
+                if (emphasis & 0x01) { g_scale *= EMPHASIS_ATTENUATION; b_scale *= EMPHASIS_ATTENUATION; }
+                if (emphasis & 0x02) { r_scale *= EMPHASIS_ATTENUATION; b_scale *= EMPHASIS_ATTENUATION; }
+                if (emphasis & 0x04) { r_scale *= EMPHASIS_ATTENUATION; g_scale *= EMPHASIS_ATTENUATION; }
+
+                for (int i = 0; i < PALETTE_COUNT; i++)
+                {
+                    PaletteColor color = DEFAULT_PALETTE[i];
+                    color.r = static_cast<std::uint8_t>(color.r * r_scale + 0.5);
+                    color.g = static_cast<std::uint8_t>(color.g * g_scale + 0.5);
+                    color.b = static_cast<std::uint8_t>(color.b * b_scale + 0.5);
+                    res[(emphasis << 6) | i] = ToScreenColor(color);
+                }
+            }
+            return res;
+        }
+    }
+
     void VirtualDevice::ApplicationUpdate()
     {
         m_write_screen_finish.wait(false);
+        if (m_palette_index_mode)
+            ConvertIndexScreen();
         m_app_update_callback(m_screen.data());
         m_write_screen_finish.store(false);
     }
@@ -80,37 +113,65 @@ namespace nes
         m_write_screen_finish.notify_one();
     }
 
-    void VirtualDevice::FillAudioSamples(unsigned char* stream, int len)
+    std::size_t VirtualDevice::GetAudioSampleSize() const noexcept
     {
-        if (m_audio_samples.size() > 1)
+        switch (m_audio_format)
         {
-            std::lock_guard<std::mutex> lock(m_audio_mutex);
-            for (int i = 0; i < len; i++)
-            {
-                stream[i] = m_audio_samples.front().data[i];
-            }
-            m_garbage_audio_samples.splice(m_garbage_audio_samples.cend(), m_audio_samples, m_audio_samples.cbegin());
+        case AudioFormat::U8:
+            return sizeof(std::uint8_t);
+        case AudioFormat::F32:
+            return sizeof(float);
+        default:
+            return sizeof(std::int16_t);
         }
     }
 
-    void VirtualDevice::PutAudioSample(std::uint8_t sample)
+    void VirtualDevice::FillAudioSamples(unsigned char* stream, int len)
     {
-        if (m_audio_samples.empty() || m_audio_samples.back().index >= AUDIO_BUFFER_SAMPLES)
+        std::size_t sample_size = GetAudioSampleSize();
+        std::size_t count = static_cast<std::size_t>(std::max(len, 0)) / sample_size;
+        if (count == 0)
+            return;
+
+        // 只有音频线程取，看到够了的话后面分几次取一定取得到
+        bool underrun = m_audio_samples.GetSize() < count;
+        if (underrun)
+            m_audio_underrun_count.fetch_add(1, std::memory_order_relaxed);
+
+        std::array<std::int16_t, 256> samples;
+        for (std::size_t offset = 0; offset < count; offset += samples.size())
         {
-            // 添加新的buffer放在这
-            std::lock_guard<std::mutex> lock(m_audio_mutex);
-            if (!m_garbage_audio_samples.empty())
-            {
-                m_audio_samples.splice(m_audio_samples.cend(), m_garbage_audio_samples, m_garbage_audio_samples.cbegin());
-                m_audio_samples.back().index = 0;
-            }
+            std::size_t n = std::min(samples.size(), count - offset);
+            if (underrun)
+                std::fill_n(samples.begin(), n, m_last_audio_sample);
             else
+                m_audio_samples.PopExactly(samples.data(), n);
+
+            auto out = stream + offset * sample_size;
+            switch (m_audio_format)
             {
-                m_audio_samples.push_back(AudioSamples{});
+            case AudioFormat::U8:
+                for (std::size_t i = 0; i < n; i++)
+                    out[i] = static_cast<std::uint8_t>((samples[i] >> 8) + 128);
+                break;
+            case AudioFormat::F32:
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    float value = samples[i] / 32768.0f;
+                    std::memcpy(out + i * sizeof(float), &value, sizeof(float));
+                }
+                break;
+            default:
+                std::memcpy(out, samples.data(), n * sizeof(std::int16_t));
+                break;
             }
+            m_last_audio_sample = samples[n - 1];
         }
-        auto& container = m_audio_samples.back();
-        container.data[container.index++] = sample;
+    }
+
+    void VirtualDevice::PutAudioSamples(const std::int16_t* samples, std::size_t count)
+    {
+        m_audio_samples.Push(samples, count);
     }
 
     void VirtualDevice::Write4016(std::uint8_t val)
@@ -157,6 +218,12 @@ namespace nes
         assert(palette_index >= 0);
         assert(palette_index < PALETTE_COUNT);
 
+        if (m_palette_index_mode)
+        {
+            m_index_screen[y * NES_WIDTH + x] = static_cast<std::uint8_t>(palette_index);
+            return;
+        }
+
         int index = (y * NES_WIDTH + x) * 4;
         PaletteColor color = DEFAULT_PALETTE[palette_index];
 
@@ -165,4 +232,45 @@ namespace nes
         m_screen[index + 2ull] = color.r;
         m_screen[index + 3ull] = color.a;
     }
+
+    void VirtualDevice::ConvertIndexScreen()
+    {
+        static const auto EMPHASIS_PALETTE = MakeEmphasisPalette();
+
+        std::array<std::uint32_t, NES_WIDTH> line;
+        for (int y = 0; y < NES_HEIGHT; y++)
+        {
+            const auto* palette = EMPHASIS_PALETTE.data() + (m_line_emphasis[y] << 6);
+            const auto* indices = m_index_screen.data() + y * NES_WIDTH;
+            for (int x = 0; x < NES_WIDTH; x++)
+                line[x] = palette[indices[x]];
+            std::memcpy(m_screen.data() + y * NES_WIDTH * 4, line.data(), NES_WIDTH * 4);
+        }
+    }
+
+    void VirtualDevice::SetLine(int y, const std::uint32_t* colors)
+    {
+        assert(y >= 0);
+        assert(y < NES_HEIGHT);
+
+        std::memcpy(m_screen.data() + y * NES_WIDTH * 4, colors, NES_WIDTH * 4);
+    }
+
+    void VirtualDevice::SetIndexLine(int y, const std::uint32_t* indices)
+    {
+        assert(y >= 0);
+        assert(y < NES_HEIGHT);
+
+        auto line = m_index_screen.data() + y * NES_WIDTH;
+        for (int x = 0; x < NES_WIDTH; x++)
+            line[x] = static_cast<std::uint8_t>(indices[x]);
+    }
+
+    void VirtualDevice::SetLineEmphasis(int y, std::uint8_t emphasis)
+    {
+        assert(y >= 0);
+        assert(y < NES_HEIGHT);
+
+        m_line_emphasis[y] = emphasis & 0x07;
+    }
 }